@@ -2,3 +2,7 @@
 # Component Makefile
 #
 
+# Logging above CONFIG_EXTFLASH_LOG_LEVEL is compiled out, see Kconfig
+ifdef CONFIG_EXTFLASH_LOG_LEVEL
+CXXFLAGS += -DLOG_LOCAL_LEVEL=$(CONFIG_EXTFLASH_LOG_LEVEL)
+endif
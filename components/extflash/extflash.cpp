@@ -12,10 +12,17 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <string.h>
+
 #include "esp_err.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "esp_timer.h"
+#include "mbedtls/sha256.h"
+#include "rom/crc.h"
+#include "soc/soc_memory_layout.h"
 
 #include "extflash.h"
 
@@ -24,13 +31,92 @@ static const char *TAG = "extflash";
 ExtFlash::ExtFlash()
 {
     spi = NULL;
+    spibus = NULL;
 
     capacity = 0;
     sector_sz = 0;
 
+    for (int i = 0; i < max_erase_types; i++)
+    {
+        erase_types[i] = {};
+    }
+    chip_erase_us = 0;
+
+    for (int i = 0; i < max_read_types; i++)
+    {
+        read_types[i] = {};
+    }
+    quad_enable_req = 0xff;
+    qpi_enter_inst = 0;
+    qpi_exit_inst = 0;
+
+    tflags = 0;
+    is_qpi = false;
+    read_mode = -1;
+
+    addr_bits = 24;
+    addr4_mode = false;
+    addr4_insts = false;
+    addr4_only = false;
+    addr4_enter = 0;
+    bait_insts = 0;
+    for (int i = 0; i < max_erase_types; i++)
+    {
+        bait_erase[i] = 0;
+    }
+
     trans = NULL;
     queued = 0;
     qnext = 0;
+
+    completions = NULL;
+    issued = 0;
+    completed = 0;
+
+    bus_lock = NULL;
+    op_lock = NULL;
+    erasing = false;
+    eraser = NULL;
+
+    op_pending = false;
+    op_addr = 0;
+    op_size = 0;
+    op_start = 0;
+    op_estimate = NULL;
+    busy_addr = 0;
+    busy_size = 0;
+
+    sched_lock = NULL;
+    sched_free = NULL;
+    for (int i = 0; i < max_requesters; i++)
+    {
+        requesters[i] = {};
+    }
+    bus_busy = false;
+    bus_priority = 0;
+    sched_seq = 0;
+
+    crm_session = false;
+    crm_inst = 0;
+    crm_off = 0;
+    crm_dummy = 0;
+    crm_flags = 0;
+
+    cache = NULL;
+    ahead = NULL;
+    pool = NULL;
+
+    nstaged = 0;
+    staging = false;
+
+    bounce_bufs = NULL;
+    bounce_free = 0;
+    nbounce = 0;
+
+    stats = {};
+
+    status_buf = NULL;
+    tpp_us = default_tpp_us;
 }
 
 ExtFlash::~ExtFlash()
@@ -38,23 +124,103 @@ ExtFlash::~ExtFlash()
     if (spi)
     {
         spi_bus_remove_device(spi);
-        spi_bus_free(bus);
+        spibus->detach();
     }
 
     if (trans)
     {
         delete [] trans;
     }
+
+    if (completions)
+    {
+        delete [] completions;
+    }
+
+    if (status_buf)
+    {
+        heap_caps_free(status_buf);
+    }
+
+    if (bounce_bufs)
+    {
+        heap_caps_free(bounce_bufs);
+    }
+
+    if (bus_lock)
+    {
+        vSemaphoreDelete(bus_lock);
+    }
+
+    if (op_lock)
+    {
+        vSemaphoreDelete(op_lock);
+    }
+
+    if (sched_lock)
+    {
+        vSemaphoreDelete(sched_lock);
+    }
+
+    if (sched_free)
+    {
+        vSemaphoreDelete(sched_free);
+    }
+
+    for (int i = 0; i < max_requesters; i++)
+    {
+        if (requesters[i].wake)
+        {
+            vSemaphoreDelete(requesters[i].wake);
+        }
+    }
 }
 
 esp_err_t ExtFlash::init(const ext_flash_config_t *config)
 {
     ESP_LOGD(TAG, "%s", __func__);
 
+    ext_flash_bus_config_t buscfg =
+    {
+        .vspi = config->vspi,
+        .sck_io_num = config->sck_io_num,
+        .miso_io_num = config->miso_io_num,
+        .mosi_io_num = config->mosi_io_num,
+        .hd_io_num = config->hd_io_num,
+        .wp_io_num = config->wp_io_num,
+        .dma_channel = config->dma_channel,
+        .max_dma_size = config->max_dma_size
+    };
+
+    esp_err_t err = own_bus.init(&buscfg);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    return init(&own_bus, config);
+}
+
+// Add the chip to a bus that's been initialized already, which takes the
+// place of the bus settings in the config
+esp_err_t ExtFlash::init(ExtFlashBus *spibus, const ext_flash_config_t *config)
+{
+    ESP_LOGD(TAG, "%s - ss_io_num=%d", __func__, config->ss_io_num);
+
     esp_err_t err;
 
     cfg = *config;
 
+    const ext_flash_bus_config_t *buscfg = spibus->config();
+    cfg.vspi = buscfg->vspi;
+    cfg.sck_io_num = buscfg->sck_io_num;
+    cfg.miso_io_num = buscfg->miso_io_num;
+    cfg.mosi_io_num = buscfg->mosi_io_num;
+    cfg.hd_io_num = buscfg->hd_io_num;
+    cfg.wp_io_num = buscfg->wp_io_num;
+    cfg.dma_channel = buscfg->dma_channel;
+    cfg.max_dma_size = buscfg->max_dma_size;
+
     if ((cfg.sector_size != 0) + (cfg.capacity != 0) == 1)
     {
         ESP_LOGE(TAG, "sector_size and capacticy config values must both be set (or neither)");
@@ -73,28 +239,6 @@ esp_err_t ExtFlash::init(const ext_flash_config_t *config)
         return ESP_ERR_INVALID_ARG;
     }
 
-    if (cfg.dma_channel != 1 && cfg.dma_channel != 2)
-    {
-        ESP_LOGE(TAG, "dma_channel config value must either 1 or 2");
-        return ESP_ERR_INVALID_ARG;
-    }
-
-    if ((cfg.hd_io_num != -1) + (cfg.wp_io_num != -1) == 1)
-    {
-        ESP_LOGE(TAG, "hd_io_num and wp_io_num config values must both be set");
-        return ESP_ERR_INVALID_ARG;
-    }
-
-    spi_bus_config_t buscfg =
-    {
-        .mosi_io_num = cfg.mosi_io_num,
-        .miso_io_num = cfg.miso_io_num,
-        .sclk_io_num = cfg.sck_io_num,
-        .quadwp_io_num = cfg.wp_io_num,
-        .quadhd_io_num = cfg.hd_io_num,
-        .max_transfer_sz = cfg.max_dma_size ? cfg.max_dma_size : SPI_MAX_DMA_LEN
-    };
-
     spi_device_interface_config_t devcfg =
     {
         .command_bits = 8,
@@ -112,7 +256,8 @@ esp_err_t ExtFlash::init(const ext_flash_config_t *config)
         .post_cb = NULL
     };
 
-    bus = cfg.vspi ? VSPI_HOST : HSPI_HOST;
+    this->spibus = spibus;
+    bus = spibus->host();
 
     trans = new spi_transaction_ext_t[cfg.queue_size];
     if (trans == NULL)
@@ -120,18 +265,85 @@ esp_err_t ExtFlash::init(const ext_flash_config_t *config)
         return ESP_ERR_NO_MEM;
     }
 
-    err = spi_bus_initialize(bus, &buscfg, cfg.dma_channel);
+    completions = new completion_t[cfg.queue_size]();
+    if (completions == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    status_buf = (uint8_t *) heap_caps_malloc(status_burst, MALLOC_CAP_DMA);
+    if (status_buf == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    nbounce = cfg.bounce_buffers == 0 ? default_bounce_buffers : cfg.bounce_buffers;
+    if (nbounce < 0)
+    {
+        nbounce = 0;
+    }
+    if (nbounce > cfg.queue_size)
+    {
+        nbounce = cfg.queue_size;
+    }
+    if (nbounce > max_bounce_buffers)
+    {
+        nbounce = max_bounce_buffers;
+    }
+
+    if (nbounce > 0)
+    {
+        bounce_bufs = (uint8_t *) heap_caps_malloc(nbounce * cfg.max_dma_size, MALLOC_CAP_DMA);
+        if (bounce_bufs == NULL)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    bounce_free = (uint32_t) ((1ull << nbounce) - 1);
+    stats = {};
+
+    bus_lock = xSemaphoreCreateMutex();
+    op_lock = xSemaphoreCreateMutex();
+    if (bus_lock == NULL || op_lock == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    err = bus_sleeper.init();
+    if (err == ESP_OK)
+    {
+        err = op_sleeper.init();
+    }
     if (err != ESP_OK)
     {
         return err;
     }
 
+    if (cfg.scheduler)
+    {
+        sched_lock = xSemaphoreCreateMutex();
+        sched_free = xSemaphoreCreateCounting(max_requesters, max_requesters);
+        if (sched_lock == NULL || sched_free == NULL)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+
+        for (int i = 0; i < max_requesters; i++)
+        {
+            requesters[i].wake = xSemaphoreCreateBinary();
+            if (requesters[i].wake == NULL)
+            {
+                return ESP_ERR_NO_MEM;
+            }
+        }
+    }
+
     err = spi_bus_add_device(bus, &devcfg, &spi);
     if (err != ESP_OK)
     {
-        spi_bus_free(bus);
         return err;
     }
+    spibus->attach();
 
     set_1_1_1();
 
@@ -157,30 +369,108 @@ void ExtFlash::term()
         spi_bus_remove_device(spi);
         spi = NULL;
 
-        spi_bus_free(bus);
+        spibus->detach();
     }
 
+    own_bus.term();
+    spibus = NULL;
+
+    cache = NULL;
+    ahead = NULL;
+    pool = NULL;
+
     if (trans)
     {
         delete [] trans;
         trans = NULL;
     }
+
+    if (completions)
+    {
+        delete [] completions;
+        completions = NULL;
+    }
+
+    if (status_buf)
+    {
+        heap_caps_free(status_buf);
+        status_buf = NULL;
+    }
+
+    if (bounce_bufs)
+    {
+        heap_caps_free(bounce_bufs);
+        bounce_bufs = NULL;
+    }
+    bounce_free = 0;
+    nbounce = 0;
+
+    if (bus_lock)
+    {
+        vSemaphoreDelete(bus_lock);
+        bus_lock = NULL;
+    }
+
+    if (op_lock)
+    {
+        vSemaphoreDelete(op_lock);
+        op_lock = NULL;
+    }
+
+    if (sched_lock)
+    {
+        vSemaphoreDelete(sched_lock);
+        sched_lock = NULL;
+    }
+
+    if (sched_free)
+    {
+        vSemaphoreDelete(sched_free);
+        sched_free = NULL;
+    }
+
+    for (int i = 0; i < max_requesters; i++)
+    {
+        if (requesters[i].wake)
+        {
+            vSemaphoreDelete(requesters[i].wake);
+        }
+        requesters[i] = {};
+    }
+    bus_busy = false;
+
+    bus_sleeper.term();
+    op_sleeper.term();
 }
 
-spi_transaction_ext_t *ExtFlash::cmd_prolog()
+spi_transaction_ext_t *ExtFlash::cmd_prolog(uint8_t cmd)
 {
     spi_transaction_ext_t *t = NULL;
 
+    // Anything but a continued read has to get the chip out of CRM first,
+    // except when staging since that's checked when submitting
+    if (cmd != 0 && crm_inst != 0 && !staging)
+    {
+        crm_exit();
+    }
+
+    if (staging)
+    {
+        t = &staged[nstaged];
+        *t = {};
+
+        return t;
+    }
+
     if (queued == cfg.queue_size)
     {
-        spi_transaction_t *done;
-        ESP_ERROR_CHECK(spi_device_get_trans_result(spi, &done, portMAX_DELAY));
-        queued--;
+        reap(portMAX_DELAY);
     }
     qnext = (qnext + 1) % cfg.queue_size;
 
     t = &trans[qnext];
     *t = {};
+    completions[qnext] = {};
 
     return t;
 }
@@ -198,21 +488,157 @@ void ExtFlash::cmd_epilog(spi_transaction_ext_t *t, uint8_t *buf, size_t size, b
         t->base.length = size * 8;
     }
 
-    queued++;
-    ESP_ERROR_CHECK(spi_device_queue_trans(spi, &t->base, portMAX_DELAY));
+    cmd_epilog(t);
 }
 
 void ExtFlash::cmd_epilog(spi_transaction_ext_t *t)
 {
+    if (staging)
+    {
+        nstaged++;
+        return;
+    }
+
+    size_t len = (t->base.rxlength > 0 ? t->base.rxlength : t->base.length) / 8;
+    if (queued == 0 && len <= max_polled)
+    {
+        transmit_polled(t);
+        return;
+    }
+
+    bounce(t);
+
     queued++;
+    issued++;
     ESP_ERROR_CHECK(spi_device_queue_trans(spi, &t->base, portMAX_DELAY));
 }
 
+// With nothing queued, a short transaction is cheaper to spin on than to
+// queue and then sleep until its interrupt wakes the task.  Data that fits
+// goes in the transaction itself, the rest through the usual bounce checks.
+void ExtFlash::transmit_polled(spi_transaction_ext_t *t)
+{
+    spi_transaction_t *b = &t->base;
+    uint8_t *dest = NULL;
+    size_t size = b->rxlength / 8;
+
+    if (size > 0 && size <= 4 && !(b->flags & SPI_TRANS_USE_RXDATA))
+    {
+        dest = (uint8_t *) b->rx_buffer;
+        b->flags |= SPI_TRANS_USE_RXDATA;
+    }
+    else if (b->length > 0 && b->length <= 32 && !(b->flags & SPI_TRANS_USE_TXDATA))
+    {
+        uint8_t data[4];
+        memcpy(data, b->tx_buffer, b->length / 8);
+        memcpy(b->tx_data, data, b->length / 8);
+        b->flags |= SPI_TRANS_USE_TXDATA;
+    }
+    else
+    {
+        bounce(t);
+    }
+
+    issued++;
+    ESP_ERROR_CHECK(spi_device_polling_transmit(spi, b));
+    completed++;
+    stats.polled++;
+
+    if (dest)
+    {
+        memcpy(dest, b->rx_data, size);
+    }
+    unbounce(&completions[t - trans]);
+}
+
+void ExtFlash::unbounce(completion_t *c)
+{
+    if (c->bounce)
+    {
+        if (c->dest)
+        {
+            memcpy(c->dest, c->bounce, c->size);
+            c->dest = NULL;
+        }
+        bounce_free |= 1u << ((c->bounce - bounce_bufs) / cfg.max_dma_size);
+        c->bounce = NULL;
+    }
+}
+
+// Point a transfer the SPI DMA can't reach, or that it would read into
+// whole words past the end of, at a bounce buffer instead of leaving the
+// driver to allocate one for it.  Bounced reads are rounded up to whole
+// words, the chip just clocks out a few more bytes, and copied out when
+// reaped.
+void ExtFlash::bounce(spi_transaction_ext_t *t)
+{
+    spi_transaction_t *b = &t->base;
+    bool isread = b->rxlength > 0;
+    uint8_t *buf;
+    size_t size;
+
+    if (isread)
+    {
+        buf = (b->flags & SPI_TRANS_USE_RXDATA) ? NULL : (uint8_t *) b->rx_buffer;
+        size = b->rxlength / 8;
+    }
+    else
+    {
+        buf = (b->flags & SPI_TRANS_USE_TXDATA) ? NULL : (uint8_t *) b->tx_buffer;
+        size = b->length / 8;
+    }
+
+    if (buf == NULL || size == 0)
+    {
+        return;
+    }
+
+    if (esp_ptr_dma_capable(buf) && ((uintptr_t) buf & 3) == 0 && (!isread || (size & 3) == 0))
+    {
+        stats.zero_copy++;
+        return;
+    }
+
+    if (nbounce == 0 || size > (size_t) cfg.max_dma_size)
+    {
+        return;
+    }
+
+    while (bounce_free == 0)
+    {
+        stats.bounce_waits++;
+        reap(portMAX_DELAY);
+    }
+
+    int i = __builtin_ctz(bounce_free);
+    bounce_free &= ~(1u << i);
+
+    completion_t *c = &completions[t - trans];
+    c->bounce = &bounce_bufs[i * cfg.max_dma_size];
+    c->size = size;
+
+    if (isread)
+    {
+        c->dest = buf;
+        b->rx_buffer = c->bounce;
+        b->rxlength = ((size + 3) & ~3) * 8;
+    }
+    else
+    {
+        memcpy(c->bounce, buf, size);
+        b->tx_buffer = c->bounce;
+    }
+
+    stats.bounced++;
+}
+
 void ExtFlash::cmd(bool isread, uint8_t cmd, int64_t addr, uint8_t mode, uint8_t dummy, uint8_t *buf, size_t size)
 {
     ESP_LOGV(TAG, "%s - isread=%d cmd=0x%02x addr=0x%08llx mode=0x%02x dummy=%d size=%d", __func__, isread, cmd, addr, mode, dummy, size);
 
-    spi_transaction_ext_t *t = cmd_prolog();
+    cmd = addr_inst(cmd);
+
+    spi_transaction_ext_t *t = cmd_prolog(cmd);
 
     if (is_qpi)
     {
@@ -220,15 +646,15 @@ void ExtFlash::cmd(bool isread, uint8_t cmd, int64_t addr, uint8_t mode, uint8_t
                         SPI_TRANS_VARIABLE_ADDR |
                         SPI_TRANS_MODE_QIO |
                         SPI_TRANS_MODE_DIOQIO_ADDR;
-        t->base.addr = ((((cmd << 24) | addr) << 8) | mode) << dummy;
-        t->address_bits = (cmd ? 8 : 0) + 24 + 8 + dummy;
+        t->base.addr = (((((int64_t) cmd << addr_bits) | addr) << 8) | mode) << dummy;
+        t->address_bits = (cmd ? 8 : 0) + addr_bits + 8 + dummy;
     }
     else
     {
         t->base.flags = tflags;
         t->base.cmd = cmd;
         t->base.addr = ((addr << 8) | mode) << dummy;
-        t->address_bits = 24 + 8 + dummy;
+        t->address_bits = addr_bits + 8 + dummy;
         t->command_bits = (cmd ? 8 : 0);
     }
 
@@ -239,7 +665,9 @@ void ExtFlash::cmd(bool isread, uint8_t cmd, int64_t addr, uint8_t dummy, uint8_
 {
     ESP_LOGV(TAG, "%s - isread=%d cmd=0x%02x addr=0x%08llx dummy=%d size=%d", __func__, isread, cmd, addr, dummy, size);
 
-    spi_transaction_ext_t *t = cmd_prolog();
+    cmd = addr_inst(cmd);
+
+    spi_transaction_ext_t *t = cmd_prolog(cmd);
 
     if (is_qpi)
     {
@@ -247,15 +675,16 @@ void ExtFlash::cmd(bool isread, uint8_t cmd, int64_t addr, uint8_t dummy, uint8_
                         SPI_TRANS_VARIABLE_ADDR |
                         SPI_TRANS_MODE_QIO |
                         SPI_TRANS_MODE_DIOQIO_ADDR;
-        t->base.addr = ((cmd << 24) | addr) << dummy;
-        t->address_bits = 8 + 24 + dummy;
+        t->base.addr = (((int64_t) cmd << addr_bits) | addr) << dummy;
+        t->address_bits = 8 + addr_bits + dummy;
     }
     else
     {
         t->base.flags = tflags;
         t->base.cmd = cmd;
         t->base.addr = addr << dummy;
-        t->address_bits = 24 + dummy;
+        t->address_bits = addr_bits + dummy;
+        t->command_bits = 8;
     }
 
     cmd_epilog(t, buf, size, isread);
@@ -265,7 +694,9 @@ void ExtFlash::cmd(bool isread, uint8_t cmd, int64_t addr, uint8_t *buf, size_t
 {
     ESP_LOGV(TAG, "%s - isread=%d cmd=0x%02x addr=0x%08llx size=%d", __func__, isread, cmd, addr, size);
 
-    spi_transaction_ext_t *t = cmd_prolog();
+    cmd = addr_inst(cmd);
+
+    spi_transaction_ext_t *t = cmd_prolog(cmd);
 
     if (is_qpi)
     {
@@ -273,15 +704,15 @@ void ExtFlash::cmd(bool isread, uint8_t cmd, int64_t addr, uint8_t *buf, size_t
                         SPI_TRANS_VARIABLE_ADDR |
                         SPI_TRANS_MODE_QIO |
                         SPI_TRANS_MODE_DIOQIO_ADDR;
-        t->base.addr = (cmd << 24) | addr;
-        t->address_bits = 8 + 24;
+        t->base.addr = ((int64_t) cmd << addr_bits) | addr;
+        t->address_bits = 8 + addr_bits;
     }
     else
     {
         t->base.flags = tflags;
         t->base.cmd = cmd;
         t->base.addr = addr;
-        t->address_bits = 24;
+        t->address_bits = addr_bits;
     }
 
     cmd_epilog(t, buf, size, isread);
@@ -291,7 +722,7 @@ void ExtFlash::cmd(bool isread, uint8_t cmd, uint8_t *buf, size_t size)
 {
     ESP_LOGV(TAG, "%s - isread=%d cmd=0x%02x size=%d", __func__, isread, cmd, size);
 
-    spi_transaction_ext_t *t = cmd_prolog();
+    spi_transaction_ext_t *t = cmd_prolog(cmd);
 
     if (is_qpi)
     {
@@ -315,44 +746,57 @@ void ExtFlash::cmd(uint8_t cmd, int64_t addr)
 {
     ESP_LOGV(TAG, "%s - cmd=0x%02x addr=0x%08llx", __func__, cmd, addr);
 
-    spi_transaction_ext_t *t = cmd_prolog();
+    cmd = addr_inst(cmd);
 
-    if (is_qpi)
+    spi_transaction_ext_t *t = cmd_prolog(cmd);
+
+    if (is_qpi && addr_bits != 24)
     {
         t->base.flags = SPI_TRANS_VARIABLE_CMD |
                         SPI_TRANS_VARIABLE_ADDR |
                         SPI_TRANS_MODE_QIO |
                         SPI_TRANS_MODE_DIOQIO_ADDR;
-        uint8_t *buf = (uint8_t *) &t->base.addr;
-        buf[0] = cmd;
-        buf[1] = (addr >> 16) & 0xff;
-        buf[2] = (addr >> 8) & 0xff;
-        buf[3] = (addr >> 0) & 0xff;
-        cmd_epilog(t, buf, 4, false);
+        t->base.addr = ((int64_t) cmd << addr_bits) | addr;
+        t->address_bits = 8 + addr_bits;
+    }
+    else if (is_qpi)
+    {
+        t->base.flags = SPI_TRANS_VARIABLE_CMD |
+                        SPI_TRANS_VARIABLE_ADDR |
+                        SPI_TRANS_MODE_QIO |
+                        SPI_TRANS_MODE_DIOQIO_ADDR |
+                        SPI_TRANS_USE_TXDATA;
+        t->base.tx_data[0] = cmd;
+        t->base.tx_data[1] = (addr >> 16) & 0xff;
+        t->base.tx_data[2] = (addr >> 8) & 0xff;
+        t->base.tx_data[3] = (addr >> 0) & 0xff;
+        t->base.length = 32;
     }
     else
     {
         t->base.flags = tflags;
         t->base.cmd = cmd;
         t->base.addr = addr;
-        t->address_bits = 24;
-        cmd_epilog(t);
+        t->address_bits = addr_bits;
     }
+
+    cmd_epilog(t);
 }
 
 void ExtFlash::cmd(uint8_t cmd)
 {
     ESP_LOGV(TAG, "%s - cmd=0x%02x", __func__, cmd);
 
-    spi_transaction_ext_t *t = cmd_prolog();
+    spi_transaction_ext_t *t = cmd_prolog(cmd);
 
     if (is_qpi)
     {
         t->base.flags = SPI_TRANS_VARIABLE_CMD |
                         SPI_TRANS_VARIABLE_ADDR |
                         SPI_TRANS_MODE_QIO |
-                        SPI_TRANS_MODE_DIOQIO_ADDR;
-        t->base.tx_buffer = &cmd;
+                        SPI_TRANS_MODE_DIOQIO_ADDR |
+                        SPI_TRANS_USE_TXDATA;
+        t->base.tx_data[0] = cmd;
         t->base.length = 8;
     }
     else
@@ -368,11 +812,71 @@ void ExtFlash::wait_for_command_completion()
 {
     while (queued > 0)
     {
-        spi_transaction_t *t;
-  
-        ESP_ERROR_CHECK(spi_device_get_trans_result(spi, &t, portMAX_DELAY));
-        queued--;
+        reap(portMAX_DELAY);
+    }
+}
+
+bool ExtFlash::reap(TickType_t ticks_to_wait)
+{
+    spi_transaction_t *done;
+
+    if (queued == 0)
+    {
+        return false;
+    }
+
+    esp_err_t err = spi_device_get_trans_result(spi, &done, ticks_to_wait);
+    if (err == ESP_ERR_TIMEOUT)
+    {
+        return false;
+    }
+    ESP_ERROR_CHECK(err);
+
+    queued--;
+    completed++;
+
+    completion_t *c = &completions[(spi_transaction_ext_t *) done - trans];
+    unbounce(c);
+
+    if (c->cb)
+    {
+        ext_flash_callback_t cb = c->cb;
+        c->cb = NULL;
+        cb(c->arg);
+    }
+
+    return true;
+}
+
+// Staging encodes transactions into a side buffer instead of the queue so
+// they can be prepared while the chip is still busy and then handed to the
+// driver back to back with stage_submit().
+void ExtFlash::stage_begin()
+{
+    nstaged = 0;
+    staging = true;
+}
+
+void ExtFlash::stage_end()
+{
+    staging = false;
+}
+
+void ExtFlash::stage_submit()
+{
+    if (crm_inst != 0)
+    {
+        crm_exit();
+    }
+
+    for (int i = 0; i < nstaged; i++)
+    {
+        spi_transaction_ext_t *t = cmd_prolog(0);
+        *t = staged[i];
+        cmd_epilog(t);
     }
+
+    nstaged = 0;
 }
 
 void ExtFlash::set_1_1_1()
@@ -424,15 +928,18 @@ esp_err_t ExtFlash::begin()
 
     reset();
 
-    if (cfg.sector_size != 0 && cfg.capacity != 0)
+    if (cfg.auto_mode || cfg.sector_size == 0 || cfg.capacity == 0)
     {
-        sector_sz = cfg.sector_size;
+        read_sfdp();
+    }
+
+    if (cfg.sector_size != 0 && cfg.capacity != 0)
+    {
+        sector_sz = cfg.sector_size;
         capacity = cfg.capacity;
     }
     else
     {
-        read_sfdp();
-
         if (capacity == 0)
         {
             WORD_ALIGNED_ATTR uint8_t id[3];
@@ -440,10 +947,15 @@ esp_err_t ExtFlash::begin()
             cmd(true, CMD_READ_JEDEC_ID, id, sizeof(id));
             wait_for_command_completion();
 
-            if (id[2] >= 0x10 && id[2] <= 0x17)
+            // After 0x19 the codes carry on at 0x20
+            if (id[2] >= 0x10 && id[2] <= 0x19)
             {
                 capacity = 1 << id[2];
             }
+            else if (id[2] >= 0x20 && id[2] <= 0x22)
+            {
+                capacity = 1 << (id[2] - 6);
+            }
         }
 
         if (capacity == 0 || sector_sz == 0)
@@ -452,6 +964,13 @@ esp_err_t ExtFlash::begin()
         }
     }
 
+    if (erase_types[0].inst == 0)
+    {
+        erase_types[0] = {CMD_SECTOR_ERASE, sector_sz, 0};
+    }
+
+    addr_mode_begin();
+
     mode_begin();
 
     return ESP_OK;
@@ -463,15 +982,146 @@ void ExtFlash::end()
 
     mode_end();
 
+    addr_mode_end();
+
     reset();
 }
 
+// Without a subclass that knows the chip, use the fastest read SFDP lists
+// that the wired pins can carry and, past 16MB, that has a 4-byte variant
+// when those are used
 void ExtFlash::mode_begin()
 {
+    ESP_LOGD(TAG, "%s", __func__);
+
+    read_mode = -1;
+
+    if (!cfg.auto_mode)
+    {
+        return;
+    }
+
+    bool quad = cfg.hd_io_num != -1 && quad_enable_req != 0xff;
+
+    for (int t = max_read_types - 1; t >= 0; t--)
+    {
+        if (read_types[t].inst == 0 ||
+            addr_inst(read_types[t].inst) == 0 ||
+            (t >= read_1_1_4 && !quad) ||
+            (t == read_4_4_4 && (qpi_enter_inst == 0 || qpi_exit_inst == 0)))
+        {
+            continue;
+        }
+
+        if (t >= read_1_1_4 && !set_quad_enable())
+        {
+            continue;
+        }
+
+        read_mode = t;
+        break;
+    }
+
+    if (read_mode == read_4_4_4)
+    {
+        cmd(qpi_enter_inst);
+        qpi_enable();
+        wait_for_device_idle();
+    }
+
+    ESP_LOGD(TAG, "%s - read type %d inst 0x%02x", __func__, read_mode, read_mode < 0 ? CMD_FAST_READ : read_types[read_mode].inst);
 }
 
 void ExtFlash::mode_end()
 {
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (read_mode == read_4_4_4 && is_qpi)
+    {
+        cmd(qpi_exit_inst);
+        qpi_disable();
+        wait_for_device_idle();
+    }
+
+    read_mode = -1;
+}
+
+// QE is left set when done with, it only takes away the WP# and HOLD# pin
+// functions and clearing it would mean another non-volatile write
+bool ExtFlash::set_quad_enable()
+{
+    ESP_LOGD(TAG, "%s - requirement=%d", __func__, quad_enable_req);
+
+    WORD_ALIGNED_ATTR uint8_t sr[2];
+
+    switch (quad_enable_req)
+    {
+        case 0:
+        break;
+
+        // Bit 1 of status register 2, written along with status register 1
+        case 1:
+        case 4:
+        case 5:
+            sr[1] = read_status(CMD_READ_STATUS_REG2);
+            if (!(sr[1] & 0x02))
+            {
+                sr[0] = read_status_register1();
+                sr[1] |= 0x02;
+                write_enable();
+                cmd(false, CMD_WRITE_STATUS_REG1, sr, 2);
+                wait_for_device_idle();
+            }
+        break;
+
+        // Bit 6 of status register 1
+        case 2:
+            sr[0] = read_status_register1();
+            if (!(sr[0] & 0x40))
+            {
+                write_status_register1(sr[0] | 0x40);
+            }
+        break;
+
+        // Bit 7 of status register 2, with its own instructions
+        case 3:
+            sr[1] = read_status(CMD_READ_STATUS_REG2_ALT);
+            if (!(sr[1] & 0x80))
+            {
+                sr[1] |= 0x80;
+                write_enable();
+                cmd(false, CMD_WRITE_STATUS_REG2_ALT, &sr[1], 1);
+                wait_for_device_idle();
+            }
+        break;
+
+        // Bit 1 of status register 2, written on its own
+        case 6:
+            sr[1] = read_status(CMD_READ_STATUS_REG2);
+            if (!(sr[1] & 0x02))
+            {
+                sr[1] |= 0x02;
+                write_enable();
+                cmd(false, CMD_WRITE_STATUS_REG2, &sr[1], 1);
+                wait_for_device_idle();
+            }
+        break;
+
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+uint8_t ExtFlash::read_status(uint8_t inst)
+{
+    WORD_ALIGNED_ATTR uint8_t status;
+
+    cmd(true, inst, &status, 1);
+    wait_for_command_completion();
+
+    return status;
 }
 
 void ExtFlash::write_enable()
@@ -497,19 +1147,293 @@ void ExtFlash::write_status_register1(uint8_t status)
 }
 
 void ExtFlash::wait_for_device_idle()
+{
+    wait_for_busy(NULL);
+}
+
+// Wait for a program, erase or status register write to finish without
+// hogging the core or the bus.  Given an estimate of how long the operation
+// takes, the task sleeps through most of it and then polls at a fraction of
+// it.  Past the estimate, operations of a tick or more are polled once a
+// tick, and without an estimate or one that short the polls start close
+// together and back off to a tick.  The estimate is then moved towards
+// what was observed.
+void ExtFlash::wait_for_busy(uint32_t *estimate_us)
 {
     wait_for_command_completion();
 
-    int i = 0;
+    const uint32_t tick_us = portTICK_PERIOD_MS * 1000;
+    uint32_t expect = estimate_us ? *estimate_us : 0;
+    int64_t start = esp_timer_get_time();
+
+    if (expect > 0)
+    {
+        sleep_us(expect - expect / 4);
+    }
+
+    uint32_t interval = expect / 32;
+    if (interval < min_poll_us)
+    {
+        interval = min_poll_us;
+    }
+
     while (read_status_register1() & sr1_wip)
     {
-        i++;
-        if (i == 1000)
+        sleep_us(interval);
+
+        if (esp_timer_get_time() - start >= expect)
+        {
+            interval = expect >= tick_us ? tick_us : interval * 2;
+            if (interval > tick_us)
+            {
+                interval = tick_us;
+            }
+        }
+    }
+
+    if (estimate_us)
+    {
+        uint32_t took = esp_timer_get_time() - start;
+        *estimate_us = expect ? (3 * expect + took) / 4 : took;
+    }
+}
+
+// Readers get at the bus while an erase is under way, but only the task
+// waiting for the erase lets go of it.  Others, such as a reader waiting
+// for the chip in suspend_for_read(), keep it to the end of their request.
+// See ExtFlashSleeper for how long waits are.
+void ExtFlash::sleep_us(uint32_t us)
+{
+    bool share = erasing && eraser == xTaskGetCurrentTaskHandle();
+    uint8_t priority = bus_priority;
+
+    if (share)
+    {
+        unlock_bus();
+        op_sleeper.sleep_us(us);
+        lock_bus(priority);
+    }
+    else
+    {
+        bus_sleeper.sleep_us(us);
+    }
+}
+
+// Called with the op lock and the bus locked once an erase of the range
+// has been sent.  Readers get the bus while it runs, see sleep_us() and
+// suspend_for_read().
+void ExtFlash::wait_for_erase(size_t addr, size_t size, uint32_t *estimate_us)
+{
+    busy_addr = addr;
+    busy_size = size;
+    erasing = true;
+
+    eraser = xTaskGetCurrentTaskHandle();
+    wait_for_busy(estimate_us);
+    erasing = false;
+}
+
+// The calling task's entry or NULL, called with the sched lock held
+ExtFlash::requester_t *ExtFlash::find_requester()
+{
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+
+    for (int i = 0; i < max_requesters; i++)
+    {
+        if (requesters[i].task == task)
+        {
+            return &requesters[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Gives the calling task an entry.  Called with the sched lock held and
+// after taking sched_free, so there is always one unused.
+ExtFlash::requester_t *ExtFlash::claim_requester()
+{
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+
+    for (int i = 0; i < max_requesters; i++)
+    {
+        requester_t *r = &requesters[i];
+        if (r->task == NULL)
+        {
+            r->task = task;
+            r->priority = EXT_FLASH_PRIORITY_DEFAULT;
+            r->waiting = false;
+            return r;
+        }
+    }
+
+    return NULL;
+}
+
+// Lets go of an entry that is neither waiting nor holding a priority, so
+// tasks that come and go don't use them all up
+void ExtFlash::release_requester(requester_t *r)
+{
+    if (!r->waiting && r->priority == EXT_FLASH_PRIORITY_DEFAULT)
+    {
+        r->task = NULL;
+        xSemaphoreGive(sched_free);
+    }
+}
+
+// Without the scheduler the bus lock is a plain mutex.  With it, a task
+// that finds the bus in use waits in the queue and is handed the bus by
+// unlock_bus(), in priority order and in arrival order within a priority.
+// The priority is the task's from set_priority() or else the one given.
+// When every entry is taken, a task waits on sched_free for one first.
+void ExtFlash::lock_bus(uint8_t priority)
+{
+    if (sched_lock == NULL)
+    {
+        if (bus_lock)
+        {
+            xSemaphoreTake(bus_lock, portMAX_DELAY);
+        }
+        return;
+    }
+
+    bool reserved = false;
+
+    while (true)
+    {
+        xSemaphoreTake(sched_lock, portMAX_DELAY);
+
+        requester_t *r = find_requester();
+        if (r && r->priority != EXT_FLASH_PRIORITY_DEFAULT)
+        {
+            priority = r->priority;
+        }
+
+        if (!bus_busy)
+        {
+            bus_busy = true;
+            bus_priority = priority;
+            if (reserved)
+            {
+                xSemaphoreGive(sched_free);
+            }
+            xSemaphoreGive(sched_lock);
+            return;
+        }
+
+        if (r == NULL && (reserved || xSemaphoreTake(sched_free, 0) == pdTRUE))
+        {
+            r = claim_requester();
+            reserved = false;
+        }
+
+        if (r)
+        {
+            r->waiting = true;
+            r->want = priority;
+            r->seq = sched_seq++;
+            xSemaphoreGive(sched_lock);
+
+            // unlock_bus() leaves the bus busy and ours
+            xSemaphoreTake(r->wake, portMAX_DELAY);
+
+            xSemaphoreTake(sched_lock, portMAX_DELAY);
+            release_requester(r);
+            xSemaphoreGive(sched_lock);
+            return;
+        }
+
+        // More tasks than entries, wait for one to be released
+        xSemaphoreGive(sched_lock);
+        xSemaphoreTake(sched_free, portMAX_DELAY);
+        reserved = true;
+    }
+}
+
+void ExtFlash::unlock_bus()
+{
+    if (sched_lock == NULL)
+    {
+        if (bus_lock)
+        {
+            xSemaphoreGive(bus_lock);
+        }
+        return;
+    }
+
+    xSemaphoreTake(sched_lock, portMAX_DELAY);
+
+    requester_t *next = NULL;
+    for (int i = 0; i < max_requesters; i++)
+    {
+        requester_t *r = &requesters[i];
+        if (r->waiting && (next == NULL || r->want > next->want || (r->want == next->want && (int32_t) (r->seq - next->seq) < 0)))
         {
-            i = 0;
-            vTaskDelay(1);
+            next = r;
         }
     }
+
+    if (next)
+    {
+        next->waiting = false;
+        bus_priority = next->want;
+        stats.handoffs++;
+        xSemaphoreGive(next->wake);
+    }
+    else
+    {
+        bus_busy = false;
+    }
+
+    xSemaphoreGive(sched_lock);
+}
+
+void ExtFlash::lock_op()
+{
+    if (op_lock)
+    {
+        xSemaphoreTake(op_lock, portMAX_DELAY);
+    }
+    lock_bus(EXT_FLASH_PRIORITY_BULK);
+}
+
+void ExtFlash::unlock_op()
+{
+    unlock_bus();
+    if (op_lock)
+    {
+        xSemaphoreGive(op_lock);
+    }
+}
+
+bool ExtFlash::suspend()
+{
+    return false;
+}
+
+void ExtFlash::resume()
+{
+}
+
+// Called with the bus locked.  If another task is erasing, either suspend
+// the erase or, if that's not possible or the read is of what's being
+// erased, wait for it to finish.
+bool ExtFlash::suspend_for_read(size_t addr, size_t size)
+{
+    if (!erasing)
+    {
+        return false;
+    }
+
+    bool overlaps = addr < busy_addr + busy_size && busy_addr < addr + size;
+    if (!overlaps && suspend())
+    {
+        return true;
+    }
+
+    wait_for_device_idle();
+
+    return false;
 }
 
 void ExtFlash::reset()
@@ -517,6 +1441,13 @@ void ExtFlash::reset()
     ESP_LOGD(TAG, "%s", __func__);
 
     set_1_1_1();
+
+    if (read_mode == read_4_4_4 && is_qpi)
+    {
+        cmd(qpi_exit_inst);
+        qpi_disable();
+    }
+
     cmd(CMD_ENABLE_RESET);
     cmd(CMD_RESET_DEVICE);
     wait_for_device_idle();
@@ -541,20 +1472,29 @@ bool ExtFlash::read_sfdp()
 
     uint32_t ptp = 0;
     uint8_t ptl = 0;
+    uint32_t bait = 0;
     uint32_t off = 8;
     while (nph-- >= 0)
     {
         cmd(true, CMD_READ_SFDP, off, 8, sfdp, 8);
         wait_for_command_completion();
+        off += 8;
 
         uint32_t dword1 = p[0];
         uint32_t dword2 = p[1];
 
-        if (((dword2 >> 24) & 0xff) == 0xff)
+        // Basic flash parameter table has ID 0xff00
+        if ((dword1 & 0xff) == 0x00 && ((dword2 >> 24) & 0xff) == 0xff)
         {
             ptp = dword2 & 0x00ffffff;
             ptl = (dword1 >> 24) & 0xff; 
         }
+
+        // 4-byte address instruction table has ID 0xff84
+        if ((dword1 & 0xff) == 0x84 && ((dword2 >> 24) & 0xff) == 0xff && ((dword1 >> 24) & 0xff) >= 2)
+        {
+            bait = dword2 & 0x00ffffff;
+        }
     }
 
     if (ptp == 0 || ptl == 0 || ptl > 32)
@@ -565,6 +1505,17 @@ bool ExtFlash::read_sfdp()
     cmd(true, CMD_READ_SFDP, ptp, 8, sfdp, ptl << 3);
     wait_for_command_completion();
 
+    for (int t = 0; t < max_read_types; t++)
+    {
+        read_types[t] = {};
+    }
+
+    uint32_t reads = 0;
+    bool qpi = false;
+
+    addr4_only = false;
+    addr4_enter = 0;
+
     for (int i = 0; i < ptl; i++)
     {
         uint32_t dword = p[i];
@@ -572,6 +1523,8 @@ bool ExtFlash::read_sfdp()
         {
             case 0:
                 sector_sz = (dword & 0x03) == 1 ? 4096 : 0;
+                reads = dword;
+                addr4_only = ((dword >> 17) & 0x03) == 2;
             break;
 
             case 1:
@@ -585,40 +1538,155 @@ bool ExtFlash::read_sfdp()
                 }
             break;
 
-            case 7:
-                sector_sz = 1 << (dword & 0xff);
+            case 2:
+                if (reads & (1 << 21))
+                {
+                    set_read_type(read_1_4_4, dword);
+                }
+                if (reads & (1 << 22))
+                {
+                    set_read_type(read_1_1_4, dword >> 16);
+                }
             break;
-        }
-    }
 
-    return true;
-}
+            case 3:
+                if (reads & (1 << 16))
+                {
+                    set_read_type(read_1_1_2, dword);
+                }
+                if (reads & (1 << 20))
+                {
+                    set_read_type(read_1_2_2, dword >> 16);
+                }
+            break;
 
-esp_err_t ExtFlash::read_nocrm(uint8_t inst, uint8_t dummy, size_t addr, void *dest, size_t size)
-{
-    ESP_LOGD(TAG, "%s - inst=0x%02x dummy=%d addr=0x%08x size=%d", __func__, inst, dummy, addr, size);
+            case 4:
+                qpi = (dword & 0x10) != 0;
+            break;
 
-    uint8_t *bytes = (uint8_t *) dest;
-    size_t len = cfg.max_dma_size;
+            case 6:
+                if (qpi)
+                {
+                    set_read_type(read_4_4_4, dword >> 16);
+                }
+            break;
 
-    while (size > 0)
-    {
-        if (len >= size)
-        {
-            len = size;
-        }
+            case 7:
+                sector_sz = 1 << (dword & 0xff);
 
-        cmd(true, inst, addr, dummy, bytes, len);
+                for (int e = 0; e < max_erase_types; e++)
+                {
+                    erase_types[e] = {};
+                }
+            // fall through
 
-        addr += len;
-        bytes += len;
-        size -= len;
-    }
+            case 8:
+                for (int e = 0; e < 2; e++)
+                {
+                    uint8_t bits = (dword >> (e * 16)) & 0xff;
+                    if (bits != 0)
+                    {
+                        erase_type_t *et = &erase_types[(i - 7) * 2 + e];
+                        et->inst = (dword >> (e * 16 + 8)) & 0xff;
+                        et->size = 1 << bits;
+                    }
+                }
+            break;
 
-    wait_for_command_completion();
+            case 9:
+                for (int e = 0; e < max_erase_types; e++)
+                {
+                    static const uint16_t units_ms[] = {1, 16, 128, 1000};
+                    uint32_t field = (dword >> (4 + e * 7)) & 0x7f;
 
-    return ESP_OK;
-}
+                    erase_types[e].time_us = ((field & 0x1f) + 1) * units_ms[field >> 5] * 1000;
+                }
+            break;
+
+            case 10:
+            {
+                static const uint32_t pp_units_us[] = {8, 64};
+                static const uint32_t ce_units_ms[] = {16, 256, 4000, 64000};
+                uint32_t pp = (dword >> 8) & 0x3f;
+                uint32_t ce = (dword >> 24) & 0x7f;
+
+                tpp_us = ((pp & 0x1f) + 1) * pp_units_us[pp >> 5];
+                chip_erase_us = ((ce & 0x1f) + 1) * ce_units_ms[ce >> 5] * 1000;
+            }
+            break;
+
+            case 14:
+                quad_enable_req = (dword >> 20) & 0x07;
+
+                // Only entering with 38h is handled
+                qpi_enter_inst = (dword & 0x30) ? CMD_ENTER_QPI_MODE : 0;
+                qpi_exit_inst = (dword & 0x01) ? CMD_EXIT_QPI_MODE :
+                                (dword & 0x02) ? CMD_EXIT_QPI_MODE_ALT : 0;
+            break;
+
+            case 15:
+                addr4_enter = (dword >> 24) & 0xff;
+            break;
+        }
+    }
+
+    bait_insts = 0;
+    for (int e = 0; e < max_erase_types; e++)
+    {
+        bait_erase[e] = 0;
+    }
+
+    if (bait != 0)
+    {
+        cmd(true, CMD_READ_SFDP, bait, 8, sfdp, 8);
+        wait_for_command_completion();
+
+        bait_insts = p[0];
+        for (int e = 0; e < max_erase_types; e++)
+        {
+            if (p[0] & (1 << (9 + e)))
+            {
+                bait_erase[e] = (p[1] >> (e * 8)) & 0xff;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Fast read parameters are 16 bit fields of inst, mode and dummy clocks
+void ExtFlash::set_read_type(int type, uint32_t bits)
+{
+    read_type_t *rt = &read_types[type];
+
+    rt->inst = (bits >> 8) & 0xff;
+    rt->mode_clocks = (bits >> 5) & 0x07;
+    rt->dummy_clocks = bits & 0x1f;
+}
+
+esp_err_t ExtFlash::read_nocrm(uint8_t inst, uint8_t dummy, size_t addr, void *dest, size_t size)
+{
+    ESP_LOGD(TAG, "%s - inst=0x%02x dummy=%d addr=0x%08x size=%d", __func__, inst, dummy, addr, size);
+
+    uint8_t *bytes = (uint8_t *) dest;
+    size_t len = cfg.max_dma_size;
+
+    while (size > 0)
+    {
+        if (len >= size)
+        {
+            len = size;
+        }
+
+        cmd(true, inst, addr, dummy, bytes, len);
+
+        addr += len;
+        bytes += len;
+        size -= len;
+    }
+
+    return ESP_OK;
+}
 
 esp_err_t ExtFlash::read_crm(uint8_t inst, uint8_t on, uint8_t off, uint8_t dummy, size_t addr, void *dest, size_t size)
 {
@@ -627,27 +1695,217 @@ esp_err_t ExtFlash::read_crm(uint8_t inst, uint8_t on, uint8_t off, uint8_t dumm
     uint8_t *bytes = (uint8_t *) dest;
     size_t len = cfg.max_dma_size;
     uint8_t mode = on;
+    uint8_t first = inst;
+
+    if (size == 0)
+    {
+        return ESP_OK;
+    }
+
+    // A session left by an earlier read can carry on if the read is the same
+    if (crm_inst != 0 && (crm_inst != inst || crm_flags != tflags || crm_dummy != dummy))
+    {
+        crm_exit();
+    }
+
+    if (crm_inst != 0)
+    {
+        first = 0;
+    }
 
     while (size > 0)
     {
         if (len >= size)
         {
             len = size;
-            mode = off;
+            mode = crm_session ? on : off;
         }
 
-        cmd(true, inst, addr, mode, dummy, bytes, len);
-        inst = 0;
+        cmd(true, first, addr, mode, dummy, bytes, len);
+        first = 0;
 
         addr += len;
         bytes += len;
         size -= len;
     }
 
-    wait_for_command_completion();
+    crm_inst = crm_session ? inst : 0;
+    crm_off = off;
+    crm_dummy = dummy;
+    crm_flags = tflags;
 
     return ESP_OK;
 }
+
+// Leave continuous read mode with a throwaway read that clears the mode bits
+void ExtFlash::crm_exit()
+{
+    uint32_t flags = tflags;
+    uint8_t off = crm_off;
+
+    ESP_LOGD(TAG, "%s - inst=0x%02x", __func__, crm_inst);
+
+    crm_inst = 0;
+
+    tflags = crm_flags;
+    cmd(true, 0, 0, off, crm_dummy, status_buf, 1);
+    tflags = flags;
+}
+
+// Past 16MB, prefer the chip's 4-byte address mode since it keeps every
+// instruction, word reads included, and fall back to the 4-byte
+// instructions SFDP lists when the mode can't be entered with B7h
+void ExtFlash::addr_mode_begin()
+{
+    ESP_LOGD(TAG, "%s - capacity=%d", __func__, capacity);
+
+    if (capacity <= (1 << 24))
+    {
+        return;
+    }
+
+    addr_bits = 32;
+
+    if (addr4_only)
+    {
+        return;
+    }
+
+    addr4_insts = true;
+    bool insts = (addr4_enter & 0x03) == 0 &&
+                 addr_inst(CMD_FAST_READ) != 0 &&
+                 addr_inst(CMD_PAGE_PROGRAM) != 0 &&
+                 addr_inst(CMD_SECTOR_ERASE) != 0;
+    addr4_insts = insts;
+
+    if (!insts)
+    {
+        if (addr4_enter & 0x02)
+        {
+            write_enable();
+        }
+        cmd(CMD_ENTER_4B_MODE);
+        addr4_mode = true;
+    }
+}
+
+void ExtFlash::addr_mode_end()
+{
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (addr4_mode)
+    {
+        cmd(CMD_EXIT_4B_MODE);
+        addr4_mode = false;
+    }
+
+    addr4_insts = false;
+    addr_bits = 24;
+}
+
+// The instruction to send for an addressed command, which is its 4-byte
+// variant when those are used, or 0 when there isn't one
+uint8_t ExtFlash::addr_inst(uint8_t inst)
+{
+    // In the bit order of the SFDP 4-byte address instruction table
+    static const uint8_t variants[][2] =
+    {
+        {CMD_READ_DATA, CMD_READ_DATA_4B},
+        {CMD_FAST_READ, CMD_FAST_READ_4B},
+        {0x3b, 0x3c},
+        {0xbb, 0xbc},
+        {0x6b, 0x6c},
+        {0xeb, 0xec},
+        {CMD_PAGE_PROGRAM, CMD_PAGE_PROGRAM_4B},
+        {0x32, 0x34},
+    };
+
+    if (!addr4_insts || inst == 0)
+    {
+        return inst;
+    }
+
+    for (int i = 0; i < (int) (sizeof(variants) / sizeof(variants[0])); i++)
+    {
+        if (variants[i][0] == inst)
+        {
+            return (bait_insts & (1 << i)) ? variants[i][1] : 0;
+        }
+    }
+
+    for (int e = 0; e < max_erase_types; e++)
+    {
+        if (erase_types[e].inst == inst)
+        {
+            return bait_erase[e];
+        }
+    }
+
+    return 0;
+}
+
+// The read the chip is still in CRM for, if any
+uint8_t ExtFlash::crm_instruction()
+{
+    return crm_inst;
+}
+
+void ExtFlash::set_crm_session(bool enable)
+{
+    ESP_LOGD(TAG, "%s - enable=%d", __func__, enable);
+
+    lock_bus();
+
+    crm_session = enable;
+    if (!enable && crm_inst != 0)
+    {
+        crm_exit();
+        wait_for_command_completion();
+    }
+
+    unlock_bus();
+}
+
+esp_err_t ExtFlash::queue_read(size_t addr, void *dest, size_t size)
+{
+    if (read_mode < 0)
+    {
+        return read_nocrm(CMD_FAST_READ, 8, addr, dest, size);
+    }
+
+    // Mode bits are sent as zeros, which no chip takes for CRM, so they
+    // count as dummy clocks on the address lines
+    static const uint8_t addr_lines[max_read_types] = {1, 2, 1, 4, 4};
+    const read_type_t *rt = &read_types[read_mode];
+    uint8_t dummy = (rt->mode_clocks + rt->dummy_clocks) * addr_lines[read_mode];
+    esp_err_t err;
+
+    switch (read_mode)
+    {
+        case read_1_1_2:
+            set_1_1_2();
+        break;
+
+        case read_1_2_2:
+            set_1_2_2();
+        break;
+
+        case read_1_1_4:
+            set_1_1_4();
+        break;
+
+        case read_1_4_4:
+            set_1_4_4();
+        break;
+    }
+
+    err = read_nocrm(rt->inst, dummy, addr, dest, size);
+
+    set_1_1_1();
+
+    return err;
+}
+
 size_t ExtFlash::sector_size()
 {
     ESP_LOGD(TAG, "%s - %d", __func__, sector_sz);
@@ -662,13 +1920,50 @@ size_t ExtFlash::chip_size()
     return capacity;
 }
 
+size_t ExtFlash::page_size()
+{
+    return pagesize;
+}
+
 esp_err_t ExtFlash::erase_sector(size_t sector)
 {
     ESP_LOGD(TAG, "%s - sector=0x%08x", __func__, sector);
 
+    uint32_t *estimate = NULL;
+    for (int i = 0; i < max_erase_types; i++)
+    {
+        if (erase_types[i].inst == CMD_SECTOR_ERASE)
+        {
+            estimate = &erase_types[i].time_us;
+        }
+    }
+
+    lock_op();
+
+    if (pool && pool->blank(sector * sector_sz, sector_sz))
+    {
+        pool->skipped();
+        unlock_op();
+        return ESP_OK;
+    }
+
+    if (pool)
+    {
+        pool->erasing(sector * sector_sz, sector_sz);
+    }
+
     write_enable();
     cmd(CMD_SECTOR_ERASE, sector * sector_sz);
-    wait_for_device_idle();
+    wait_for_erase(sector * sector_sz, sector_sz, estimate);
+
+    if (pool)
+    {
+        pool->erased(sector * sector_sz, sector_sz);
+    }
+
+    invalidate_buffers(sector * sector_sz, sector_sz);
+
+    unlock_op();
 
     return ESP_OK;
 }
@@ -677,16 +1972,69 @@ esp_err_t ExtFlash::erase_range(size_t addr, size_t size)
 {
     ESP_LOGD(TAG, "%s - add=0x%08x size=%d", __func__, addr, size);
 
+    size_t smallest = 0;
+    for (int i = 0; i < max_erase_types; i++)
+    {
+        if (erase_types[i].inst && addr_inst(erase_types[i].inst) && (smallest == 0 || erase_types[i].size < smallest))
+        {
+            smallest = erase_types[i].size;
+        }
+    }
+
+    if (smallest == 0 || (addr % smallest) != 0 || (size % smallest) != 0)
+    {
+        ESP_LOGE(TAG, "erase range must be aligned to %d bytes", smallest);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    lock_op();
+
+    // Readers may have cached parts of the range while it was being erased
+    size_t start = addr;
+    size_t total = size;
+
+    // Largest unit that is aligned and fits what's left, each time round
     while (size > 0)
     {
-        write_enable();
-        cmd(CMD_SECTOR_ERASE, addr);
-        wait_for_device_idle();
+        erase_type_t *et = NULL;
+        for (int i = 0; i < max_erase_types; i++)
+        {
+            erase_type_t *t = &erase_types[i];
+            if (t->inst && addr_inst(t->inst) && (addr % t->size) == 0 && t->size <= size && (et == NULL || t->size > et->size))
+            {
+                et = t;
+            }
+        }
+
+        if (pool && pool->blank(addr, et->size))
+        {
+            pool->skipped();
+        }
+        else
+        {
+            if (pool)
+            {
+                pool->erasing(addr, et->size);
+            }
+
+            write_enable();
+            cmd(et->inst, addr);
+            wait_for_erase(addr, et->size, &et->time_us);
+        }
+
+        addr += et->size;
+        size -= et->size;
+    }
 
-        addr += sector_sz;
-        size -= sector_sz;
+    if (pool)
+    {
+        pool->erased(start, total);
     }
 
+    invalidate_buffers(start, total);
+
+    unlock_op();
+
     return ESP_OK;
 }
 
@@ -694,11 +2042,26 @@ esp_err_t ExtFlash::erase_chip()
 {
     ESP_LOGD(TAG, "%s", __func__);
 
+    lock_op();
+
+    if (pool)
+    {
+        pool->erasing(0, capacity);
+    }
+
     write_enable();
 
     cmd(CMD_CHIP_ERASE);
+    wait_for_erase(0, capacity, &chip_erase_us);
 
-    wait_for_device_idle();
+    if (pool)
+    {
+        pool->erased(0, capacity);
+    }
+
+    invalidate_buffers(0, capacity);
+
+    unlock_op();
 
     return ESP_OK;
 }
@@ -707,34 +2070,1402 @@ esp_err_t ExtFlash::write(size_t addr, const void *src, size_t size)
 {
     ESP_LOGD(TAG, "%s - addr=0x%08x size=%d", __func__, addr, size);
 
-    uint8_t *bytes = (uint8_t *) src;
+    const uint8_t *bytes = (const uint8_t *) src;
     size_t len = pagesize - (addr % pagesize);
 
+    if (len > size)
+    {
+        len = size;
+    }
+
+    lock_op();
+
+    size_t start = addr;
+    size_t total = size;
+
+    if (pool)
+    {
+        pool->written(addr, size);
+    }
+
+    if (size > 0)
+    {
+        stage_page(addr, bytes, len);
+    }
+
     while (size > 0)
     {
-        if (len > size)
-        {
-            len = size;
-        }
+        stage_submit();
 
-        write_enable();
-        cmd(false, CMD_PAGE_PROGRAM, addr, bytes, len);
-        wait_for_device_idle();
+        size_t programming = len;
 
         addr += len;
         bytes += len;
         size -= len;
 
-        len = pagesize;
+        len = size < pagesize ? size : pagesize;
+
+        // Encode the next page while the chip works on this one
+        if (size > 0)
+        {
+            stage_page(addr, bytes, len);
+        }
+
+        wait_for_page_program(addr - programming, programming, true);
+
+        // Let waiting readers in between pages
+        unlock_bus();
+        lock_bus(EXT_FLASH_PRIORITY_BULK);
     }
 
+    invalidate_buffers(start, total);
+
+    unlock_op();
+
     return ESP_OK;
 }
 
-esp_err_t ExtFlash::read(size_t addr, void *dest, size_t size)
+// Whether programming src over old leaves src, that is it only clears bits
+static bool only_clears(const uint8_t *old, const uint8_t *src, size_t size)
 {
-    ESP_LOGD(TAG, "%s - addr=0x%08x size=%d", __func__, addr, size);
+    size_t i = 0;
+
+    for ( ; i + 4 <= size; i += 4)
+    {
+        uint32_t o;
+        uint32_t n;
+        memcpy(&o, &old[i], 4);
+        memcpy(&n, &src[i], 4);
+        if ((o & n) != n)
+        {
+            return false;
+        }
+    }
+
+    for ( ; i < size; i++)
+    {
+        if ((old[i] & src[i]) != src[i])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool all_ones(const uint8_t *src, size_t size)
+{
+    size_t i = 0;
+
+    for ( ; i + 4 <= size; i += 4)
+    {
+        uint32_t n;
+        memcpy(&n, &src[i], 4);
+        if (n != 0xffffffff)
+        {
+            return false;
+        }
+    }
+
+    for ( ; i < size; i++)
+    {
+        if (src[i] != 0xff)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Writes only what has changed.  Each sector the range touches is read and
+// compared first and only erased if some bit has to go from 0 to 1, in
+// which case the rest of the sector is read and written back with it.
+// Pages that already hold the data, or that would only be programmed with
+// 0xff after an erase, are left alone.
+esp_err_t ExtFlash::smart_write(size_t addr, const void *src, size_t size)
+{
+    ESP_LOGD(TAG, "%s - addr=0x%08x size=%d", __func__, addr, size);
+
+    if (addr > capacity || size > capacity - addr)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (size == 0)
+    {
+        return ESP_OK;
+    }
+
+    uint8_t *buf = (uint8_t *) heap_caps_malloc(sector_sz, MALLOC_CAP_DMA);
+    if (buf == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    const uint8_t *bytes = (const uint8_t *) src;
+    esp_err_t err = ESP_OK;
+
+    while (size > 0 && err == ESP_OK)
+    {
+        size_t sector = addr / sector_sz;
+        size_t base = sector * sector_sz;
+        size_t off = addr - base;
+        size_t len = sector_sz - off < size ? sector_sz - off : size;
+        size_t end = off + len;
+
+        err = read(addr, &buf[off], len);
+
+        bool erase = err == ESP_OK && !only_clears(&buf[off], bytes, len);
+        if (erase)
+        {
+            if (off > 0)
+            {
+                err = read(base, buf, off);
+            }
+
+            if (err == ESP_OK && end < sector_sz)
+            {
+                err = read(base + end, &buf[end], sector_sz - end);
+            }
+
+            memcpy(&buf[off], bytes, len);
+
+            if (err == ESP_OK)
+            {
+                err = erase_sector(sector);
+            }
+
+            off = 0;
+            end = sector_sz;
+        }
+        else if (err == ESP_OK)
+        {
+            stats.erases_skipped++;
+        }
+
+        // Runs of pages that need programming go to write() together, so
+        // it can prepare each page while the chip programs the last
+        size_t run = end;
+        for (size_t p = off; p < end && err == ESP_OK; )
+        {
+            size_t next = (p - p % pagesize) + pagesize;
+            next = next < end ? next : end;
+
+            const uint8_t *want = erase ? &buf[p] : &bytes[p - (addr - base)];
+            bool skip = erase ? all_ones(want, next - p) : memcmp(&buf[p], want, next - p) == 0;
+
+            if (skip)
+            {
+                stats.pages_skipped++;
+                if (run < p)
+                {
+                    err = write(base + run, erase ? &buf[run] : &bytes[run - (addr - base)], p - run);
+                }
+                run = end;
+            }
+            else if (run == end)
+            {
+                run = p;
+            }
+
+            p = next;
+        }
+
+        if (err == ESP_OK && run < end)
+        {
+            err = write(base + run, erase ? &buf[run] : &bytes[run - (addr - base)], end - run);
+        }
+
+        addr += len;
+        bytes += len;
+        size -= len;
+    }
+
+    heap_caps_free(buf);
+
+    return err;
+}
+
+// Split phase programs and erases, which let one task keep several chips
+// busy at once, see ExtFlashStripe.  Writes and erases from other tasks are
+// held off from the start until finish_op(), while their reads get in the
+// way they do during an erase.
+esp_err_t ExtFlash::start_program(size_t addr, const void *src, size_t size, size_t *programmed)
+{
+    ESP_LOGD(TAG, "%s - addr=0x%08x size=%d", __func__, addr, size);
+
+    size_t len = pagesize - (addr % pagesize);
+    if (len > size)
+    {
+        len = size;
+    }
+
+    if (len == 0 || op_pending)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    lock_op();
+
+    if (pool)
+    {
+        pool->written(addr, len);
+    }
+
+    stage_page(addr, (const uint8_t *) src, len);
+    stage_submit();
+
+    // The caller's buffer is free to go once it's been sent
+    wait_for_command_completion();
+
+    begin_op(addr, len, len == pagesize ? &tpp_us : NULL);
+    *programmed = len;
+
+    return ESP_OK;
+}
+
+// Starts erasing the largest unit that's aligned and fits
+esp_err_t ExtFlash::start_erase(size_t addr, size_t size, size_t *erased)
+{
+    ESP_LOGD(TAG, "%s - addr=0x%08x size=%d", __func__, addr, size);
+
+    erase_type_t *et = NULL;
+    for (int i = 0; i < max_erase_types; i++)
+    {
+        erase_type_t *t = &erase_types[i];
+        if (t->inst && addr_inst(t->inst) && (addr % t->size) == 0 && t->size <= size && (et == NULL || t->size > et->size))
+        {
+            et = t;
+        }
+    }
+
+    if (et == NULL || op_pending)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    lock_op();
+
+    if (pool)
+    {
+        pool->erasing(addr, et->size);
+    }
+
+    write_enable();
+    cmd(et->inst, addr);
+    wait_for_command_completion();
+
+    begin_op(addr, et->size, &et->time_us);
+    *erased = et->size;
+
+    return ESP_OK;
+}
+
+// Called with the op lock and the bus locked, lets go of the bus
+void ExtFlash::begin_op(size_t addr, size_t size, uint32_t *estimate_us)
+{
+    op_pending = true;
+    op_addr = addr;
+    op_size = size;
+    op_start = esp_timer_get_time();
+    op_estimate = estimate_us;
+
+    busy_addr = addr;
+    busy_size = size;
+    erasing = true;
+
+    eraser = xTaskGetCurrentTaskHandle();
+
+    unlock_bus();
+}
+
+// How long to leave the chip be before asking op_busy(), which is most of
+// the expected time and then a fraction of it, as in wait_for_busy()
+uint32_t ExtFlash::op_wait_us()
+{
+    if (!op_pending)
+    {
+        return 0;
+    }
+
+    uint32_t expect = op_estimate ? *op_estimate : 0;
+    int64_t due = op_start + expect - expect / 4;
+    int64_t now = esp_timer_get_time();
+
+    if (now < due)
+    {
+        return due - now;
+    }
+
+    return expect / 32 > min_poll_us ? expect / 32 : min_poll_us;
+}
+
+bool ExtFlash::op_busy()
+{
+    if (!op_pending)
+    {
+        return false;
+    }
+
+    uint32_t expect = op_estimate ? *op_estimate : 0;
+    if (esp_timer_get_time() < op_start + expect - expect / 4)
+    {
+        return true;
+    }
+
+    lock_bus(EXT_FLASH_PRIORITY_BULK);
+    bool busy = read_status_register1() & sr1_wip;
+    unlock_bus();
+
+    return busy;
+}
+
+esp_err_t ExtFlash::finish_op()
+{
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (!op_pending)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    lock_bus(EXT_FLASH_PRIORITY_BULK);
+
+    // Whoever finishes the op waits out the erase
+    eraser = xTaskGetCurrentTaskHandle();
+    wait_for_device_idle();
+
+    if (op_estimate)
+    {
+        uint32_t took = esp_timer_get_time() - op_start;
+        *op_estimate = *op_estimate ? (3 * *op_estimate + took) / 4 : took;
+    }
+
+    op_pending = false;
+    erasing = false;
+
+    if (pool)
+    {
+        pool->erased(op_addr, op_size);
+    }
+
+    invalidate_buffers(op_addr, op_size);
+
+    unlock_op();
+
+    return ESP_OK;
+}
+
+// Programs outside an erase begun by start_erase() without waiting for it,
+// by suspending it on chips that allow programs while an erase is suspended
+// (see wb_w25q_base::set_suspend_mode()).  Otherwise, or if the erase is
+// already done, it waits for the chip to be idle first.  Only for the task
+// that started the erase.
+esp_err_t ExtFlash::program_during_erase(size_t addr, const void *src, size_t size)
+{
+    ESP_LOGD(TAG, "%s - addr=0x%08x size=%d", __func__, addr, size);
+
+    if (addr > capacity || size > capacity - addr)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (!op_pending)
+    {
+        return write(addr, src, size);
+    }
+
+    if (addr < op_addr + op_size && op_addr < addr + size)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const uint8_t *bytes = (const uint8_t *) src;
+    size_t start = addr;
+    size_t total = size;
+    esp_err_t err = ESP_OK;
+
+    lock_bus(EXT_FLASH_PRIORITY_BULK);
+
+    if (pool)
+    {
+        pool->written(addr, size);
+    }
+
+    bool suspended = suspend();
+    if (!suspended)
+    {
+        wait_for_device_idle();
+    }
+
+    // Readers go straight to the chip while it's suspended
+    erasing = false;
+
+    while (size > 0)
+    {
+        size_t len = pagesize - (addr % pagesize);
+        if (len > size)
+        {
+            len = size;
+        }
+
+        stage_page(addr, bytes, len);
+        stage_submit();
+        wait_for_page_program(addr, len, false);
+
+        // A program the chip turned down leaves write enable set
+        if (read_status_register1() & sr1_wel)
+        {
+            ESP_LOGE(TAG, "program at 0x%08x during erase not done", addr);
+            err = ESP_FAIL;
+            break;
+        }
+
+        addr += len;
+        bytes += len;
+        size -= len;
+
+        if (size > 0)
+        {
+            unlock_bus();
+            lock_bus(EXT_FLASH_PRIORITY_BULK);
+        }
+    }
+
+    if (suspended)
+    {
+        resume();
+    }
+
+    erasing = true;
+
+    eraser = xTaskGetCurrentTaskHandle();
+
+    invalidate_buffers(start, total);
+
+    unlock_bus();
+
+    return err;
+}
+
+void ExtFlash::stage_page(size_t addr, const uint8_t *src, size_t size)
+{
+    stage_begin();
+    write_enable();
+    page_program(addr, src, size);
+    stage_end();
+}
+
+void ExtFlash::page_program(size_t addr, const uint8_t *src, size_t size)
+{
+    cmd(false, CMD_PAGE_PROGRAM, addr, (uint8_t *) src, size);
+}
+
+// Rather than polling all the way, follow a full page program with status
+// register reads that keep the bus clocking for most of the time the program
+// takes, so the task sleeps on the driver instead of spinning, and only poll
+// for the last stretch.  The chip streams SR1 continuously, so an idle byte in
+// the reads means they ran too long and the number of polls afterwards means
+// they stopped too early.  Either way tpp_us gets nudged for the next page.
+//
+// With other chips on the bus the reads would keep them off it, so the task
+// sleeps for tpp_us instead, and tpp_us follows the polls afterwards the same
+// way.  Unless an erase is suspended underneath, it lets go of the bus while
+// it sleeps, as it would during an erase, so readers of the chip get in.
+void ExtFlash::wait_for_page_program(size_t addr, size_t size, bool share)
+{
+    if (spibus->shared())
+    {
+        wait_for_command_completion();
+
+        if (share)
+        {
+            busy_addr = addr;
+            busy_size = size;
+            erasing = true;
+
+            eraser = xTaskGetCurrentTaskHandle();
+        }
+
+        sleep_us(size == pagesize ? tpp_us : tpp_us * size / pagesize);
+
+        int polls = 0;
+        while (read_status_register1() & sr1_wip)
+        {
+            sleep_us(min_poll_us);
+            polls++;
+        }
+
+        if (share)
+        {
+            erasing = false;
+        }
+
+        if (size != pagesize)
+        {
+            return;
+        }
+
+        if (polls == 0)
+        {
+            tpp_us -= tpp_us / 16;
+        }
+        else if (polls > 2 && tpp_us < max_tpp_us)
+        {
+            tpp_us += tpp_us / 32 + 1;
+        }
+        return;
+    }
+
+    if (size != pagesize)
+    {
+        wait_for_device_idle();
+        return;
+    }
+
+    const uint32_t clocks = is_qpi ? 2 : 8;
+    size_t total = tpp_us * cfg.speed_mhz / clocks;
+    size_t len = 0;
+
+    while (total > 0)
+    {
+        len = total < status_burst ? total : status_burst;
+        cmd(true, CMD_READ_STATUS_REG1, status_buf, len);
+        total -= len;
+    }
+    wait_for_command_completion();
+
+    if (len > 0 && !(status_buf[len - 1] & sr1_wip))
+    {
+        size_t i = 0;
+        while (status_buf[i] & sr1_wip)
+        {
+            i++;
+        }
+
+        // When the last read started out idle there's no telling by how much
+        uint32_t over = (i > 0 ? len - i : len) * clocks / cfg.speed_mhz;
+        over += tpp_us / 16;
+
+        tpp_us = tpp_us > over ? tpp_us - over : 0;
+        return;
+    }
+
+    int polls = 0;
+    while (read_status_register1() & sr1_wip)
+    {
+        polls++;
+    }
+
+    if (polls > 2 && tpp_us < max_tpp_us)
+    {
+        tpp_us += tpp_us / 32 + 1;
+    }
+}
+
+esp_err_t ExtFlash::read(size_t addr, void *dest, size_t size)
+{
+    ESP_LOGD(TAG, "%s - addr=0x%08x size=%d", __func__, addr, size);
+
+    esp_err_t err;
+
+    lock_bus();
+
+    // Reads of a sector or more are better off going straight to the chip
+    // unless they're part of a stream
+    if (!(ahead && ahead_read(addr, (uint8_t *) dest, size, &err)))
+    {
+        if (cache && size < sector_sz)
+        {
+            err = cache_read(addr, (uint8_t *) dest, size);
+        }
+        else
+        {
+            err = chip_read(addr, dest, size);
+        }
+    }
+
+    unlock_bus();
+
+    return err;
+}
+
+// Called with the bus locked
+esp_err_t ExtFlash::chip_read(size_t addr, void *dest, size_t size)
+{
+    bool suspended = suspend_for_read(addr, size);
+
+    esp_err_t err = queue_read(addr, dest, size);
+
+    wait_for_command_completion();
+
+    if (suspended)
+    {
+        resume();
+    }
+
+    return err;
+}
+
+// Called with the bus locked, see ExtFlashCache::admit() for when a miss
+// reads the whole sector into the cache
+esp_err_t ExtFlash::cache_read(size_t addr, uint8_t *dest, size_t size)
+{
+    esp_err_t err = ESP_OK;
+
+    while (size > 0 && err == ESP_OK)
+    {
+        size_t sector = addr / sector_sz;
+        size_t off = addr % sector_sz;
+        size_t len = sector_sz - off;
+
+        if (len > size)
+        {
+            len = size;
+        }
+
+        uint8_t *data = cache->lookup(sector);
+        if (data == NULL && cache->admit(sector))
+        {
+            data = cache->replace(sector);
+            if (data)
+            {
+                err = chip_read(sector * sector_sz, data, sector_sz);
+                if (!cache->filled(data, err == ESP_OK))
+                {
+                    data = NULL;
+                }
+                if (err != ESP_OK)
+                {
+                    break;
+                }
+            }
+        }
+
+        if (data)
+        {
+            memcpy(dest, data + off, len);
+        }
+        else
+        {
+            err = chip_read(addr, dest, len);
+        }
+
+        addr += len;
+        dest += len;
+        size -= len;
+    }
+
+    return err;
+}
+
+// Called with the bus locked.  Returns false when the read isn't part of a
+// sequential stream (yet) and has to be done some other way.
+bool ExtFlash::ahead_read(size_t addr, uint8_t *dest, size_t size, esp_err_t *err)
+{
+    // Reads this large gain nothing from going through the buffers
+    if (size >= ahead->max_size())
+    {
+        return false;
+    }
+
+    ExtFlashReadAhead::stream_t *s = ahead->find(addr);
+
+    if (s == NULL)
+    {
+        s = ahead->lru();
+        ahead_wait(s);
+        ahead->restart(s, addr + size);
+
+        return false;
+    }
+
+    if (s->next == addr)
+    {
+        s->run++;
+    }
+    s->next = addr + size;
+
+    if (s->run < ExtFlashReadAhead::min_run)
+    {
+        return false;
+    }
+
+    *err = ESP_OK;
+
+    while (size > 0)
+    {
+        ExtFlashReadAhead::buffer_t *b = ahead->buffer(s, addr);
+        if (b == NULL)
+        {
+            break;
+        }
+
+        wait_for_handle(b->handle);
+
+        size_t off = addr - b->addr;
+        size_t len = b->len - off;
+        if (len > size)
+        {
+            len = size;
+        }
+
+        memcpy(dest, b->data + off, len);
+
+        addr += len;
+        dest += len;
+        size -= len;
+
+        if (addr == b->addr + b->len)
+        {
+            b->len = 0;
+            ahead->used_up(s);
+        }
+    }
+
+    if (size > 0)
+    {
+        // Only starting out or the reader got past what was read ahead
+        ahead->miss();
+        ahead_wait(s);
+        ahead->dropped(s);
+
+        *err = chip_read(addr, dest, size);
+    }
+    else
+    {
+        ahead->hit();
+    }
+
+    ahead_fill(s);
+
+    return true;
+}
+
+// Queue reads of what comes next into the stream's empty buffers
+void ExtFlash::ahead_fill(ExtFlashReadAhead::stream_t *s)
+{
+    if (s->ahead < s->next)
+    {
+        s->ahead = s->next;
+    }
+
+    for (size_t i = 0; i < ahead->buffer_count(); i++)
+    {
+        ExtFlashReadAhead::buffer_t *b = &s->bufs[i];
+
+        // Skipped over by the reader
+        if (b->len != 0 && b->addr + b->len <= s->next)
+        {
+            b->len = 0;
+        }
+
+        if (b->len != 0 || s->ahead >= capacity)
+        {
+            continue;
+        }
+
+        size_t len = s->window;
+        if (len > capacity - s->ahead)
+        {
+            len = capacity - s->ahead;
+        }
+
+        bool suspended = suspend_for_read(s->ahead, len);
+
+        esp_err_t err = queue_read(s->ahead, b->data, len);
+        if (err == ESP_OK)
+        {
+            ahead->issued(s, b, s->ahead, len, issued);
+        }
+
+        if (suspended)
+        {
+            resume();
+        }
+
+        if (err != ESP_OK)
+        {
+            break;
+        }
+    }
+}
+
+// Read-aheads have to be done before their buffers are reused
+void ExtFlash::ahead_wait(ExtFlashReadAhead::stream_t *s)
+{
+    for (size_t i = 0; i < ahead->buffer_count(); i++)
+    {
+        if (s->bufs[i].len != 0)
+        {
+            wait_for_handle(s->bufs[i].handle);
+        }
+    }
+}
+
+void ExtFlash::wait_for_handle(ext_flash_handle_t handle)
+{
+    while ((int32_t) (completed - handle) < 0)
+    {
+        if (!reap(portMAX_DELAY))
+        {
+            break;
+        }
+    }
+}
+
+void ExtFlash::invalidate_buffers(size_t addr, size_t size)
+{
+    if (cache)
+    {
+        cache->invalidate(addr, size);
+    }
+
+    if (ahead)
+    {
+        ahead->invalidate(addr, size);
+    }
+}
+
+// Sequential reads are served from buffers read ahead of them, which writes
+// and erases keep up to date.  NULL detaches it.
+esp_err_t ExtFlash::set_read_ahead(ExtFlashReadAhead *ahead)
+{
+    ESP_LOGD(TAG, "%s - ahead=%p", __func__, ahead);
+
+    lock_bus();
+
+    // Nothing may still be reading into the old buffers
+    wait_for_command_completion();
+
+    if (ahead)
+    {
+        ahead->invalidate(0, capacity);
+    }
+    this->ahead = ahead;
+
+    unlock_bus();
+
+    return ESP_OK;
+}
+
+// Reads smaller than a sector are served from the cache, which writes and
+// erases keep up to date.  NULL detaches it.
+esp_err_t ExtFlash::set_cache(ExtFlashCache *cache)
+{
+    ESP_LOGD(TAG, "%s - cache=%p", __func__, cache);
+
+    if (cache && cache->sector_size() != sector_sz)
+    {
+        ESP_LOGE(TAG, "cache sector size must match the flash sector size %d", sector_sz);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    lock_bus();
+
+    if (cache)
+    {
+        cache->invalidate_all();
+    }
+    this->cache = cache;
+
+    unlock_bus();
+
+    return ESP_OK;
+}
+
+// Erases skip sectors the pool knows are blank and writes take them out of
+// it.  NULL detaches it.
+esp_err_t ExtFlash::set_pool(ExtFlashPool *pool)
+{
+    ESP_LOGD(TAG, "%s - pool=%p", __func__, pool);
+
+    if (pool && pool->sector_size() != sector_sz)
+    {
+        ESP_LOGE(TAG, "pool sector size must match the flash sector size %d", sector_sz);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    lock_op();
+    this->pool = pool;
+    unlock_op();
+
+    return ESP_OK;
+}
+
+// Marks the sectors wholly inside the range as no longer needed, for
+// erase_discarded() to erase ahead of time
+esp_err_t ExtFlash::discard(size_t addr, size_t size)
+{
+    ESP_LOGD(TAG, "%s - addr=0x%08x size=%d", __func__, addr, size);
+
+    if (pool == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    lock_bus();
+    pool->discard(addr, size);
+    unlock_bus();
+
+    return ESP_OK;
+}
+
+// Erases discarded sectors with the largest erase that takes in nothing in
+// use, one erase per call, for an idle task to call until it returns
+// ESP_ERR_NOT_FOUND.  Reads get in the way they do during any erase.
+esp_err_t ExtFlash::erase_discarded()
+{
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (pool == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    lock_op();
+
+    size_t addr;
+    if (!pool->next_discarded(&addr))
+    {
+        unlock_op();
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    erase_type_t *et = NULL;
+    for (int i = 0; i < max_erase_types; i++)
+    {
+        erase_type_t *t = &erase_types[i];
+        if (t->inst && addr_inst(t->inst) && (et == NULL || t->size > et->size) && pool->erasable(addr - addr % t->size, t->size))
+        {
+            et = t;
+        }
+    }
+
+    if (et == NULL)
+    {
+        unlock_op();
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    addr -= addr % et->size;
+    pool->erasing(addr, et->size);
+
+    write_enable();
+    cmd(et->inst, addr);
+    wait_for_erase(addr, et->size, &et->time_us);
+
+    pool->erased(addr, et->size);
+    pool->erased_ahead(et->size);
+
+    invalidate_buffers(addr, et->size);
+
+    unlock_op();
+
+    return ESP_OK;
+}
+
+// Hands out a blank sector from the pool, or if there are none a discarded
+// one after erasing it
+esp_err_t ExtFlash::allocate_sector(size_t *sector)
+{
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (pool == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    size_t addr;
+
+    lock_bus();
+    bool blank = pool->take_blank(&addr);
+    unlock_bus();
+
+    if (blank)
+    {
+        *sector = addr / sector_sz;
+        return ESP_OK;
+    }
+
+    lock_op();
+
+    // erase_discarded() may have made some while waiting
+    if (!pool->take_blank(&addr))
+    {
+        if (!pool->take_discarded(&addr))
+        {
+            unlock_op();
+            return ESP_ERR_NOT_FOUND;
+        }
+
+        uint32_t *estimate = NULL;
+        for (int i = 0; i < max_erase_types; i++)
+        {
+            if (erase_types[i].inst == CMD_SECTOR_ERASE)
+            {
+                estimate = &erase_types[i].time_us;
+            }
+        }
+
+        write_enable();
+        cmd(CMD_SECTOR_ERASE, addr);
+        wait_for_erase(addr, sector_sz, estimate);
+
+        invalidate_buffers(addr, sector_sz);
+    }
+
+    unlock_op();
+
+    *sector = addr / sector_sz;
+
+    return ESP_OK;
+}
+
+esp_err_t ExtFlash::readv(const ext_flash_iovec_t *vec, size_t count)
+{
+    ESP_LOGD(TAG, "%s - count=%d", __func__, count);
+
+    esp_err_t err = ESP_OK;
+    bool session = crm_session;
+
+    // Readers wait out an erase of any part of the span
+    size_t lo = SIZE_MAX;
+    size_t hi = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (vec[i].size > 0)
+        {
+            lo = vec[i].addr < lo ? vec[i].addr : lo;
+            hi = vec[i].addr + vec[i].size > hi ? vec[i].addr + vec[i].size : hi;
+        }
+    }
+
+    lock_bus();
+
+    bool suspended = hi > lo && suspend_for_read(lo, hi - lo);
+
+    // Queue all segments back to back, staying in CRM between them so a
+    // segment read the same way as the one before skips the instruction
+    for (size_t i = 0; i < count && err == ESP_OK; i++)
+    {
+        crm_session = session || i + 1 < count;
+        err = queue_read(vec[i].addr, vec[i].dest, vec[i].size);
+    }
+    crm_session = session;
+
+    wait_for_command_completion();
+
+    if (suspended)
+    {
+        resume();
+    }
+
+    unlock_bus();
+
+    return err;
+}
+
+esp_err_t ExtFlash::read_async(size_t addr, void *dest, size_t size, ext_flash_handle_t *handle, ext_flash_callback_t cb, void *arg)
+{
+    ESP_LOGD(TAG, "%s - addr=0x%08x size=%d", __func__, addr, size);
+
+    if (size == 0)
+    {
+        *handle = completed;
+        if (cb)
+        {
+            cb(arg);
+        }
+        return ESP_OK;
+    }
+
+    lock_bus();
+
+    bool suspended = suspend_for_read(addr, size);
+
+    esp_err_t err = queue_read(addr, dest, size);
+    if (err == ESP_OK)
+    {
+        // The newest transaction is the request's last one and, with reaping
+        // being in order, still pending unless the ring drained completely
+        *handle = issued;
+        if (cb)
+        {
+            if (queued > 0)
+            {
+                completions[qnext].cb = cb;
+                completions[qnext].arg = arg;
+            }
+            else
+            {
+                cb(arg);
+            }
+        }
+    }
+
+    // Queued behind the read, so the erase carries on once it's done
+    if (suspended)
+    {
+        resume();
+    }
+
+    unlock_bus();
+
+    return err;
+}
+
+esp_err_t ExtFlash::wait(ext_flash_handle_t handle)
+{
+    esp_err_t err = ESP_OK;
+
+    lock_bus();
+
+    while ((int32_t) (completed - handle) < 0)
+    {
+        if (!reap(portMAX_DELAY))
+        {
+            err = ESP_ERR_INVALID_ARG;
+            break;
+        }
+    }
+
+    unlock_bus();
+
+    return err;
+}
+
+// Priority of the calling task's requests from now on, needs the scheduler.
+// Setting EXT_FLASH_PRIORITY_DEFAULT again frees the task's entry.
+esp_err_t ExtFlash::set_priority(ext_flash_priority_t priority)
+{
+    ESP_LOGD(TAG, "%s - priority=%d", __func__, priority);
+
+    if (sched_lock == NULL)
+    {
+        ESP_LOGE(TAG, "scheduler config value must be set to use priorities");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (priority < EXT_FLASH_PRIORITY_DEFAULT || priority > EXT_FLASH_PRIORITY_URGENT)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    xSemaphoreTake(sched_lock, portMAX_DELAY);
+
+    requester_t *r = find_requester();
+    if (r == NULL && priority != EXT_FLASH_PRIORITY_DEFAULT)
+    {
+        if (xSemaphoreTake(sched_free, 0) != pdTRUE)
+        {
+            xSemaphoreGive(sched_lock);
+            return ESP_ERR_NO_MEM;
+        }
+        r = claim_requester();
+    }
+
+    if (r)
+    {
+        r->priority = priority;
+        release_requester(r);
+    }
+
+    xSemaphoreGive(sched_lock);
+
+    return ESP_OK;
+}
+
+void ExtFlash::get_stats(ext_flash_stats_t *stats)
+{
+    *stats = this->stats;
+}
+
+void ExtFlash::reset_stats()
+{
+    stats = {};
+}
+
+bool ExtFlash::poll(ext_flash_handle_t handle)
+{
+    bool done = true;
+
+    lock_bus();
+
+    while ((int32_t) (completed - handle) < 0)
+    {
+        if (!reap(0))
+        {
+            done = false;
+            break;
+        }
+    }
+
+    unlock_bus();
+
+    return done;
+}
+
+// Reads the range through two small DMA buffers, handing each chunk to fn
+// while the read of the next one is under way
+esp_err_t ExtFlash::stream(size_t addr, size_t size, stream_fn_t fn, void *arg)
+{
+    if (addr > capacity || size > capacity - addr)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (size == 0)
+    {
+        return ESP_OK;
+    }
+
+    uint8_t *bufs = (uint8_t *) heap_caps_malloc(2 * stream_chunk, MALLOC_CAP_DMA);
+    if (bufs == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    ext_flash_handle_t handles[2];
+    size_t len = size < stream_chunk ? size : stream_chunk;
+    size_t offset = 0;
+    int cur = 0;
+
+    esp_err_t err = read_async(addr, bufs, len, &handles[cur]);
+
+    while (err == ESP_OK)
+    {
+        size_t next = offset + len;
+        size_t nlen = size - next < stream_chunk ? size - next : stream_chunk;
+
+        if (nlen > 0)
+        {
+            err = read_async(addr + next, bufs + (cur ^ 1) * stream_chunk, nlen, &handles[cur ^ 1]);
+            if (err != ESP_OK)
+            {
+                // The current chunk is still in flight
+                wait(handles[cur]);
+                break;
+            }
+        }
+
+        err = wait(handles[cur]);
+
+        bool more = err == ESP_OK && fn(arg, offset, bufs + cur * stream_chunk, len);
+
+        if (nlen == 0)
+        {
+            break;
+        }
+
+        if (!more)
+        {
+            wait(handles[cur ^ 1]);
+            break;
+        }
+
+        offset = next;
+        len = nlen;
+        cur ^= 1;
+    }
+
+    heap_caps_free(bufs);
+
+    return err;
+}
+
+typedef struct
+{
+    const uint8_t *src;
+    size_t mismatch;
+} verify_state_t;
+
+static bool verify_chunk(void *arg, size_t offset, const uint8_t *data, size_t size)
+{
+    verify_state_t *v = (verify_state_t *) arg;
+
+    if (memcmp(data, v->src + offset, size) == 0)
+    {
+        return true;
+    }
+
+    size_t i = 0;
+    while (data[i] == v->src[offset + i])
+    {
+        i++;
+    }
+    v->mismatch = offset + i;
+
+    return false;
+}
+
+// Compares the flash with src, *mismatch is the offset of the first byte
+// that differs or size if none do
+esp_err_t ExtFlash::verify(size_t addr, const void *src, size_t size, size_t *mismatch)
+{
+    ESP_LOGD(TAG, "%s - addr=0x%08x size=%d", __func__, addr, size);
+
+    verify_state_t v = { (const uint8_t *) src, size };
+
+    esp_err_t err = stream(addr, size, verify_chunk, &v);
+
+    *mismatch = v.mismatch;
+
+    return err;
+}
+
+static bool crc32_chunk(void *arg, size_t offset, const uint8_t *data, size_t size)
+{
+    uint32_t *crc = (uint32_t *) arg;
+
+    *crc = crc32_le(*crc, data, size);
+
+    return true;
+}
+
+// The usual CRC-32, as zlib's crc32().  *crc is 0 to start a new one or the
+// result of an earlier call to carry on from it.
+esp_err_t ExtFlash::crc32(size_t addr, size_t size, uint32_t *crc)
+{
+    ESP_LOGD(TAG, "%s - addr=0x%08x size=%d", __func__, addr, size);
+
+    uint32_t c = *crc;
+
+    esp_err_t err = stream(addr, size, crc32_chunk, &c);
+    if (err == ESP_OK)
+    {
+        *crc = c;
+    }
+
+    return err;
+}
+
+static bool sha256_chunk(void *arg, size_t offset, const uint8_t *data, size_t size)
+{
+    mbedtls_sha256_update((mbedtls_sha256_context *) arg, data, size);
+
+    return true;
+}
+
+// Uses the SHA accelerator when mbedtls is set up to
+esp_err_t ExtFlash::sha256(size_t addr, size_t size, uint8_t digest[32])
+{
+    ESP_LOGD(TAG, "%s - addr=0x%08x size=%d", __func__, addr, size);
+
+    mbedtls_sha256_context ctx;
+
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+
+    esp_err_t err = stream(addr, size, sha256_chunk, &ctx);
+    if (err == ESP_OK)
+    {
+        mbedtls_sha256_finish(&ctx, digest);
+    }
+
+    mbedtls_sha256_free(&ctx);
 
-    return read_nocrm(CMD_FAST_READ, 8, addr, dest, size);
+    return err;
 }
 
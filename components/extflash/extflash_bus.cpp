@@ -0,0 +1,128 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+#include "extflash_bus.h"
+
+static const char *TAG = "extflash_bus";
+
+ExtFlashBus::ExtFlashBus()
+{
+    cfg = {};
+    initialized = false;
+    devices = 0;
+}
+
+ExtFlashBus::~ExtFlashBus()
+{
+    term();
+}
+
+esp_err_t ExtFlashBus::init(const ext_flash_bus_config_t *config)
+{
+    ESP_LOGD(TAG, "%s - vspi=%d dma_channel=%d", __func__, config->vspi, config->dma_channel);
+
+    term();
+
+    cfg = *config;
+
+    if (cfg.dma_channel != 1 && cfg.dma_channel != 2)
+    {
+        ESP_LOGE(TAG, "dma_channel config value must either 1 or 2");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if ((cfg.hd_io_num != -1) + (cfg.wp_io_num != -1) == 1)
+    {
+        ESP_LOGE(TAG, "hd_io_num and wp_io_num config values must both be set");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (cfg.max_dma_size == 0)
+    {
+        cfg.max_dma_size = SPI_MAX_DMA_LEN;
+    }
+
+    // Keeps continued word reads aligned
+    cfg.max_dma_size &= ~0x0f;
+
+    spi_bus_config_t buscfg =
+    {
+        .mosi_io_num = cfg.mosi_io_num,
+        .miso_io_num = cfg.miso_io_num,
+        .sclk_io_num = cfg.sck_io_num,
+        .quadwp_io_num = cfg.wp_io_num,
+        .quadhd_io_num = cfg.hd_io_num,
+        .max_transfer_sz = cfg.max_dma_size
+    };
+
+    esp_err_t err = spi_bus_initialize(host(), &buscfg, cfg.dma_channel);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    initialized = true;
+    devices = 0;
+
+    return ESP_OK;
+}
+
+void ExtFlashBus::term()
+{
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (!initialized)
+    {
+        return;
+    }
+
+    if (devices != 0)
+    {
+        ESP_LOGE(TAG, "%d chips are still on the bus", devices);
+        return;
+    }
+
+    spi_bus_free(host());
+    initialized = false;
+}
+
+const ext_flash_bus_config_t *ExtFlashBus::config()
+{
+    return &cfg;
+}
+
+spi_host_device_t ExtFlashBus::host()
+{
+    return cfg.vspi ? VSPI_HOST : HSPI_HOST;
+}
+
+// Called by ExtFlash as chips are added to and removed from the bus
+void ExtFlashBus::attach()
+{
+    devices++;
+}
+
+void ExtFlashBus::detach()
+{
+    devices--;
+}
+
+// Whether other chips may want the bus while one is busy
+bool ExtFlashBus::shared()
+{
+    return devices > 1;
+}
@@ -0,0 +1,300 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#include "extflash_cache.h"
+
+static const char *TAG = "extflash_cache";
+
+ExtFlashCache::ExtFlashCache()
+{
+    cfg = {};
+    sector_sz = 0;
+
+    slots = NULL;
+    data = NULL;
+    tick = 0;
+    hand = 0;
+
+    ghosts = NULL;
+    nghosts = 0;
+    ghost_next = 0;
+
+    stats = {};
+}
+
+ExtFlashCache::~ExtFlashCache()
+{
+    term();
+}
+
+esp_err_t ExtFlashCache::init(const ext_flash_cache_config_t *config, size_t sector_size)
+{
+    ESP_LOGD(TAG, "%s - sectors=%d sector_size=%d", __func__, config->sectors, sector_size);
+
+    term();
+
+    cfg = *config;
+
+    if (cfg.sectors == 0 || sector_size == 0)
+    {
+        ESP_LOGE(TAG, "sectors config value and sector size must be greater than 0");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    sector_sz = sector_size;
+
+    slots = new slot_t[cfg.sectors]();
+    ghosts = new size_t[cfg.sectors];
+    if (slots == NULL || ghosts == NULL)
+    {
+        term();
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Internal RAM the SPI DMA can fill directly, PSRAM goes through the
+    // bounce buffers
+    data = (uint8_t *) heap_caps_malloc(cfg.sectors * sector_sz,
+                                        cfg.psram ? MALLOC_CAP_SPIRAM : MALLOC_CAP_DMA);
+    if (data == NULL)
+    {
+        term();
+        return ESP_ERR_NO_MEM;
+    }
+
+    tick = 0;
+    hand = 0;
+    nghosts = 0;
+    ghost_next = 0;
+    stats = {};
+
+    return ESP_OK;
+}
+
+void ExtFlashCache::term()
+{
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (slots)
+    {
+        delete [] slots;
+        slots = NULL;
+    }
+
+    if (ghosts)
+    {
+        delete [] ghosts;
+        ghosts = NULL;
+    }
+
+    if (data)
+    {
+        heap_caps_free(data);
+        data = NULL;
+    }
+
+    cfg.sectors = 0;
+}
+
+size_t ExtFlashCache::sector_size()
+{
+    return sector_sz;
+}
+
+void ExtFlashCache::get_stats(ext_flash_cache_stats_t *stats)
+{
+    *stats = this->stats;
+}
+
+void ExtFlashCache::reset_stats()
+{
+    stats = {};
+}
+
+// Returns the cached copy of a sector or NULL if it isn't cached
+uint8_t *ExtFlashCache::lookup(size_t sector)
+{
+    for (size_t i = 0; i < cfg.sectors; i++)
+    {
+        slot_t *s = &slots[i];
+        if (s->state == slot_valid && s->sector == sector)
+        {
+            s->used = ++tick;
+            s->ref = true;
+            stats.hits++;
+
+            return &data[i * sector_sz];
+        }
+    }
+
+    return NULL;
+}
+
+// Whether a sector that missed is worth filling.  A sector is only cached
+// when it misses a second time while still remembered from the first, so
+// one-off reads get just the bytes they asked for instead of a sector fill
+// that would also push out sectors in use.
+bool ExtFlashCache::admit(size_t sector)
+{
+    stats.misses++;
+
+    for (size_t i = 0; i < nghosts; i++)
+    {
+        if (ghosts[i] == sector)
+        {
+            ghosts[i] = ghosts[--nghosts];
+            if (ghost_next > nghosts)
+            {
+                ghost_next = nghosts;
+            }
+            return true;
+        }
+    }
+
+    if (nghosts < cfg.sectors)
+    {
+        ghost_next = nghosts++;
+    }
+    ghosts[ghost_next] = sector;
+    ghost_next = (ghost_next + 1) % cfg.sectors;
+
+    return false;
+}
+
+// Gives a slot to a sector that wasn't cached, or NULL if every slot is
+// being filled.  The caller fills it and then calls filled(), until which
+// the slot is neither looked up nor replaced.
+uint8_t *ExtFlashCache::replace(size_t sector)
+{
+    size_t victim = cfg.sectors;
+
+    for (size_t i = 0; i < cfg.sectors && victim == cfg.sectors; i++)
+    {
+        if (slots[i].state == slot_empty)
+        {
+            victim = i;
+        }
+    }
+
+    if (victim == cfg.sectors)
+    {
+        if (cfg.clock)
+        {
+            // Sweep past the recently used ones, taking their second
+            // chance, twice round at most
+            for (size_t i = 0; i < 2 * cfg.sectors && victim == cfg.sectors; i++)
+            {
+                slot_t *s = &slots[hand];
+                if (s->state == slot_valid && !s->ref)
+                {
+                    victim = hand;
+                }
+                s->ref = false;
+                hand = (hand + 1) % cfg.sectors;
+            }
+        }
+        else
+        {
+            for (size_t i = 0; i < cfg.sectors; i++)
+            {
+                if (slots[i].state == slot_valid &&
+                    (victim == cfg.sectors || (int32_t) (slots[i].used - slots[victim].used) < 0))
+                {
+                    victim = i;
+                }
+            }
+        }
+
+        if (victim == cfg.sectors)
+        {
+            return NULL;
+        }
+
+        stats.evictions++;
+    }
+
+    slot_t *s = &slots[victim];
+    s->sector = sector;
+    s->used = ++tick;
+    s->ref = false;
+    s->state = slot_filling;
+
+    return &data[victim * sector_sz];
+}
+
+// Ends the fill of a slot from replace().  Returns whether the slot now
+// holds the sector, which it doesn't if the read failed or the sector was
+// invalidated meanwhile.
+bool ExtFlashCache::filled(uint8_t *buf, bool ok)
+{
+    slot_t *s = &slots[(buf - data) / sector_sz];
+
+    if (ok && s->state == slot_filling)
+    {
+        s->state = slot_valid;
+        stats.fills++;
+        return true;
+    }
+
+    s->state = slot_empty;
+
+    return false;
+}
+
+void ExtFlashCache::invalidate(size_t addr, size_t size)
+{
+    if (size == 0)
+    {
+        return;
+    }
+
+    size_t first = addr / sector_sz;
+    size_t last = (addr + size - 1) / sector_sz;
+
+    for (size_t i = 0; i < cfg.sectors; i++)
+    {
+        slot_t *s = &slots[i];
+        if (s->state != slot_empty && s->sector >= first && s->sector <= last)
+        {
+            if (s->state == slot_valid)
+            {
+                s->state = slot_empty;
+                stats.invalidations++;
+            }
+            else
+            {
+                s->state = slot_dropped;
+            }
+        }
+    }
+}
+
+void ExtFlashCache::invalidate_all()
+{
+    for (size_t i = 0; i < cfg.sectors; i++)
+    {
+        if (slots[i].state == slot_valid)
+        {
+            slots[i].state = slot_empty;
+            stats.invalidations++;
+        }
+        else if (slots[i].state == slot_filling)
+        {
+            slots[i].state = slot_dropped;
+        }
+    }
+}
@@ -0,0 +1,737 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#include "extflash_ftl.h"
+
+static const char *TAG = "extflash_ftl";
+
+ExtFlashFtl::ExtFlashFtl()
+{
+    cfg = {};
+    flash = NULL;
+    lock = NULL;
+
+    sector_sz = 0;
+    nsectors = 0;
+    slots = 0;
+    nblocks = 0;
+
+    map = NULL;
+    sectors = NULL;
+    nfree = 0;
+    head = -1;
+    head_slot = 0;
+    seq = 0;
+    collecting = false;
+
+    buf = NULL;
+    gc_buf = NULL;
+    entries = NULL;
+
+    stats = {};
+}
+
+ExtFlashFtl::~ExtFlashFtl()
+{
+    term();
+}
+
+esp_err_t ExtFlashFtl::init(ExtFlash *flash, const ext_flash_ftl_config_t *config)
+{
+    ESP_LOGD(TAG, "%s - start=0x%08x size=%d block_size=%d", __func__, config->start, config->size, config->block_size);
+
+    term();
+
+    cfg = *config;
+    sector_sz = flash->sector_size();
+
+    if (cfg.block_size == 0)
+    {
+        cfg.block_size = default_block_size;
+    }
+
+    if (cfg.wear_threshold == 0)
+    {
+        cfg.wear_threshold = default_wear_threshold;
+    }
+
+    if ((cfg.start % sector_sz) != 0 || (cfg.size % sector_sz) != 0 || cfg.start + cfg.size > flash->chip_size())
+    {
+        ESP_LOGE(TAG, "start and size config values must be sector aligned and on the chip");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if ((sector_sz % cfg.block_size) != 0 || sizeof(header_t) + (sector_sz / cfg.block_size - 1) * sizeof(uint32_t) > cfg.block_size)
+    {
+        ESP_LOGE(TAG, "block_size config value must divide the sector size and hold a sector header");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    nsectors = cfg.size / sector_sz;
+    if (cfg.spare_sectors == 0)
+    {
+        cfg.spare_sectors = 2 + nsectors / 8;
+    }
+
+    if (cfg.spare_sectors < 2 || (int) cfg.spare_sectors >= nsectors)
+    {
+        ESP_LOGE(TAG, "spare_sectors config value must be at least 2 and leave sectors to use");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    slots = sector_sz / cfg.block_size;
+    nblocks = (nsectors - cfg.spare_sectors) * (slots - 1);
+
+    map = new uint32_t[nblocks];
+    sectors = new sector_t[nsectors]();
+    entries = new uint32_t[slots - 1];
+    buf = (uint8_t *) heap_caps_malloc(cfg.block_size, MALLOC_CAP_DMA);
+    gc_buf = (uint8_t *) heap_caps_malloc(cfg.block_size, MALLOC_CAP_DMA);
+    lock = xSemaphoreCreateMutex();
+    if (map == NULL || sectors == NULL || entries == NULL || buf == NULL || gc_buf == NULL || lock == NULL)
+    {
+        term();
+        return ESP_ERR_NO_MEM;
+    }
+
+    this->flash = flash;
+    stats = {};
+
+    esp_err_t err = mount();
+    if (err != ESP_OK)
+    {
+        term();
+        return err;
+    }
+
+    return ESP_OK;
+}
+
+void ExtFlashFtl::term()
+{
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (map)
+    {
+        delete [] map;
+        map = NULL;
+    }
+
+    if (sectors)
+    {
+        delete [] sectors;
+        sectors = NULL;
+    }
+
+    if (entries)
+    {
+        delete [] entries;
+        entries = NULL;
+    }
+
+    if (buf)
+    {
+        heap_caps_free(buf);
+        buf = NULL;
+    }
+
+    if (gc_buf)
+    {
+        heap_caps_free(gc_buf);
+        gc_buf = NULL;
+    }
+
+    if (lock)
+    {
+        vSemaphoreDelete(lock);
+        lock = NULL;
+    }
+
+    flash = NULL;
+    nsectors = 0;
+    nblocks = 0;
+    head = -1;
+}
+
+size_t ExtFlashFtl::size()
+{
+    return nblocks * cfg.block_size;
+}
+
+size_t ExtFlashFtl::block_size()
+{
+    return cfg.block_size;
+}
+
+typedef struct
+{
+    uint32_t seq;
+    int sector;
+} mount_order_t;
+
+static int by_seq(const void *a, const void *b)
+{
+    uint32_t sa = ((const mount_order_t *) a)->seq;
+    uint32_t sb = ((const mount_order_t *) b)->seq;
+
+    return sa < sb ? -1 : sa > sb;
+}
+
+// Rebuild the map from the sector headers.  Replaying the sectors in the
+// order they were opened leaves every block mapped to its newest copy, so
+// copies left behind by a write or reclaim cut short are simply stale.
+// Sectors without a header may be half erased and get erased before use,
+// the sector that was being filled is treated as full.
+esp_err_t ExtFlashFtl::mount()
+{
+    mount_order_t *order = new mount_order_t[nsectors];
+    if (order == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    uint64_t total_erases = 0;
+    int used = 0;
+
+    for (uint32_t i = 0; i < nblocks; i++)
+    {
+        map[i] = unmapped;
+    }
+
+    seq = 0;
+    for (int s = 0; s < nsectors; s++)
+    {
+        header_t hdr;
+        esp_err_t err = flash->read(cfg.start + s * sector_sz, &hdr, sizeof(hdr));
+        if (err != ESP_OK)
+        {
+            delete [] order;
+            return err;
+        }
+
+        sector_t *sec = &sectors[s];
+        if (hdr.magic == header_magic && hdr.block_size == cfg.block_size)
+        {
+            sec->state = sector_full;
+            sec->erases = hdr.erases;
+            order[used].seq = hdr.seq;
+            order[used].sector = s;
+            used++;
+
+            total_erases += hdr.erases;
+            seq = hdr.seq > seq ? hdr.seq : seq;
+        }
+        else
+        {
+            sec->state = sector_free;
+            sec->dirty = true;
+        }
+        sec->valid = 0;
+    }
+
+    qsort(order, used, sizeof(mount_order_t), by_seq);
+
+    for (int i = 0; i < used; i++)
+    {
+        int s = order[i].sector;
+
+        esp_err_t err = flash->read(cfg.start + s * sector_sz + sizeof(header_t), entries, (slots - 1) * sizeof(uint32_t));
+        if (err != ESP_OK)
+        {
+            delete [] order;
+            return err;
+        }
+
+        for (uint32_t slot = 1; slot < slots; slot++)
+        {
+            uint32_t block = entries[slot - 1];
+            if (block < nblocks)
+            {
+                map[block] = s * slots + slot;
+            }
+        }
+    }
+
+    delete [] order;
+
+    // Wear of sectors without a header is unknown, so take the average
+    uint32_t average = used ? total_erases / used : 0;
+
+    nfree = 0;
+    for (int s = 0; s < nsectors; s++)
+    {
+        if (sectors[s].state == sector_free)
+        {
+            sectors[s].erases = average;
+            nfree++;
+        }
+    }
+
+    for (uint32_t i = 0; i < nblocks; i++)
+    {
+        if (map[i] != unmapped)
+        {
+            sectors[map[i] / slots].valid++;
+        }
+    }
+
+    head = -1;
+    head_slot = 0;
+    collecting = false;
+
+    ESP_LOGD(TAG, "%s - %d sectors in use, %d free", __func__, used, nfree);
+
+    return ESP_OK;
+}
+
+size_t ExtFlashFtl::block_addr(uint32_t phys)
+{
+    return cfg.start + phys * cfg.block_size;
+}
+
+size_t ExtFlashFtl::entry_addr(uint32_t phys)
+{
+    return cfg.start + (phys / slots) * sector_sz + sizeof(header_t) + (phys % slots - 1) * sizeof(uint32_t);
+}
+
+esp_err_t ExtFlashFtl::read(size_t addr, void *dest, size_t size)
+{
+    ESP_LOGD(TAG, "%s - addr=0x%08x size=%d", __func__, addr, size);
+
+    if (map == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (addr > this->size() || size > this->size() - addr)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint8_t *bytes = (uint8_t *) dest;
+    esp_err_t err = ESP_OK;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+
+    while (size > 0 && err == ESP_OK)
+    {
+        uint32_t block = addr / cfg.block_size;
+        size_t offset = addr % cfg.block_size;
+        size_t len = cfg.block_size - offset;
+        if (len > size)
+        {
+            len = size;
+        }
+
+        if (map[block] == unmapped)
+        {
+            memset(bytes, 0xff, len);
+        }
+        else
+        {
+            err = flash->read(block_addr(map[block]) + offset, bytes, len);
+        }
+
+        addr += len;
+        bytes += len;
+        size -= len;
+    }
+
+    xSemaphoreGive(lock);
+
+    return err;
+}
+
+esp_err_t ExtFlashFtl::write(size_t addr, const void *src, size_t size)
+{
+    ESP_LOGD(TAG, "%s - addr=0x%08x size=%d", __func__, addr, size);
+
+    if (map == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (addr > this->size() || size > this->size() - addr)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const uint8_t *bytes = (const uint8_t *) src;
+    esp_err_t err = ESP_OK;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+
+    while (size > 0 && err == ESP_OK)
+    {
+        uint32_t block = addr / cfg.block_size;
+        size_t offset = addr % cfg.block_size;
+        size_t len = cfg.block_size - offset;
+        if (len > size)
+        {
+            len = size;
+        }
+
+        // Partial blocks are merged with what's there
+        const uint8_t *data = bytes;
+        if (len != cfg.block_size)
+        {
+            err = read_block(block, buf);
+            memcpy(buf + offset, bytes, len);
+            data = buf;
+        }
+
+        if (err == ESP_OK)
+        {
+            err = write_block(block, data);
+            stats.writes++;
+        }
+
+        addr += len;
+        bytes += len;
+        size -= len;
+    }
+
+    xSemaphoreGive(lock);
+
+    return err;
+}
+
+esp_err_t ExtFlashFtl::read_block(uint32_t block, uint8_t *dest)
+{
+    if (map[block] == unmapped)
+    {
+        memset(dest, 0xff, cfg.block_size);
+        return ESP_OK;
+    }
+
+    return flash->read(block_addr(map[block]), dest, cfg.block_size);
+}
+
+// The data goes in before the slot's entry, so a block only shows up at
+// mount once it's complete
+esp_err_t ExtFlashFtl::write_block(uint32_t block, const uint8_t *src)
+{
+    uint32_t phys;
+
+    esp_err_t err = allocate(&phys);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    err = flash->write(block_addr(phys), src, cfg.block_size);
+    if (err == ESP_OK)
+    {
+        err = flash->write(entry_addr(phys), &block, sizeof(block));
+    }
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    if (map[block] != unmapped)
+    {
+        sectors[map[block] / slots].valid--;
+    }
+    map[block] = phys;
+    sectors[phys / slots].valid++;
+
+    return ESP_OK;
+}
+
+esp_err_t ExtFlashFtl::allocate(uint32_t *phys)
+{
+    esp_err_t err;
+
+    if (head < 0 && !collecting)
+    {
+        err = make_room();
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+    }
+
+    // Reclaiming may have opened one
+    if (head < 0)
+    {
+        err = open_sector();
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+    }
+
+    *phys = head * slots + head_slot++;
+
+    if (head_slot == slots)
+    {
+        sectors[head].state = sector_full;
+        head = -1;
+    }
+
+    return ESP_OK;
+}
+
+// Keep a free sector back for moving blocks out of the one being
+// reclaimed, and move cold data once wear has drifted too far apart
+esp_err_t ExtFlashFtl::make_room()
+{
+    while (nfree < 2)
+    {
+        esp_err_t err = reclaim(false);
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+    }
+
+    if (wear_spread() > cfg.wear_threshold)
+    {
+        return reclaim(true);
+    }
+
+    return ESP_OK;
+}
+
+// Fill the least worn free sector next
+esp_err_t ExtFlashFtl::open_sector()
+{
+    int s = -1;
+    for (int i = 0; i < nsectors; i++)
+    {
+        if (sectors[i].state == sector_free && (s < 0 || sectors[i].erases < sectors[s].erases))
+        {
+            s = i;
+        }
+    }
+
+    if (s < 0)
+    {
+        ESP_LOGE(TAG, "out of free sectors");
+        return ESP_ERR_NO_MEM;
+    }
+
+    sector_t *sec = &sectors[s];
+    if (sec->dirty)
+    {
+        esp_err_t err = erase(s);
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+    }
+
+    header_t hdr =
+    {
+        .magic = header_magic,
+        .seq = ++seq,
+        .erases = sec->erases,
+        .block_size = (uint32_t) cfg.block_size
+    };
+
+    esp_err_t err = flash->write(cfg.start + s * sector_sz, &hdr, sizeof(hdr));
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    sec->state = sector_open;
+    sec->valid = 0;
+    nfree--;
+
+    head = s;
+    head_slot = 1;
+
+    return ESP_OK;
+}
+
+esp_err_t ExtFlashFtl::erase(int sector)
+{
+    esp_err_t err = flash->erase_sector((cfg.start + sector * sector_sz) / sector_sz);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    sectors[sector].erases++;
+    sectors[sector].dirty = false;
+    stats.erases++;
+
+    return ESP_OK;
+}
+
+// The full sector with the fewest blocks to move or, to even out wear,
+// the least worn one still holding blocks
+int ExtFlashFtl::victim(bool wear)
+{
+    int v = -1;
+
+    for (int i = 0; i < nsectors; i++)
+    {
+        sector_t *sec = &sectors[i];
+        if (sec->state != sector_full)
+        {
+            continue;
+        }
+
+        if (wear)
+        {
+            if (sec->valid > 0 && (v < 0 || sec->erases < sectors[v].erases))
+            {
+                v = i;
+            }
+        }
+        else if (v < 0 || sec->valid < sectors[v].valid ||
+                 (sec->valid == sectors[v].valid && sec->erases < sectors[v].erases))
+        {
+            v = i;
+        }
+    }
+
+    return v;
+}
+
+uint32_t ExtFlashFtl::wear_spread()
+{
+    int cold = victim(true);
+    if (cold < 0)
+    {
+        return 0;
+    }
+
+    uint32_t most = 0;
+    for (int i = 0; i < nsectors; i++)
+    {
+        most = sectors[i].erases > most ? sectors[i].erases : most;
+    }
+
+    return most - sectors[cold].erases;
+}
+
+// Move the newest copies out of a sector and erase it
+esp_err_t ExtFlashFtl::reclaim(bool wear)
+{
+    int v = victim(wear);
+    if (v < 0 || (!wear && sectors[v].valid == slots - 1))
+    {
+        ESP_LOGE(TAG, "nothing to reclaim");
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err = flash->read(cfg.start + v * sector_sz + sizeof(header_t), entries, (slots - 1) * sizeof(uint32_t));
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    collecting = true;
+
+    for (uint32_t slot = 1; slot < slots && err == ESP_OK; slot++)
+    {
+        uint32_t block = entries[slot - 1];
+        if (block < nblocks && map[block] == v * slots + slot)
+        {
+            err = flash->read(block_addr(map[block]), gc_buf, cfg.block_size);
+            if (err == ESP_OK)
+            {
+                err = write_block(block, gc_buf);
+                stats.relocations++;
+            }
+        }
+    }
+
+    collecting = false;
+
+    if (err == ESP_OK)
+    {
+        err = erase(v);
+    }
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    sectors[v].state = sector_free;
+    sectors[v].valid = 0;
+    nfree++;
+
+    if (wear)
+    {
+        stats.wear_moves++;
+    }
+
+    return ESP_OK;
+}
+
+// Garbage collection for idle time, reclaims sectors until there are
+// free_sectors of them or nothing is left to gain
+esp_err_t ExtFlashFtl::collect(size_t free_sectors)
+{
+    ESP_LOGD(TAG, "%s - free_sectors=%d", __func__, free_sectors);
+
+    if (map == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t err = ESP_OK;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+
+    while (err == ESP_OK && nfree < (int) free_sectors)
+    {
+        int v = victim(false);
+        if (v < 0 || sectors[v].valid == slots - 1)
+        {
+            break;
+        }
+        err = reclaim(false);
+    }
+
+    // A cold sector may need a whole free sector to move into
+    if (err == ESP_OK && nfree > 0 && wear_spread() > cfg.wear_threshold)
+    {
+        err = reclaim(true);
+    }
+
+    xSemaphoreGive(lock);
+
+    return err;
+}
+
+void ExtFlashFtl::get_stats(ext_flash_ftl_stats_t *stats)
+{
+    *stats = this->stats;
+
+    stats->min_erases = nsectors ? UINT32_MAX : 0;
+    stats->max_erases = 0;
+    for (int i = 0; i < nsectors; i++)
+    {
+        stats->min_erases = sectors[i].erases < stats->min_erases ? sectors[i].erases : stats->min_erases;
+        stats->max_erases = sectors[i].erases > stats->max_erases ? sectors[i].erases : stats->max_erases;
+    }
+}
+
+void ExtFlashFtl::reset_stats()
+{
+    stats = {};
+}
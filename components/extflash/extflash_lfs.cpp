@@ -0,0 +1,101 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "extflash_lfs.h"
+
+#if __has_include("lfs.h")
+
+static const char *TAG = "extflash_lfs";
+
+static int part_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+{
+    ExtFlashPartition *part = (ExtFlashPartition *) c->context;
+
+    return part->read(block * c->block_size + off, buffer, size) == ESP_OK ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+static int part_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+{
+    ExtFlashPartition *part = (ExtFlashPartition *) c->context;
+
+    return part->write(block * c->block_size + off, buffer, size) == ESP_OK ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+static int part_erase(const struct lfs_config *c, lfs_block_t block)
+{
+    ExtFlashPartition *part = (ExtFlashPartition *) c->context;
+
+    return part->erase_range(block * c->block_size, c->block_size) == ESP_OK ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+static int part_sync(const struct lfs_config *c)
+{
+    ExtFlashPartition *part = (ExtFlashPartition *) c->context;
+
+    return part->sync() == ESP_OK ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+// Blocks are sectors and programs whole pages, which ExtFlash::write()
+// sends a page program each.  Reads go through ExtFlash::read() and so
+// the fastest read the chip was set up for and any cache or read-ahead.
+// LittleFS programs each block right after erasing it, so the partition
+// never gets to gather its erases into block erases.
+esp_err_t ext_flash_lfs_config(ExtFlashPartition *part, struct lfs_config *config)
+{
+    ESP_LOGD(TAG, "%s - label=%s", __func__, part->label());
+
+    config->context = part;
+    config->read = part_read;
+    config->prog = part_prog;
+    config->erase = part_erase;
+    config->sync = part_sync;
+
+    config->block_size = part->sector_size();
+    config->block_count = part->size() / part->sector_size();
+
+    if (config->read_size == 0)
+    {
+        config->read_size = 16;
+    }
+
+    if (config->prog_size == 0)
+    {
+        config->prog_size = part->page_size();
+    }
+
+    if (config->cache_size == 0)
+    {
+        config->cache_size = part->page_size();
+    }
+
+    if (config->lookahead_size == 0)
+    {
+        config->lookahead_size = 32;
+    }
+
+    if (config->block_cycles == 0)
+    {
+        config->block_cycles = 500;
+    }
+
+    if ((config->cache_size % config->prog_size) != 0 || (config->block_size % config->cache_size) != 0)
+    {
+        ESP_LOGE(TAG, "cache_size must be a multiple of prog_size and divide the sector size");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    return ESP_OK;
+}
+
+#endif
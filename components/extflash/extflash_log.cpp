@@ -0,0 +1,797 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string.h>
+
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#include "extflash_log.h"
+
+static const char *TAG = "extflash_log";
+
+#define PAD4(n) (((n) + 3) & ~3)
+
+// Fletcher-16 over the record's length and then its data
+static uint16_t record_check(uint16_t sum, const void *src, size_t size)
+{
+    const uint8_t *p = (const uint8_t *) src;
+    uint32_t a = sum & 0xff;
+    uint32_t b = sum >> 8;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        a = (a + p[i]) % 255;
+        b = (b + a) % 255;
+    }
+
+    return (b << 8) | a;
+}
+
+ExtFlashLog::ExtFlashLog()
+{
+    cfg = {};
+    flash = NULL;
+    lock = NULL;
+
+    sector_sz = 0;
+    page_sz = 0;
+    nsectors = 0;
+    base = 0;
+
+    tail_seq = 0;
+    discarded_seq = 0;
+    head_seq = 0;
+    head_off = 0;
+    prog_seq = 0;
+    prog_off = 0;
+    erased_seq = 0;
+    mounted = false;
+    erase_pending = false;
+
+    slots = NULL;
+    data = NULL;
+    first = 0;
+    used = 0;
+
+    buf = NULL;
+
+    stats = {};
+}
+
+ExtFlashLog::~ExtFlashLog()
+{
+    term();
+}
+
+esp_err_t ExtFlashLog::init(ExtFlash *flash, const ext_flash_log_config_t *config)
+{
+    ESP_LOGD(TAG, "%s - start=0x%08x size=%d erase_ahead=%d buffer_pages=%d", __func__,
+             config->start, config->size, config->erase_ahead, config->buffer_pages);
+
+    term();
+
+    cfg = *config;
+    sector_sz = flash->sector_size();
+    page_sz = flash->page_size();
+
+    if (cfg.erase_ahead == 0)
+    {
+        cfg.erase_ahead = default_erase_ahead;
+    }
+
+    if (cfg.buffer_pages == 0)
+    {
+        cfg.buffer_pages = default_buffer_pages;
+    }
+
+    if ((cfg.start % sector_sz) != 0 || (cfg.size % sector_sz) != 0 || cfg.start + cfg.size > flash->chip_size())
+    {
+        ESP_LOGE(TAG, "start and size config values must be sector aligned and on the chip");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    nsectors = cfg.size / sector_sz;
+    if (nsectors < cfg.erase_ahead + 2)
+    {
+        ESP_LOGE(TAG, "size config value must hold at least erase_ahead + 2 sectors");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    slots = new slot_t[cfg.buffer_pages]();
+    data = (uint8_t *) heap_caps_malloc(cfg.buffer_pages * page_sz, MALLOC_CAP_DMA);
+    buf = (uint8_t *) heap_caps_malloc(page_sz, MALLOC_CAP_DMA);
+    lock = xSemaphoreCreateMutex();
+    if (slots == NULL || data == NULL || buf == NULL || lock == NULL)
+    {
+        term();
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (size_t i = 0; i < cfg.buffer_pages; i++)
+    {
+        slots[i].data = &data[i * page_sz];
+    }
+
+    this->flash = flash;
+    first = 0;
+    used = 0;
+    erase_pending = false;
+    stats = {};
+
+    esp_err_t err = mount();
+    if (err != ESP_OK)
+    {
+        term();
+        return err;
+    }
+    mounted = true;
+
+    return ESP_OK;
+}
+
+// Programs what's still buffered, as sync() does, before letting go
+void ExtFlashLog::term()
+{
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (mounted)
+    {
+        xSemaphoreTake(lock, portMAX_DELAY);
+
+        esp_err_t err = drain(true);
+        if (err == ESP_OK)
+        {
+            err = discard();
+        }
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "records appended since the last sync() may be lost");
+        }
+
+        xSemaphoreGive(lock);
+
+        mounted = false;
+    }
+
+    if (erase_pending)
+    {
+        flash->finish_op();
+        erase_pending = false;
+    }
+
+    if (slots)
+    {
+        delete [] slots;
+        slots = NULL;
+    }
+
+    if (data)
+    {
+        heap_caps_free(data);
+        data = NULL;
+    }
+
+    if (buf)
+    {
+        heap_caps_free(buf);
+        buf = NULL;
+    }
+
+    if (lock)
+    {
+        vSemaphoreDelete(lock);
+        lock = NULL;
+    }
+
+    flash = NULL;
+    nsectors = 0;
+}
+
+size_t ExtFlashLog::max_record()
+{
+    size_t max = sector_sz - sizeof(header_t) - sizeof(record_t);
+
+    return max < 0xfffe ? max : 0xfffe;
+}
+
+void ExtFlashLog::get_stats(ext_flash_log_stats_t *stats)
+{
+    *stats = this->stats;
+}
+
+void ExtFlashLog::reset_stats()
+{
+    stats = {};
+}
+
+size_t ExtFlashLog::sector_addr(uint32_t seq)
+{
+    return cfg.start + ((base + seq) % nsectors) * sector_sz;
+}
+
+// Finds the head and tail from the sector headers alone.  The sectors in use
+// run back from the one with the highest sequence number for as long as the
+// numbers go down by one, erased, discarded and stale sectors end the run.
+esp_err_t ExtFlashLog::mount()
+{
+    header_t *headers = new header_t[nsectors];
+    if (headers == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    const size_t batch = 32;
+    ext_flash_iovec_t vec[batch];
+    esp_err_t err = ESP_OK;
+
+    for (uint32_t i = 0; i < nsectors && err == ESP_OK; i += batch)
+    {
+        size_t count = nsectors - i < batch ? nsectors - i : batch;
+        for (size_t v = 0; v < count; v++)
+        {
+            vec[v].addr = cfg.start + (i + v) * sector_sz;
+            vec[v].dest = &headers[i + v];
+            vec[v].size = sizeof(header_t);
+        }
+        err = flash->readv(vec, count);
+    }
+
+    int head = -1;
+    for (uint32_t i = 0; i < nsectors && err == ESP_OK; i++)
+    {
+        if (headers[i].magic == header_magic && (head < 0 || (int32_t) (headers[i].seq - headers[head].seq) > 0))
+        {
+            head = i;
+        }
+    }
+
+    if (err == ESP_OK && head < 0)
+    {
+        // Empty, the first append opens sequence number 1 in the first sector
+        base = nsectors - 1;
+        head_seq = 0;
+        head_off = sector_sz;
+        tail_seq = 1;
+    }
+    else if (err == ESP_OK)
+    {
+        head_seq = headers[head].seq;
+        base = (head + nsectors - head_seq % nsectors) % nsectors;
+        tail_seq = head_seq;
+
+        for (uint32_t i = 1; i < nsectors; i++)
+        {
+            header_t *h = &headers[(head + nsectors - i) % nsectors];
+            if (h->magic != header_magic || h->seq != head_seq - i)
+            {
+                break;
+            }
+            tail_seq = h->seq;
+        }
+
+        err = scan_head();
+    }
+
+    delete [] headers;
+
+    // Only sectors erased from here on are trusted to be erased
+    discarded_seq = tail_seq;
+    prog_seq = head_seq;
+    prog_off = head_off;
+    erased_seq = head_seq;
+
+    ESP_LOGD(TAG, "%s - tail=%u head=%u offset=%d", __func__, tail_seq, head_seq, head_off);
+
+    return err;
+}
+
+// Walks the head sector's records to where the next one goes.  A record that
+// doesn't check out, left by a program cut short, closes the sector.
+esp_err_t ExtFlashLog::scan_head()
+{
+    size_t addr = sector_addr(head_seq);
+    size_t off = sizeof(header_t);
+
+    while (off + sizeof(record_t) <= sector_sz)
+    {
+        record_t rec;
+        esp_err_t err = flash->read(addr + off, &rec, sizeof(rec));
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+
+        if (rec.len == 0xffff && rec.check == 0xffff)
+        {
+            break;
+        }
+
+        bool good = rec.len != 0xffff && off + sizeof(rec) + rec.len <= sector_sz;
+        uint16_t sum = record_check(0, &rec.len, sizeof(rec.len));
+
+        for (size_t done = 0; good && done < rec.len; )
+        {
+            size_t len = rec.len - done < page_sz ? rec.len - done : page_sz;
+            err = flash->read(addr + off + sizeof(rec) + done, buf, len);
+            if (err != ESP_OK)
+            {
+                return err;
+            }
+            sum = record_check(sum, buf, len);
+            done += len;
+        }
+
+        if (!good || sum != rec.check)
+        {
+            ESP_LOGW(TAG, "damaged record at 0x%08x, closing its sector", addr + off);
+            off = sector_sz;
+            break;
+        }
+
+        off += sizeof(rec) + PAD4(rec.len);
+    }
+
+    head_off = off;
+
+    return ESP_OK;
+}
+
+// Returns the slot for a page of the head sector, the next free one if the
+// head just moved to the page.  The caller has made sure there's room.
+ExtFlashLog::slot_t *ExtFlashLog::slot_for(uint32_t seq, size_t offset)
+{
+    if (used > 0)
+    {
+        slot_t *last = &slots[(first + used - 1) % cfg.buffer_pages];
+        if (last->seq == seq && last->offset == offset)
+        {
+            return last;
+        }
+        last->closed = true;
+    }
+
+    slot_t *s = &slots[(first + used) % cfg.buffer_pages];
+    memset(s->data, 0xff, page_sz);
+    s->seq = seq;
+    s->offset = offset;
+    s->lo = page_sz;
+    s->hi = 0;
+    s->closed = false;
+    used++;
+
+    return s;
+}
+
+void ExtFlashLog::put(uint32_t seq, size_t offset, const void *src, size_t size)
+{
+    const uint8_t *bytes = (const uint8_t *) src;
+
+    while (size > 0)
+    {
+        size_t in = offset % page_sz;
+        size_t len = page_sz - in < size ? page_sz - in : size;
+
+        slot_t *s = slot_for(seq, offset - in);
+        memcpy(&s->data[in], bytes, len);
+        s->lo = in < s->lo ? in : s->lo;
+        s->hi = in + len > s->hi ? in + len : s->hi;
+
+        offset += len;
+        bytes += len;
+        size -= len;
+    }
+}
+
+// Copies the record into the RAM buffer and never touches the chip, refusing
+// it when the buffer has no room left
+esp_err_t ExtFlashLog::append(const void *record, size_t size)
+{
+    ESP_LOGD(TAG, "%s - size=%d", __func__, size);
+
+    if (size > max_record())
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+
+    uint32_t seq = head_seq;
+    size_t off = head_off;
+    size_t start = off - (off % page_sz);
+    bool open = off + sizeof(record_t) + size > sector_sz;
+
+    if (open)
+    {
+        seq++;
+        off = sizeof(header_t);
+        start = 0;
+    }
+
+    size_t pages = (off + sizeof(record_t) + size - 1) / page_sz - start / page_sz + 1;
+    if (used > 0)
+    {
+        slot_t *last = &slots[(first + used - 1) % cfg.buffer_pages];
+        if (last->seq == seq && last->offset == start)
+        {
+            pages--;
+        }
+    }
+
+    // The sectors a new one would push out must already be on the chip
+    if (used + pages > cfg.buffer_pages || (open && seq - prog_seq + cfg.erase_ahead >= nsectors))
+    {
+        stats.overruns++;
+        xSemaphoreGive(lock);
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (open)
+    {
+        header_t h = { header_magic, seq };
+        put(seq, 0, &h, sizeof(h));
+        head_seq = seq;
+    }
+
+    record_t rec;
+    rec.len = size;
+    rec.check = record_check(record_check(0, &rec.len, sizeof(rec.len)), record, size);
+
+    put(seq, off, &rec, sizeof(rec));
+    put(seq, off + sizeof(rec), record, size);
+
+    head_off = off + sizeof(rec) + PAD4(size);
+    stats.appends++;
+
+    xSemaphoreGive(lock);
+
+    return ESP_OK;
+}
+
+// The flash work, for one task to call whenever there may be some.  Programs
+// the pages the head has moved past, marks truncated sectors and starts
+// erasing the next sector when fewer than erase_ahead are ready.
+esp_err_t ExtFlashLog::service()
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+
+    esp_err_t err = ESP_OK;
+
+    if (erase_pending && !flash->op_busy())
+    {
+        err = finish_erase();
+    }
+
+    if (err == ESP_OK)
+    {
+        err = drain(false);
+    }
+
+    if (err == ESP_OK)
+    {
+        err = discard();
+    }
+
+    if (err == ESP_OK && !erase_pending && erased_seq < head_seq + cfg.erase_ahead)
+    {
+        err = start_erase();
+    }
+
+    xSemaphoreGive(lock);
+
+    return err;
+}
+
+// Programs everything appended so far, for the task that calls service()
+esp_err_t ExtFlashLog::sync()
+{
+    ESP_LOGD(TAG, "%s", __func__);
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+
+    esp_err_t err = drain(true);
+    if (err == ESP_OK)
+    {
+        err = discard();
+    }
+
+    xSemaphoreGive(lock);
+
+    return err;
+}
+
+// Called locked, programs slots oldest first and frees them once the head
+// has moved on.  The page the head is in only goes when partial is true.
+esp_err_t ExtFlashLog::drain(bool partial)
+{
+    esp_err_t err = ESP_OK;
+
+    while (err == ESP_OK && used > 0)
+    {
+        slot_t *s = &slots[first];
+
+        if (!s->closed && !partial)
+        {
+            break;
+        }
+
+        if (s->lo < s->hi)
+        {
+            err = program(s);
+        }
+        else if (s->closed)
+        {
+            first = (first + 1) % cfg.buffer_pages;
+            used--;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    return err;
+}
+
+// Called locked, lets go of the lock while the chip is busy so appends carry
+// on.  The sector has to be erased first if erasing ahead fell behind.
+esp_err_t ExtFlashLog::program(slot_t *slot)
+{
+    esp_err_t err = ESP_OK;
+
+    while (err == ESP_OK && slot->seq > erased_seq)
+    {
+        if (!erase_pending)
+        {
+            err = start_erase();
+        }
+
+        if (err == ESP_OK)
+        {
+            stats.late_erases++;
+            err = finish_erase();
+        }
+    }
+
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    size_t lo = slot->lo;
+    size_t hi = slot->hi;
+    size_t addr = sector_addr(slot->seq) + slot->offset;
+
+    xSemaphoreGive(lock);
+    err = flash_write(addr + lo, &slot->data[lo], hi - lo);
+    xSemaphoreTake(lock, portMAX_DELAY);
+
+    if (err == ESP_OK)
+    {
+        slot->lo = hi;
+        prog_seq = slot->seq;
+        prog_off = slot->offset + hi;
+        stats.pages++;
+    }
+
+    return err;
+}
+
+// Called locked, starts erasing the sector after the last one erased, giving
+// up the oldest sector if it's that one
+esp_err_t ExtFlashLog::start_erase()
+{
+    uint32_t seq = erased_seq + 1;
+
+    if (seq - tail_seq >= nsectors)
+    {
+        tail_seq = seq - nsectors + 1;
+        stats.dropped++;
+    }
+
+    if (seq - discarded_seq >= nsectors)
+    {
+        discarded_seq = seq - nsectors + 1;
+    }
+
+    size_t erased;
+    size_t addr = sector_addr(seq);
+
+    xSemaphoreGive(lock);
+    esp_err_t err = flash->start_erase(addr, sector_sz, &erased);
+    xSemaphoreTake(lock, portMAX_DELAY);
+
+    erase_pending = err == ESP_OK;
+
+    return err;
+}
+
+// Called locked, waits for the erase to finish
+esp_err_t ExtFlashLog::finish_erase()
+{
+    xSemaphoreGive(lock);
+    esp_err_t err = flash->finish_op();
+    xSemaphoreTake(lock, portMAX_DELAY);
+
+    if (err == ESP_OK)
+    {
+        erase_pending = false;
+        erased_seq++;
+        stats.erases++;
+    }
+
+    return err;
+}
+
+// Called locked, zeroes the magic of sectors truncate() gave up so they stay
+// given up after a restart
+esp_err_t ExtFlashLog::discard()
+{
+    esp_err_t err = ESP_OK;
+
+    while (err == ESP_OK && (int32_t) (tail_seq - discarded_seq) > 0)
+    {
+        uint32_t zero = 0;
+        size_t addr = sector_addr(discarded_seq);
+
+        xSemaphoreGive(lock);
+        err = flash_write(addr, &zero, sizeof(zero));
+        xSemaphoreTake(lock, portMAX_DELAY);
+
+        if (err == ESP_OK)
+        {
+            discarded_seq++;
+        }
+    }
+
+    return err;
+}
+
+// Programs around an erase under way instead of waiting for it
+esp_err_t ExtFlashLog::flash_write(size_t addr, const void *src, size_t size)
+{
+    if (erase_pending)
+    {
+        return flash->program_during_erase(addr, src, size);
+    }
+
+    return flash->write(addr, src, size);
+}
+
+void ExtFlashLog::rewind(ext_flash_log_cursor_t *cursor)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+
+    cursor->seq = tail_seq;
+    cursor->offset = sizeof(header_t);
+
+    xSemaphoreGive(lock);
+}
+
+// Reads the record at the cursor and moves the cursor past it.  *size is the
+// room at dest going in and the record's length coming out.  Only records
+// that have been programmed are seen.  A cursor left behind by the tail
+// moving on skips to the oldest record.
+esp_err_t ExtFlashLog::read(ext_flash_log_cursor_t *cursor, void *dest, size_t *size)
+{
+    ESP_LOGD(TAG, "%s - seq=%u offset=%d", __func__, cursor->seq, cursor->offset);
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+
+    while (true)
+    {
+        if ((int32_t) (cursor->seq - tail_seq) < 0)
+        {
+            cursor->seq = tail_seq;
+            cursor->offset = sizeof(header_t);
+        }
+
+        if ((int32_t) (cursor->seq - prog_seq) > 0 || (cursor->seq == prog_seq && cursor->offset >= prog_off))
+        {
+            err = ESP_ERR_NOT_FOUND;
+            break;
+        }
+
+        size_t addr = sector_addr(cursor->seq) + cursor->offset;
+        record_t rec = { 0xffff, 0xffff };
+
+        if (cursor->offset + sizeof(rec) <= sector_sz)
+        {
+            err = flash->read(addr, &rec, sizeof(rec));
+            if (err != ESP_OK)
+            {
+                break;
+            }
+        }
+
+        size_t end = cursor->offset + sizeof(rec) + rec.len;
+        if (rec.len == 0xffff || end > sector_sz)
+        {
+            if (cursor->seq == prog_seq)
+            {
+                err = ESP_ERR_NOT_FOUND;
+                break;
+            }
+
+            cursor->seq++;
+            cursor->offset = sizeof(header_t);
+            continue;
+        }
+
+        if (cursor->seq == prog_seq && end > prog_off)
+        {
+            err = ESP_ERR_NOT_FOUND;
+            break;
+        }
+
+        if (rec.len > *size)
+        {
+            *size = rec.len;
+            err = ESP_ERR_INVALID_SIZE;
+            break;
+        }
+
+        err = flash->read(addr + sizeof(rec), dest, rec.len);
+        if (err != ESP_OK)
+        {
+            break;
+        }
+
+        uint16_t sum = record_check(record_check(0, &rec.len, sizeof(rec.len)), dest, rec.len);
+        if (sum != rec.check)
+        {
+            // Nothing past it in the sector can be trusted
+            cursor->seq++;
+            cursor->offset = sizeof(header_t);
+            err = ESP_ERR_INVALID_CRC;
+            break;
+        }
+
+        cursor->offset += sizeof(rec) + PAD4(rec.len);
+        *size = rec.len;
+        err = ESP_OK;
+        break;
+    }
+
+    xSemaphoreGive(lock);
+
+    return err;
+}
+
+// Gives up the sectors before the cursor's, the oldest records go first.
+// The sectors are marked on the chip by the next service() or sync().
+esp_err_t ExtFlashLog::truncate(const ext_flash_log_cursor_t *cursor)
+{
+    ESP_LOGD(TAG, "%s - seq=%u", __func__, cursor->seq);
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+
+    uint32_t seq = cursor->seq;
+    if ((int32_t) (seq - prog_seq) > 0)
+    {
+        seq = prog_seq;
+    }
+
+    if ((int32_t) (seq - tail_seq) > 0)
+    {
+        tail_seq = seq;
+    }
+
+    xSemaphoreGive(lock);
+
+    return ESP_OK;
+}
@@ -0,0 +1,252 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+#include "extflash_partition.h"
+
+static const char *TAG = "extflash_partition";
+
+ExtFlashPartition *ExtFlashPartition::partitions = NULL;
+
+ExtFlashPartition::ExtFlashPartition()
+{
+    cfg = {};
+    flash = NULL;
+
+    erase_start = 0;
+    erase_size = 0;
+
+    next = NULL;
+}
+
+ExtFlashPartition::~ExtFlashPartition()
+{
+    term();
+}
+
+// Partitions are registered and looked up at start up, before the tasks
+// using them are about
+esp_err_t ExtFlashPartition::init(ExtFlash *flash, const ext_flash_partition_config_t *config)
+{
+    ESP_LOGD(TAG, "%s - label=%s offset=0x%08x size=%d", __func__, config->label, config->offset, config->size);
+
+    term();
+
+    size_t sector = flash->sector_size();
+
+    if (config->label == NULL || (config->offset % sector) != 0 || (config->size % sector) != 0 ||
+        config->size == 0 || config->offset + config->size > flash->chip_size())
+    {
+        ESP_LOGE(TAG, "partition needs a label and a sector aligned range on the chip");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    for (ExtFlashPartition *p = partitions; p; p = p->next)
+    {
+        if (strcmp(p->cfg.label, config->label) == 0)
+        {
+            ESP_LOGE(TAG, "partition %s exists already", config->label);
+            return ESP_ERR_INVALID_STATE;
+        }
+
+        if (p->flash == flash && p->cfg.offset < config->offset + config->size && config->offset < p->cfg.offset + p->cfg.size)
+        {
+            ESP_LOGE(TAG, "partition %s overlaps %s", config->label, p->cfg.label);
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    cfg = *config;
+    this->flash = flash;
+
+    erase_start = 0;
+    erase_size = 0;
+
+    next = partitions;
+    partitions = this;
+
+    return ESP_OK;
+}
+
+void ExtFlashPartition::term()
+{
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (flash == NULL)
+    {
+        return;
+    }
+
+    sync();
+
+    for (ExtFlashPartition **p = &partitions; *p; p = &(*p)->next)
+    {
+        if (*p == this)
+        {
+            *p = next;
+            break;
+        }
+    }
+
+    next = NULL;
+    flash = NULL;
+}
+
+ExtFlashPartition *ExtFlashPartition::find(const char *label)
+{
+    for (ExtFlashPartition *p = partitions; p; p = p->next)
+    {
+        if (strcmp(p->cfg.label, label) == 0)
+        {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+const char *ExtFlashPartition::label()
+{
+    return cfg.label;
+}
+
+ExtFlash *ExtFlashPartition::chip()
+{
+    return flash;
+}
+
+size_t ExtFlashPartition::size()
+{
+    return cfg.size;
+}
+
+size_t ExtFlashPartition::sector_size()
+{
+    return flash->sector_size();
+}
+
+size_t ExtFlashPartition::page_size()
+{
+    return flash->page_size();
+}
+
+esp_err_t ExtFlashPartition::check(size_t addr, size_t size)
+{
+    if (flash == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (addr > cfg.size || size > cfg.size - addr)
+    {
+        ESP_LOGE(TAG, "range 0x%08x + %d is outside partition %s", addr, size, cfg.label);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    return ESP_OK;
+}
+
+// Do the held back erase if it overlaps a range about to be used
+esp_err_t ExtFlashPartition::flush(size_t addr, size_t size)
+{
+    if (erase_size == 0 || addr >= erase_start + erase_size || erase_start >= addr + size)
+    {
+        return ESP_OK;
+    }
+
+    return sync();
+}
+
+esp_err_t ExtFlashPartition::read(size_t addr, void *dest, size_t size)
+{
+    esp_err_t err = check(addr, size);
+    if (err == ESP_OK)
+    {
+        err = flush(addr, size);
+    }
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    return flash->read(cfg.offset + addr, dest, size);
+}
+
+esp_err_t ExtFlashPartition::write(size_t addr, const void *src, size_t size)
+{
+    esp_err_t err = check(addr, size);
+    if (err == ESP_OK)
+    {
+        err = flush(addr, size);
+    }
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    return flash->write(cfg.offset + addr, src, size);
+}
+
+// Callers that erase a sector at a time, such as a format, can have the
+// chip's larger block erases.  Sectors erased one after the other are
+// gathered up until one of them is used, another erase doesn't follow on
+// or sync() is called, and then go to erase_range() together.
+esp_err_t ExtFlashPartition::erase_range(size_t addr, size_t size)
+{
+    esp_err_t err = check(addr, size);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    if ((addr % flash->sector_size()) != 0 || (size % flash->sector_size()) != 0)
+    {
+        ESP_LOGE(TAG, "erase range must be aligned to %d bytes", flash->sector_size());
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (erase_size != 0 && addr == erase_start + erase_size)
+    {
+        erase_size += size;
+        return ESP_OK;
+    }
+
+    err = sync();
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    erase_start = addr;
+    erase_size = size;
+
+    return ESP_OK;
+}
+
+esp_err_t ExtFlashPartition::sync()
+{
+    if (erase_size == 0)
+    {
+        return ESP_OK;
+    }
+
+    size_t size = erase_size;
+    erase_size = 0;
+
+    return flash->erase_range(cfg.offset + erase_start, size);
+}
@@ -0,0 +1,297 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+#include "extflash_pool.h"
+
+static const char *TAG = "extflash_pool";
+
+ExtFlashPool::ExtFlashPool()
+{
+    cfg = {};
+    sector_sz = 0;
+    nsectors = 0;
+
+    states = NULL;
+    ndiscarded = 0;
+    nblank = 0;
+    hand = 0;
+
+    stats = {};
+}
+
+ExtFlashPool::~ExtFlashPool()
+{
+    term();
+}
+
+esp_err_t ExtFlashPool::init(const ext_flash_pool_config_t *config, size_t sector_size)
+{
+    ESP_LOGD(TAG, "%s - start=0x%08x size=%d sector_size=%d", __func__, config->start, config->size, sector_size);
+
+    term();
+
+    cfg = *config;
+
+    if (sector_size == 0 || cfg.size == 0 || (cfg.start % sector_size) != 0 || (cfg.size % sector_size) != 0)
+    {
+        ESP_LOGE(TAG, "start and size config values must be sector aligned and size greater than 0");
+        cfg = {};
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    sector_sz = sector_size;
+    nsectors = cfg.size / sector_sz;
+
+    // Nothing is known about the sectors yet, so they're all in use
+    states = new uint8_t[nsectors]();
+    if (states == NULL)
+    {
+        term();
+        return ESP_ERR_NO_MEM;
+    }
+
+    ndiscarded = 0;
+    nblank = 0;
+    hand = 0;
+    stats = {};
+
+    return ESP_OK;
+}
+
+void ExtFlashPool::term()
+{
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (states)
+    {
+        delete [] states;
+        states = NULL;
+    }
+
+    nsectors = 0;
+}
+
+size_t ExtFlashPool::sector_size()
+{
+    return sector_sz;
+}
+
+bool ExtFlashPool::covers(size_t addr, size_t size)
+{
+    return addr >= cfg.start && addr + size <= cfg.start + cfg.size;
+}
+
+void ExtFlashPool::get_stats(ext_flash_pool_stats_t *stats)
+{
+    *stats = this->stats;
+}
+
+void ExtFlashPool::reset_stats()
+{
+    stats = {};
+}
+
+void ExtFlashPool::set_state(size_t sector, uint8_t state)
+{
+    uint8_t old = states[sector];
+
+    ndiscarded -= old == sector_discarded;
+    nblank -= old == sector_blank;
+    ndiscarded += state == sector_discarded;
+    nblank += state == sector_blank;
+
+    states[sector] = state;
+}
+
+// Only sectors wholly inside the range and the pool are discarded.  Sectors
+// handed out and not written go straight back.
+void ExtFlashPool::discard(size_t addr, size_t size)
+{
+    size_t end = addr + size;
+
+    addr = addr < cfg.start ? cfg.start : addr;
+    end = end > cfg.start + cfg.size ? cfg.start + cfg.size : end;
+
+    for (size_t a = (addr + sector_sz - 1) / sector_sz * sector_sz; a + sector_sz <= end; a += sector_sz)
+    {
+        size_t sector = (a - cfg.start) / sector_sz;
+        if (states[sector] == sector_used)
+        {
+            set_state(sector, sector_discarded);
+            stats.discarded++;
+        }
+        else if (states[sector] == sector_allocated)
+        {
+            set_state(sector, sector_blank);
+        }
+    }
+}
+
+// The calls below take any range and apply to the sectors of the pool it
+// touches
+
+void ExtFlashPool::written(size_t addr, size_t size)
+{
+    for (size_t a = addr - addr % sector_sz; a < addr + size; a += sector_sz)
+    {
+        if (covers(a, sector_sz))
+        {
+            set_state((a - cfg.start) / sector_sz, sector_used);
+        }
+    }
+}
+
+void ExtFlashPool::erasing(size_t addr, size_t size)
+{
+    for (size_t a = addr - addr % sector_sz; a < addr + size; a += sector_sz)
+    {
+        size_t sector = (a - cfg.start) / sector_sz;
+        if (covers(a, sector_sz) && states[sector] != sector_blank && states[sector] != sector_allocated)
+        {
+            set_state(sector, sector_erasing);
+        }
+    }
+}
+
+// Sectors handed out while their erase was under way stay in use
+void ExtFlashPool::erased(size_t addr, size_t size)
+{
+    for (size_t a = addr - addr % sector_sz; a < addr + size; a += sector_sz)
+    {
+        size_t sector = (a - cfg.start) / sector_sz;
+        if (covers(a, sector_sz) && states[sector] == sector_erasing)
+        {
+            set_state(sector, sector_blank);
+        }
+    }
+}
+
+bool ExtFlashPool::blank(size_t addr, size_t size)
+{
+    if (!covers(addr, size))
+    {
+        return false;
+    }
+
+    for (size_t a = addr - addr % sector_sz; a < addr + size; a += sector_sz)
+    {
+        uint8_t state = states[(a - cfg.start) / sector_sz];
+        if (state != sector_blank && state != sector_allocated)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Whether an erase of the range only hits sectors nobody needs
+bool ExtFlashPool::erasable(size_t addr, size_t size)
+{
+    if (!covers(addr, size))
+    {
+        return false;
+    }
+
+    for (size_t a = addr; a < addr + size; a += sector_sz)
+    {
+        uint8_t state = states[(a - cfg.start) / sector_sz];
+        if (state == sector_used || state == sector_allocated)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool ExtFlashPool::next_discarded(size_t *addr)
+{
+    if (ndiscarded == 0)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < nsectors; i++)
+    {
+        size_t sector = (hand + i) % nsectors;
+        if (states[sector] == sector_discarded)
+        {
+            *addr = cfg.start + sector * sector_sz;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Hands out sectors round robin, so they wear evenly
+bool ExtFlashPool::take(uint8_t from, size_t *addr)
+{
+    for (size_t i = 0; i < nsectors; i++)
+    {
+        size_t sector = (hand + i) % nsectors;
+        if (states[sector] == from)
+        {
+            set_state(sector, sector_allocated);
+            hand = (sector + 1) % nsectors;
+            *addr = cfg.start + sector * sector_sz;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool ExtFlashPool::take_blank(size_t *addr)
+{
+    if (nblank == 0 || !take(sector_blank, addr))
+    {
+        return false;
+    }
+
+    stats.allocated++;
+
+    return true;
+}
+
+// The caller erases the sector before anything else can get at it
+bool ExtFlashPool::take_discarded(size_t *addr)
+{
+    if (ndiscarded == 0 || !take(sector_discarded, addr))
+    {
+        return false;
+    }
+
+    stats.allocated++;
+    stats.inline_erases++;
+
+    return true;
+}
+
+void ExtFlashPool::skipped()
+{
+    stats.skipped++;
+}
+
+void ExtFlashPool::erased_ahead(size_t size)
+{
+    stats.erases++;
+    stats.erased += size / sector_sz;
+}
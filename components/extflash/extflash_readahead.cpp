@@ -0,0 +1,283 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#include "extflash_readahead.h"
+
+static const char *TAG = "extflash_readahead";
+
+ExtFlashReadAhead::ExtFlashReadAhead()
+{
+    cfg = {};
+
+    streams = NULL;
+    bufs = NULL;
+    data = NULL;
+    tick = 0;
+
+    stats = {};
+}
+
+ExtFlashReadAhead::~ExtFlashReadAhead()
+{
+    term();
+}
+
+esp_err_t ExtFlashReadAhead::init(const ext_flash_read_ahead_config_t *config)
+{
+    ESP_LOGD(TAG, "%s - streams=%d buffers=%d min_size=%d max_size=%d", __func__,
+             config->streams, config->buffers, config->min_size, config->max_size);
+
+    term();
+
+    cfg = *config;
+
+    if (cfg.streams == 0 || cfg.buffers == 0)
+    {
+        ESP_LOGE(TAG, "streams and buffers config values must be greater than 0");
+        cfg = {};
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (cfg.min_size == 0 || cfg.min_size > cfg.max_size)
+    {
+        ESP_LOGE(TAG, "min_size config value must be greater than 0 and no larger than max_size");
+        cfg = {};
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    streams = new stream_t[cfg.streams]();
+    bufs = new buffer_t[cfg.streams * cfg.buffers]();
+    if (streams == NULL || bufs == NULL)
+    {
+        term();
+        return ESP_ERR_NO_MEM;
+    }
+
+    data = (uint8_t *) heap_caps_malloc(cfg.streams * cfg.buffers * cfg.max_size,
+                                        cfg.psram ? MALLOC_CAP_SPIRAM : MALLOC_CAP_DMA);
+    if (data == NULL)
+    {
+        term();
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (size_t i = 0; i < cfg.streams; i++)
+    {
+        stream_t *s = &streams[i];
+
+        s->bufs = &bufs[i * cfg.buffers];
+        s->window = cfg.min_size;
+
+        for (size_t b = 0; b < cfg.buffers; b++)
+        {
+            s->bufs[b].data = &data[(i * cfg.buffers + b) * cfg.max_size];
+        }
+    }
+
+    tick = 0;
+    stats = {};
+
+    return ESP_OK;
+}
+
+void ExtFlashReadAhead::term()
+{
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (streams)
+    {
+        delete [] streams;
+        streams = NULL;
+    }
+
+    if (bufs)
+    {
+        delete [] bufs;
+        bufs = NULL;
+    }
+
+    if (data)
+    {
+        heap_caps_free(data);
+        data = NULL;
+    }
+
+    cfg.streams = 0;
+}
+
+void ExtFlashReadAhead::get_stats(ext_flash_read_ahead_stats_t *stats)
+{
+    *stats = this->stats;
+}
+
+void ExtFlashReadAhead::reset_stats()
+{
+    stats = {};
+}
+
+// The stream a read continues, either because it starts where the stream's
+// last one ended or because it's buffered already
+ExtFlashReadAhead::stream_t *ExtFlashReadAhead::find(size_t addr)
+{
+    for (size_t i = 0; i < cfg.streams; i++)
+    {
+        stream_t *s = &streams[i];
+        if (s->used != 0 && (s->next == addr || buffer(s, addr) != NULL))
+        {
+            s->used = ++tick;
+            return s;
+        }
+    }
+
+    return NULL;
+}
+
+// The stream to give up for a new one
+ExtFlashReadAhead::stream_t *ExtFlashReadAhead::lru()
+{
+    stream_t *s = &streams[0];
+
+    for (size_t i = 1; i < cfg.streams; i++)
+    {
+        if ((int32_t) (streams[i].used - s->used) < 0)
+        {
+            s = &streams[i];
+        }
+    }
+
+    return s;
+}
+
+// Follow a new stream, the caller must have waited for the old one's
+// read-aheads
+void ExtFlashReadAhead::restart(stream_t *s, size_t next)
+{
+    dropped(s);
+
+    s->next = next;
+    s->ahead = next;
+    s->window = cfg.min_size;
+    s->run = 1;
+    s->full = 0;
+    s->used = ++tick;
+}
+
+ExtFlashReadAhead::buffer_t *ExtFlashReadAhead::buffer(stream_t *s, size_t addr)
+{
+    for (size_t b = 0; b < cfg.buffers; b++)
+    {
+        buffer_t *buf = &s->bufs[b];
+        if (buf->len != 0 && addr >= buf->addr && addr < buf->addr + buf->len)
+        {
+            return buf;
+        }
+    }
+
+    return NULL;
+}
+
+// A whole buffer was read, after a round of them the window doubles
+void ExtFlashReadAhead::used_up(stream_t *s)
+{
+    if (++s->full >= cfg.buffers)
+    {
+        s->full = 0;
+        s->window = s->window * 2 < cfg.max_size ? s->window * 2 : cfg.max_size;
+    }
+}
+
+// Emptying buffers that weren't read to the end halves the window
+void ExtFlashReadAhead::dropped(stream_t *s)
+{
+    size_t unused = 0;
+
+    for (size_t b = 0; b < cfg.buffers; b++)
+    {
+        buffer_t *buf = &s->bufs[b];
+        if (buf->len != 0)
+        {
+            if (buf->addr + buf->len > s->next)
+            {
+                unused += buf->addr + buf->len - (buf->addr > s->next ? buf->addr : s->next);
+            }
+            buf->len = 0;
+        }
+    }
+
+    if (unused > 0)
+    {
+        stats.wasted += unused;
+        s->full = 0;
+        s->window = s->window / 2 > cfg.min_size ? s->window / 2 : cfg.min_size;
+    }
+
+    s->ahead = s->next;
+}
+
+void ExtFlashReadAhead::issued(stream_t *s, buffer_t *b, size_t addr, size_t len, uint32_t handle)
+{
+    b->addr = addr;
+    b->len = len;
+    b->handle = handle;
+
+    s->ahead = addr + len;
+    stats.reads++;
+}
+
+void ExtFlashReadAhead::hit()
+{
+    stats.hits++;
+}
+
+void ExtFlashReadAhead::miss()
+{
+    stats.misses++;
+}
+
+size_t ExtFlashReadAhead::buffer_count()
+{
+    return cfg.buffers;
+}
+
+size_t ExtFlashReadAhead::max_size()
+{
+    return cfg.max_size;
+}
+
+// Drop buffers a write or erase changed, the streams carry on reading
+// ahead from where their readers are
+void ExtFlashReadAhead::invalidate(size_t addr, size_t size)
+{
+    for (size_t i = 0; i < cfg.streams; i++)
+    {
+        stream_t *s = &streams[i];
+        for (size_t b = 0; b < cfg.buffers; b++)
+        {
+            buffer_t *buf = &s->bufs[b];
+            if (buf->len != 0 && buf->addr < addr + size && addr < buf->addr + buf->len)
+            {
+                for (size_t o = 0; o < cfg.buffers; o++)
+                {
+                    s->bufs[o].len = 0;
+                }
+                s->ahead = s->next;
+                break;
+            }
+        }
+    }
+}
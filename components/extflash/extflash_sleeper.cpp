@@ -0,0 +1,114 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "rom/ets_sys.h"
+
+#include "extflash_sleeper.h"
+
+static const char *TAG = "extflash_sleeper";
+
+ExtFlashSleeper::ExtFlashSleeper()
+{
+    timer = NULL;
+    wake = NULL;
+}
+
+ExtFlashSleeper::~ExtFlashSleeper()
+{
+    term();
+}
+
+esp_err_t ExtFlashSleeper::init()
+{
+    ESP_LOGD(TAG, "%s", __func__);
+
+    term();
+
+    wake = xSemaphoreCreateBinary();
+    if (wake == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_timer_create_args_t args =
+    {
+        .callback = expired,
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "extflash"
+    };
+
+    esp_err_t err = esp_timer_create(&args, &timer);
+    if (err != ESP_OK)
+    {
+        timer = NULL;
+        term();
+        return err;
+    }
+
+    return ESP_OK;
+}
+
+void ExtFlashSleeper::term()
+{
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (timer)
+    {
+        esp_timer_stop(timer);
+        esp_timer_delete(timer);
+        timer = NULL;
+    }
+
+    if (wake)
+    {
+        vSemaphoreDelete(wake);
+        wake = NULL;
+    }
+}
+
+void ExtFlashSleeper::sleep_us(uint32_t us)
+{
+    const uint32_t tick_us = portTICK_PERIOD_MS * 1000;
+
+    if (us >= tick_us)
+    {
+        vTaskDelay((us + tick_us - 1) / tick_us);
+    }
+    else if (us <= max_spin_us || timer == NULL)
+    {
+        ets_delay_us(us);
+    }
+    else if (esp_timer_start_once(timer, us) == ESP_OK)
+    {
+        xSemaphoreTake(wake, portMAX_DELAY);
+    }
+    else
+    {
+        vTaskDelay(1);
+    }
+}
+
+void ExtFlashSleeper::expired(void *arg)
+{
+    ExtFlashSleeper *sleeper = (ExtFlashSleeper *) arg;
+
+    xSemaphoreGive(sleeper->wake);
+}
@@ -0,0 +1,325 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+#include "extflash_stripe.h"
+
+static const char *TAG = "extflash_stripe";
+
+ExtFlashStripe::ExtFlashStripe()
+{
+    cfg = {};
+    for (int i = 0; i < max_chips; i++)
+    {
+        chips[i] = NULL;
+    }
+    nchips = 0;
+    sector_sz = 0;
+    capacity = 0;
+}
+
+ExtFlashStripe::~ExtFlashStripe()
+{
+    term();
+}
+
+esp_err_t ExtFlashStripe::init(ExtFlash **chips, int count, const ext_flash_stripe_config_t *config)
+{
+    ESP_LOGD(TAG, "%s - count=%d unit=%d", __func__, count, config->unit);
+
+    term();
+
+    if (count < 1 || count > max_chips)
+    {
+        ESP_LOGE(TAG, "count must be 1 - %d", max_chips);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    cfg = *config;
+
+    sector_sz = chips[0]->sector_size();
+    size_t smallest = chips[0]->chip_size();
+    for (int i = 1; i < count; i++)
+    {
+        if (chips[i]->sector_size() != sector_sz)
+        {
+            ESP_LOGE(TAG, "chips must have the same sector size");
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        if (chips[i]->chip_size() < smallest)
+        {
+            smallest = chips[i]->chip_size();
+        }
+    }
+
+    if (cfg.unit == 0)
+    {
+        cfg.unit = sector_sz;
+    }
+
+    if (sector_sz == 0 || (cfg.unit % sector_sz) != 0)
+    {
+        ESP_LOGE(TAG, "unit config value must be a multiple of the sector size");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t err = sleeper.init();
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        this->chips[i] = chips[i];
+    }
+    nchips = count;
+    capacity = (smallest / cfg.unit) * cfg.unit * count;
+
+    return ESP_OK;
+}
+
+void ExtFlashStripe::term()
+{
+    ESP_LOGD(TAG, "%s", __func__);
+
+    for (int i = 0; i < max_chips; i++)
+    {
+        chips[i] = NULL;
+    }
+    nchips = 0;
+    capacity = 0;
+
+    sleeper.term();
+}
+
+size_t ExtFlashStripe::sector_size()
+{
+    return sector_sz;
+}
+
+size_t ExtFlashStripe::chip_size()
+{
+    return capacity;
+}
+
+// Where a chip's part of the stripe at or after addr starts.  Each chip's
+// part of a range is contiguous on the chip, so a range maps to one run of
+// addresses per chip.
+size_t ExtFlashStripe::chip_addr(int chip, size_t addr)
+{
+    size_t stripe = addr / cfg.unit;
+    size_t row = stripe / nchips;
+    int owner = stripe % nchips;
+
+    if (owner == chip)
+    {
+        return row * cfg.unit + addr % cfg.unit;
+    }
+
+    return (owner < chip ? row : row + 1) * cfg.unit;
+}
+
+size_t ExtFlashStripe::stripe_addr(int chip, size_t addr)
+{
+    return ((addr / cfg.unit) * nchips + chip) * cfg.unit + addr % cfg.unit;
+}
+
+esp_err_t ExtFlashStripe::check(size_t addr, size_t size)
+{
+    if (nchips == 0)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (addr > capacity || size > capacity - addr)
+    {
+        ESP_LOGE(TAG, "range 0x%08x + %d is past the end", addr, size);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t ExtFlashStripe::erase_range(size_t addr, size_t size)
+{
+    ESP_LOGD(TAG, "%s - addr=0x%08x size=%d", __func__, addr, size);
+
+    esp_err_t err = check(addr, size);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    if ((addr % sector_sz) != 0 || (size % sector_sz) != 0)
+    {
+        ESP_LOGE(TAG, "erase range must be aligned to %d bytes", sector_sz);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    return run(addr, NULL, size);
+}
+
+esp_err_t ExtFlashStripe::write(size_t addr, const void *src, size_t size)
+{
+    ESP_LOGD(TAG, "%s - addr=0x%08x size=%d", __func__, addr, size);
+
+    esp_err_t err = check(addr, size);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    return run(addr, (const uint8_t *) src, size);
+}
+
+// Keep every chip programming or erasing its part, starting the next page
+// or erase on each as soon as it's done with the last one.  Without src,
+// the range is erased.
+esp_err_t ExtFlashStripe::run(size_t addr, const uint8_t *src, size_t size)
+{
+    size_t next[max_chips];
+    size_t end[max_chips];
+    bool busy[max_chips];
+    esp_err_t err = ESP_OK;
+
+    for (int i = 0; i < nchips; i++)
+    {
+        next[i] = chip_addr(i, addr);
+        end[i] = chip_addr(i, addr + size);
+        busy[i] = false;
+    }
+
+    while (true)
+    {
+        uint32_t wait_us = UINT32_MAX;
+
+        for (int i = 0; i < nchips; i++)
+        {
+            ExtFlash *chip = chips[i];
+
+            if (busy[i])
+            {
+                if (chip->op_busy())
+                {
+                    uint32_t us = chip->op_wait_us();
+                    wait_us = us < wait_us ? us : wait_us;
+                    continue;
+                }
+
+                chip->finish_op();
+                busy[i] = false;
+            }
+
+            if (err != ESP_OK || next[i] >= end[i])
+            {
+                continue;
+            }
+
+            size_t len;
+            if (src)
+            {
+                // Up to the end of the stripe unit, start_program() stops
+                // at the end of the page
+                size_t stop = (next[i] / cfg.unit + 1) * cfg.unit;
+                stop = stop < end[i] ? stop : end[i];
+                err = chip->start_program(next[i], src + stripe_addr(i, next[i]) - addr, stop - next[i], &len);
+            }
+            else
+            {
+                err = chip->start_erase(next[i], end[i] - next[i], &len);
+            }
+
+            if (err == ESP_OK)
+            {
+                busy[i] = true;
+                next[i] += len;
+
+                uint32_t us = chip->op_wait_us();
+                wait_us = us < wait_us ? us : wait_us;
+            }
+        }
+
+        if (wait_us == UINT32_MAX)
+        {
+            break;
+        }
+
+        // Until the first chip could be done
+        sleeper.sleep_us(wait_us);
+    }
+
+    return err;
+}
+
+// Queue every chip's part before waiting for any, so the buses run at once
+esp_err_t ExtFlashStripe::read(size_t addr, void *dest, size_t size)
+{
+    ESP_LOGD(TAG, "%s - addr=0x%08x size=%d", __func__, addr, size);
+
+    esp_err_t err = check(addr, size);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    uint8_t *bytes = (uint8_t *) dest;
+    size_t next[max_chips];
+    size_t end[max_chips];
+    ext_flash_handle_t handles[max_chips];
+    bool pending[max_chips];
+    bool more = true;
+
+    for (int i = 0; i < nchips; i++)
+    {
+        next[i] = chip_addr(i, addr);
+        end[i] = chip_addr(i, addr + size);
+        pending[i] = false;
+    }
+
+    while (more && err == ESP_OK)
+    {
+        more = false;
+
+        for (int i = 0; i < nchips && err == ESP_OK; i++)
+        {
+            if (next[i] >= end[i])
+            {
+                continue;
+            }
+
+            size_t stop = (next[i] / cfg.unit + 1) * cfg.unit;
+            stop = stop < end[i] ? stop : end[i];
+
+            err = chips[i]->read_async(next[i], bytes + stripe_addr(i, next[i]) - addr, stop - next[i], &handles[i]);
+            pending[i] |= err == ESP_OK;
+            next[i] = stop;
+            more |= next[i] < end[i];
+        }
+    }
+
+    for (int i = 0; i < nchips; i++)
+    {
+        if (pending[i])
+        {
+            esp_err_t werr = chips[i]->wait(handles[i]);
+            err = err == ESP_OK ? werr : err;
+        }
+    }
+
+    return err;
+}
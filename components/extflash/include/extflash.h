@@ -17,20 +17,42 @@
 
 #include "esp_err.h"
 #include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 #include "driver/spi_master.h"
 
+#include "extflash_bus.h"
+#include "extflash_cache.h"
+#include "extflash_pool.h"
+#include "extflash_readahead.h"
+#include "extflash_sleeper.h"
+
 #define CMD_WRITE_STATUS_REG1               0x01
 #define CMD_PAGE_PROGRAM                    0x02
 #define CMD_READ_DATA                       0x03
 #define CMD_READ_STATUS_REG1                0x05
 #define CMD_WRITE_ENABLE                    0x06
 #define CMD_FAST_READ                       0x0b
+#define CMD_FAST_READ_4B                    0x0c
+#define CMD_PAGE_PROGRAM_4B                 0x12
+#define CMD_READ_DATA_4B                    0x13
 #define CMD_SECTOR_ERASE                    0x20
+#define CMD_SECTOR_ERASE_4B                 0x21
+#define CMD_WRITE_STATUS_REG2               0x31
+#define CMD_READ_STATUS_REG2                0x35
+#define CMD_ENTER_QPI_MODE                  0x38
+#define CMD_WRITE_STATUS_REG2_ALT           0x3e
+#define CMD_READ_STATUS_REG2_ALT            0x3f
 #define CMD_READ_SFDP                       0x5a
 #define CMD_ENABLE_RESET                    0x66
 #define CMD_RESET_DEVICE                    0x99
 #define CMD_READ_JEDEC_ID                   0x9f
+#define CMD_ENTER_4B_MODE                   0xb7
 #define CMD_CHIP_ERASE                      0xc7
+#define CMD_EXIT_4B_MODE                    0xe9
+#define CMD_EXIT_QPI_MODE_ALT               0xf5
+#define CMD_EXIT_QPI_MODE                   0xff
 
 typedef struct
 {
@@ -47,8 +69,45 @@ typedef struct
     int    max_dma_size;        // larger = faster, smaller = less memory, 0 = default
     size_t sector_size;         // sector size or 0 for detection
     size_t capacity;            // number of bytes on flash or 0 for detection
+    bool auto_mode;             // use the fastest SFDP read the pins allow
+    int8_t bounce_buffers;      // DMA bounce buffers, 0 = default, -1 = none
+    bool scheduler;             // hand the bus to waiting tasks by request priority
 } ext_flash_config_t;
 
+// Request priorities for the scheduler, see ExtFlash::set_priority()
+typedef enum
+{
+    EXT_FLASH_PRIORITY_DEFAULT = -1,    // reads NORMAL, writes and erases BULK
+    EXT_FLASH_PRIORITY_BULK,
+    EXT_FLASH_PRIORITY_NORMAL,
+    EXT_FLASH_PRIORITY_URGENT,
+} ext_flash_priority_t;
+
+typedef struct
+{
+    uint32_t zero_copy;         // transfers DMAed straight to or from the caller's buffer
+    uint32_t bounced;           // transfers copied through a bounce buffer
+    uint32_t bounce_waits;      // bounce buffers waited for
+    uint32_t polled;            // short transactions spun on instead of queued
+    uint32_t handoffs;          // times the scheduler handed the bus to a waiting task
+    uint32_t erases_skipped;    // sectors smart_write() could program without erasing
+    uint32_t pages_skipped;     // pages smart_write() found needed no program
+} ext_flash_stats_t;
+
+// One segment of a scattered read, see ExtFlash::readv()
+typedef struct
+{
+    size_t addr;
+    void *dest;
+    size_t size;
+} ext_flash_iovec_t;
+
+// Identifies an asynchronous request, see ExtFlash::read_async()
+typedef uint32_t ext_flash_handle_t;
+
+// Called from the task that reaps the last transaction of a request
+typedef void (*ext_flash_callback_t)(void *arg);
+
 class ExtFlash
 {
 public:
@@ -56,6 +115,7 @@ public:
     virtual ~ExtFlash();
 
     esp_err_t init(const ext_flash_config_t *config);
+    esp_err_t init(ExtFlashBus *spibus, const ext_flash_config_t *config);
     void term();
 
     virtual esp_err_t begin();
@@ -66,11 +126,42 @@ public:
 
     virtual size_t sector_size();
     virtual size_t chip_size();
+    size_t page_size();
     virtual esp_err_t erase_sector(size_t sector);
     virtual esp_err_t erase_range(size_t addr, size_t size);
     virtual esp_err_t erase_chip();
     virtual esp_err_t write(size_t addr, const void *src, size_t size);
+    esp_err_t smart_write(size_t addr, const void *src, size_t size);
     virtual esp_err_t read(size_t addr, void *dest, size_t size);
+    esp_err_t readv(const ext_flash_iovec_t *vec, size_t count);
+
+    esp_err_t set_cache(ExtFlashCache *cache);
+    esp_err_t set_read_ahead(ExtFlashReadAhead *ahead);
+    esp_err_t set_pool(ExtFlashPool *pool);
+
+    esp_err_t discard(size_t addr, size_t size);
+    esp_err_t erase_discarded();
+    esp_err_t allocate_sector(size_t *sector);
+
+    esp_err_t start_program(size_t addr, const void *src, size_t size, size_t *programmed);
+    esp_err_t start_erase(size_t addr, size_t size, size_t *erased);
+    bool op_busy();
+    uint32_t op_wait_us();
+    esp_err_t finish_op();
+    esp_err_t program_during_erase(size_t addr, const void *src, size_t size);
+
+    esp_err_t read_async(size_t addr, void *dest, size_t size, ext_flash_handle_t *handle, ext_flash_callback_t cb = NULL, void *arg = NULL);
+    esp_err_t wait(ext_flash_handle_t handle);
+    bool poll(ext_flash_handle_t handle);
+
+    esp_err_t verify(size_t addr, const void *src, size_t size, size_t *mismatch);
+    esp_err_t crc32(size_t addr, size_t size, uint32_t *crc);
+    esp_err_t sha256(size_t addr, size_t size, uint8_t digest[32]);
+
+    esp_err_t set_priority(ext_flash_priority_t priority);
+
+    void get_stats(ext_flash_stats_t *stats);
+    void reset_stats();
 
 protected:
     void cmd(bool isread, uint8_t cmd, int64_t addr, uint8_t mode, uint8_t dummy, uint8_t *buf, size_t size);
@@ -81,6 +172,11 @@ protected:
     void cmd(uint8_t cmd);
 
     void wait_for_command_completion();
+    bool reap(TickType_t ticks_to_wait);
+
+    void stage_begin();
+    void stage_end();
+    void stage_submit();
 
     void set_1_1_1();
     void set_1_1_2();
@@ -95,35 +191,239 @@ protected:
     virtual uint8_t read_status_register1();
     virtual void write_status_register1(uint8_t status);
     virtual void wait_for_device_idle();
+    void wait_for_busy(uint32_t *estimate_us);
+    void wait_for_erase(size_t addr, size_t size, uint32_t *estimate_us);
     virtual void reset();
     virtual bool read_sfdp();
 
     virtual esp_err_t read_nocrm(uint8_t inst, uint8_t dummy, size_t addr, void *dest, size_t size);
     virtual esp_err_t read_crm(uint8_t inst, uint8_t on, uint8_t off, uint8_t dummy, size_t addr, void *dest, size_t size);
- 
+
+    virtual esp_err_t queue_read(size_t addr, void *dest, size_t size);
+    virtual void page_program(size_t addr, const uint8_t *src, size_t size);
+
+    virtual bool suspend();
+    virtual void resume();
+
+    void set_crm_session(bool enable);
+    uint8_t crm_instruction();
+
+    uint8_t addr_inst(uint8_t inst);
+
 protected:
     spi_device_handle_t spi;
     size_t sector_sz;
     size_t capacity;
 
+    typedef struct
+    {
+        uint8_t inst;           // 0 = unused
+        size_t size;
+        uint32_t time_us;       // typical time, refined as erases finish, 0 = unknown
+    } erase_type_t;
+
+    static const int max_erase_types = 4;
+    erase_type_t erase_types[max_erase_types];
+    uint32_t chip_erase_us;
+
+    typedef struct
+    {
+        uint8_t inst;           // 0 = unsupported
+        uint8_t mode_clocks;
+        uint8_t dummy_clocks;
+    } read_type_t;
+
+    enum
+    {
+        read_1_1_2,
+        read_1_2_2,
+        read_1_1_4,
+        read_1_4_4,
+        read_4_4_4,
+        max_read_types
+    };
+    read_type_t read_types[max_read_types];
+
+    uint8_t quad_enable_req;    // SFDP QE requirements, 0xff = unknown
+    uint8_t qpi_enter_inst;     // 0 = unknown
+    uint8_t qpi_exit_inst;      // 0 = unknown
+
     static const uint8_t sr1_wip = 0x01;
+    static const uint8_t sr1_wel = 0x02;
     static const int pagesize = 256;
 
 private:
-    spi_transaction_ext_t *cmd_prolog();
+    spi_transaction_ext_t *cmd_prolog(uint8_t cmd);
     void cmd_epilog(spi_transaction_ext_t *t, uint8_t *buf, size_t size, bool isread);
     void cmd_epilog(spi_transaction_ext_t *t);
+    void transmit_polled(spi_transaction_ext_t *t);
+    void bounce(spi_transaction_ext_t *t);
+
+    void addr_mode_begin();
+    void addr_mode_end();
+
+    void set_read_type(int type, uint32_t bits);
+    uint8_t read_status(uint8_t inst);
+    bool set_quad_enable();
+
+    void stage_page(size_t addr, const uint8_t *src, size_t size);
+    void wait_for_page_program(size_t addr, size_t size, bool share);
+
+    void lock_bus(uint8_t priority = EXT_FLASH_PRIORITY_NORMAL);
+    void unlock_bus();
+    void lock_op();
+    void unlock_op();
+    void sleep_us(uint32_t us);
+    bool suspend_for_read(size_t addr, size_t size);
+    void crm_exit();
+
+    esp_err_t chip_read(size_t addr, void *dest, size_t size);
+    esp_err_t cache_read(size_t addr, uint8_t *dest, size_t size);
+    bool ahead_read(size_t addr, uint8_t *dest, size_t size, esp_err_t *err);
+    void ahead_fill(ExtFlashReadAhead::stream_t *s);
+    void ahead_wait(ExtFlashReadAhead::stream_t *s);
+    void invalidate_buffers(size_t addr, size_t size);
+    void wait_for_handle(ext_flash_handle_t handle);
+    void begin_op(size_t addr, size_t size, uint32_t *estimate_us);
+
+    // Gets each chunk of a stream() in order, returns false to stop early
+    typedef bool (*stream_fn_t)(void *arg, size_t offset, const uint8_t *data, size_t size);
+    esp_err_t stream(size_t addr, size_t size, stream_fn_t fn, void *arg);
 
 private:
     ext_flash_config_t cfg;
     spi_host_device_t bus;
 
+    // The bus the chip is on, own_bus unless init() was given one
+    ExtFlashBus own_bus;
+    ExtFlashBus *spibus;
+
     uint32_t tflags;
     bool is_qpi;
 
+    // Read type picked by mode_begin() or -1 for plain fast reads
+    int read_mode;
+
+    // Past 16MB addresses take 4 bytes, with the chip either in its 4-byte
+    // address mode or sent the 4-byte instructions, see addr_inst()
+    uint8_t addr_bits;
+    bool addr4_mode;
+    bool addr4_insts;
+    bool addr4_only;            // chip only does 4-byte addresses
+    uint8_t addr4_enter;        // SFDP 4-byte mode entry methods
+    uint32_t bait_insts;        // SFDP 4-byte instructions supported
+    uint8_t bait_erase[max_erase_types];
+
     spi_transaction_ext_t *trans;
     int queued;
     int qnext;
+
+    typedef struct
+    {
+        ext_flash_callback_t cb;
+        void *arg;
+        uint8_t *bounce;        // bounce buffer in use or NULL
+        uint8_t *dest;          // where a bounced read goes
+        size_t size;
+    } completion_t;
+
+    void unbounce(completion_t *c);
+
+    completion_t *completions;
+    uint32_t issued;
+    uint32_t completed;
+
+    // The bus lock covers the transaction ring and the chip, the op lock
+    // a whole write or erase, which lets go of the bus while erasing, or
+    // while programming a page when the bus is shared
+    SemaphoreHandle_t bus_lock;
+    SemaphoreHandle_t op_lock;
+    bool erasing;
+    TaskHandle_t eraser;        // task that waits for it
+    size_t busy_addr;           // range it covers, which reads wait out
+    size_t busy_size;
+
+    // Sleeps of the task holding the bus, and of the one whose write or
+    // erase sleeps with the bus let go, which can overlap
+    ExtFlashSleeper bus_sleeper;
+    ExtFlashSleeper op_sleeper;
+
+    // Program or erase begun by start_program() or start_erase()
+    bool op_pending;
+    size_t op_addr;
+    size_t op_size;
+    int64_t op_start;
+    uint32_t *op_estimate;
+
+    // With the scheduler, tasks waiting for the bus queue here instead of
+    // on the bus lock, which is given to the highest priority one when the
+    // owner lets go.  The sched lock only covers the queue.  A task only
+    // holds an entry while it waits or has a priority of its own, and
+    // sched_free counts the entries nobody holds.
+    typedef struct
+    {
+        TaskHandle_t task;      // NULL = unused
+        SemaphoreHandle_t wake; // given when the bus is handed over
+        int8_t priority;        // set_priority() or EXT_FLASH_PRIORITY_DEFAULT
+        bool waiting;
+        uint8_t want;           // priority of the request waiting
+        uint32_t seq;           // arrival order within a priority
+    } requester_t;
+
+    requester_t *find_requester();
+    requester_t *claim_requester();
+    void release_requester(requester_t *r);
+
+    static const int max_requesters = 8;
+    SemaphoreHandle_t sched_lock;
+    SemaphoreHandle_t sched_free;
+    requester_t requesters[max_requesters];
+    bool bus_busy;
+    uint8_t bus_priority;       // priority of the request holding the bus
+    uint32_t sched_seq;
+
+    // Continuous read mode kept between reads, crm_inst is the read it was
+    // entered with or 0 when the chip isn't in CRM
+    bool crm_session;
+    uint8_t crm_inst;
+    uint8_t crm_off;
+    uint8_t crm_dummy;
+    uint32_t crm_flags;
+
+    // Optional sector read cache and read-ahead, see set_cache() and
+    // set_read_ahead()
+    ExtFlashCache *cache;
+    ExtFlashReadAhead *ahead;
+
+    // Optional record of discarded and blank sectors, see set_pool()
+    ExtFlashPool *pool;
+
+    // Transactions encoded ahead of time, see stage_begin()
+    static const int max_staged = 4;
+    spi_transaction_ext_t staged[max_staged];
+    int nstaged;
+    bool staging;
+
+    // Word aligned DMA capable buffers, max_dma_size each, for transfers
+    // the SPI DMA can't reach, see bounce()
+    uint8_t *bounce_bufs;
+    uint32_t bounce_free;       // bit per free buffer
+    int nbounce;
+
+    ext_flash_stats_t stats;
+
+    // Status clocking time that covers most of a page program
+    uint8_t *status_buf;
+    uint32_t tpp_us;
+
+    static const int status_burst = 2048;
+    static const uint32_t default_tpp_us = 700;
+    static const uint32_t max_tpp_us = 5000;
+    static const uint32_t min_poll_us = 20;
+    static const int default_bounce_buffers = 2;
+    static const int max_bounce_buffers = 32;
+    static const size_t max_polled = 64;
+    static const size_t stream_chunk = 2048;
 };
 
 #endif
@@ -0,0 +1,57 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#if !defined(_EXTFLASH_BUS_H_)
+#define _EXTFLASH_BUS_H_ 1
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "driver/spi_master.h"
+
+typedef struct
+{
+    bool vspi;                  // true=VSPI, false=HSPI
+    int8_t sck_io_num;          // any GPIO or VSPICLK = 18, HSPICLK = 14
+    int8_t miso_io_num;         // any GPIO or VSPIQ   = 19, HSPIQ   = 12
+    int8_t mosi_io_num;         // any GPIO or VSPID   = 23, HSPID   = 13
+    int8_t hd_io_num;           // any GPIO or VSPIHD  = 21, HSPIHD  = 4
+    int8_t wp_io_num;           // any GPIO or VSPIWP  = 22, HSPIWP  = 2
+    int8_t dma_channel;         // must be 1 or 2
+    int    max_dma_size;        // larger = faster, smaller = less memory, 0 = default
+} ext_flash_bus_config_t;
+
+// SPI bus shared by several chips, see ExtFlash::init()
+class ExtFlashBus
+{
+public:
+    ExtFlashBus();
+    virtual ~ExtFlashBus();
+
+    esp_err_t init(const ext_flash_bus_config_t *config);
+    void term();
+
+    const ext_flash_bus_config_t *config();
+    spi_host_device_t host();
+
+    void attach();
+    void detach();
+    bool shared();
+
+private:
+    ext_flash_bus_config_t cfg;
+    bool initialized;
+    int devices;
+};
+
+#endif
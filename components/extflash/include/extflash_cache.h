@@ -0,0 +1,92 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#if !defined(_EXTFLASH_CACHE_H_)
+#define _EXTFLASH_CACHE_H_ 1
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+typedef struct
+{
+    size_t sectors;             // number of sectors held
+    bool psram;                 // true=PSRAM, false=internal RAM
+    bool clock;                 // true=CLOCK, false=LRU replacement
+} ext_flash_cache_config_t;
+
+typedef struct
+{
+    uint32_t hits;              // sectors served from the cache
+    uint32_t misses;            // sectors not in the cache
+    uint32_t fills;             // sectors read from the chip into the cache
+    uint32_t evictions;         // cached sectors replaced by others
+    uint32_t invalidations;     // cached sectors dropped by writes and erases
+} ext_flash_cache_stats_t;
+
+// Sector read cache, see ExtFlash::set_cache()
+class ExtFlashCache
+{
+public:
+    ExtFlashCache();
+    virtual ~ExtFlashCache();
+
+    esp_err_t init(const ext_flash_cache_config_t *config, size_t sector_size);
+    void term();
+
+    size_t sector_size();
+
+    void get_stats(ext_flash_cache_stats_t *stats);
+    void reset_stats();
+
+    uint8_t *lookup(size_t sector);
+    bool admit(size_t sector);
+    uint8_t *replace(size_t sector);
+    bool filled(uint8_t *buf, bool ok);
+    void invalidate(size_t addr, size_t size);
+    void invalidate_all();
+
+private:
+    ext_flash_cache_config_t cfg;
+    size_t sector_sz;
+
+    enum
+    {
+        slot_empty,
+        slot_filling,           // given out by replace(), see filled()
+        slot_dropped,           // invalidated while filling
+        slot_valid
+    };
+
+    typedef struct
+    {
+        size_t sector;
+        uint32_t used;          // LRU stamp
+        uint8_t state;
+        bool ref;               // CLOCK reference bit
+    } slot_t;
+
+    slot_t *slots;
+    uint8_t *data;
+    uint32_t tick;
+    size_t hand;
+
+    // Sectors that missed once recently, see admit()
+    size_t *ghosts;
+    size_t nghosts;
+    size_t ghost_next;
+
+    ext_flash_cache_stats_t stats;
+};
+
+#endif
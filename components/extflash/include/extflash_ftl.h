@@ -0,0 +1,134 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#if !defined(_EXTFLASH_FTL_H_)
+#define _EXTFLASH_FTL_H_ 1
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "extflash.h"
+
+typedef struct
+{
+    size_t start;               // first byte of the flash area, sector aligned
+    size_t size;                // bytes in the flash area, sector aligned
+    size_t block_size;          // bytes mapped at a time, 0 = default (256)
+    size_t spare_sectors;       // sectors kept back for garbage collection, 0 = default
+    uint32_t wear_threshold;    // erase count spread that moves cold data, 0 = default
+} ext_flash_ftl_config_t;
+
+typedef struct
+{
+    uint32_t writes;            // blocks written by the caller
+    uint32_t relocations;       // blocks moved by garbage collection
+    uint32_t erases;            // sectors erased
+    uint32_t wear_moves;        // sectors reclaimed to even out wear
+    uint32_t min_erases;        // least erased sector
+    uint32_t max_erases;        // most erased sector
+} ext_flash_ftl_stats_t;
+
+// Log structured flash translation layer, blocks are written out of place
+// and sectors reclaimed by garbage collection
+class ExtFlashFtl
+{
+public:
+    ExtFlashFtl();
+    virtual ~ExtFlashFtl();
+
+    esp_err_t init(ExtFlash *flash, const ext_flash_ftl_config_t *config);
+    void term();
+
+    size_t size();
+    size_t block_size();
+
+    esp_err_t read(size_t addr, void *dest, size_t size);
+    esp_err_t write(size_t addr, const void *src, size_t size);
+    esp_err_t collect(size_t free_sectors);
+
+    void get_stats(ext_flash_ftl_stats_t *stats);
+    void reset_stats();
+
+private:
+    esp_err_t mount();
+    size_t block_addr(uint32_t phys);
+    size_t entry_addr(uint32_t phys);
+    esp_err_t read_block(uint32_t block, uint8_t *dest);
+    esp_err_t write_block(uint32_t block, const uint8_t *src);
+    esp_err_t allocate(uint32_t *phys);
+    esp_err_t make_room();
+    esp_err_t open_sector();
+    esp_err_t erase(int sector);
+    int victim(bool wear);
+    uint32_t wear_spread();
+    esp_err_t reclaim(bool wear);
+
+private:
+    // At the start of every sector in use, followed by the logical block in
+    // each of the sector's other slots, 0xffffffff while the slot is unused
+    typedef struct
+    {
+        uint32_t magic;
+        uint32_t seq;           // order sectors were opened in
+        uint32_t erases;
+        uint32_t block_size;
+    } header_t;
+
+    enum
+    {
+        sector_free,
+        sector_open,
+        sector_full
+    };
+
+    typedef struct
+    {
+        uint32_t erases;
+        uint16_t valid;         // slots holding a block's newest copy
+        uint8_t state;
+        bool dirty;             // free but not known to be erased
+    } sector_t;
+
+    ext_flash_ftl_config_t cfg;
+    ExtFlash *flash;
+    SemaphoreHandle_t lock;
+
+    size_t sector_sz;
+    int nsectors;
+    uint32_t slots;             // per sector, the header takes the first
+    uint32_t nblocks;
+
+    uint32_t *map;              // logical block to slot or unmapped
+    sector_t *sectors;
+    int nfree;
+    int head;                   // sector being filled or -1
+    uint32_t head_slot;
+    uint32_t seq;
+    bool collecting;
+
+    uint8_t *buf;               // partial block updates
+    uint8_t *gc_buf;            // blocks being moved
+    uint32_t *entries;
+
+    ext_flash_ftl_stats_t stats;
+
+    static const uint32_t header_magic = 0x4c544645;
+    static const uint32_t unmapped = 0xffffffff;
+    static const size_t default_block_size = 256;
+    static const uint32_t default_wear_threshold = 16;
+};
+
+#endif
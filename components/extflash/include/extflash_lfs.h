@@ -0,0 +1,32 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#if !defined(_EXTFLASH_LFS_H_)
+#define _EXTFLASH_LFS_H_ 1
+
+// Only built when the project has LittleFS
+#if __has_include("lfs.h")
+
+#include "esp_err.h"
+#include "lfs.h"
+
+#include "extflash_partition.h"
+
+// Fill in the block device half of a LittleFS config for a partition, sizes
+// already set are kept
+esp_err_t ext_flash_lfs_config(ExtFlashPartition *part, struct lfs_config *config);
+
+#endif
+
+#endif
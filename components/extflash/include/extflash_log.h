@@ -0,0 +1,148 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#if !defined(_EXTFLASH_LOG_H_)
+#define _EXTFLASH_LOG_H_ 1
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "extflash.h"
+
+typedef struct
+{
+    size_t start;               // first byte of the log, sector aligned
+    size_t size;                // bytes in the log, sector aligned
+    size_t erase_ahead;         // sectors kept erased ahead of the head, 0 = default (2)
+    size_t buffer_pages;        // pages of records held until programmed, 0 = default (8)
+} ext_flash_log_config_t;
+
+typedef struct
+{
+    uint32_t appends;           // records appended
+    uint32_t overruns;          // appends refused because the buffer was full
+    uint32_t pages;             // page programs, whole or partial
+    uint32_t erases;            // sectors erased
+    uint32_t late_erases;       // erases the head had to wait for
+    uint32_t dropped;           // oldest sectors given up to make room
+} ext_flash_log_stats_t;
+
+// Where a reader is in the log, see ExtFlashLog::rewind()
+typedef struct
+{
+    uint32_t seq;               // sequence number of the sector
+    size_t offset;              // within the sector
+} ext_flash_log_cursor_t;
+
+// Circular append only record log.  append() only copies the record into
+// RAM, the task that calls service() programs whole pages and keeps sectors
+// erased ahead of the head, so a producer never waits on the chip.
+class ExtFlashLog
+{
+public:
+    ExtFlashLog();
+    virtual ~ExtFlashLog();
+
+    esp_err_t init(ExtFlash *flash, const ext_flash_log_config_t *config);
+    void term();
+
+    size_t max_record();
+
+    esp_err_t append(const void *record, size_t size);
+
+    esp_err_t service();
+    esp_err_t sync();
+
+    void rewind(ext_flash_log_cursor_t *cursor);
+    esp_err_t read(ext_flash_log_cursor_t *cursor, void *dest, size_t *size);
+    esp_err_t truncate(const ext_flash_log_cursor_t *cursor);
+
+    void get_stats(ext_flash_log_stats_t *stats);
+    void reset_stats();
+
+private:
+    // At the start of every sector in use
+    typedef struct
+    {
+        uint32_t magic;         // discarded sectors have it programmed to 0
+        uint32_t seq;
+    } header_t;
+
+    // Ahead of every record, which is padded to a multiple of 4 bytes and
+    // never crosses into the next sector
+    typedef struct
+    {
+        uint16_t len;           // 0xffff past the last record of a sector
+        uint16_t check;
+    } record_t;
+
+    typedef struct
+    {
+        uint8_t *data;
+        uint32_t seq;           // sector the page is in
+        size_t offset;          // of the page within the sector
+        size_t lo;              // bytes not yet programmed
+        size_t hi;
+        bool closed;            // the head moved past it
+    } slot_t;
+
+    esp_err_t mount();
+    esp_err_t scan_head();
+    size_t sector_addr(uint32_t seq);
+    slot_t *slot_for(uint32_t seq, size_t offset);
+    void put(uint32_t seq, size_t offset, const void *src, size_t size);
+    esp_err_t drain(bool partial);
+    esp_err_t program(slot_t *slot);
+    esp_err_t start_erase();
+    esp_err_t finish_erase();
+    esp_err_t discard();
+    esp_err_t flash_write(size_t addr, const void *src, size_t size);
+
+    ext_flash_log_config_t cfg;
+    ExtFlash *flash;
+    SemaphoreHandle_t lock;
+
+    size_t sector_sz;
+    size_t page_sz;
+    uint32_t nsectors;
+    size_t base;                // sector index of sequence number 0
+
+    uint32_t tail_seq;          // oldest sector kept
+    uint32_t discarded_seq;     // sectors before it are marked discarded
+    uint32_t head_seq;          // sector appends go to
+    size_t head_off;
+    uint32_t prog_seq;          // what readers can see
+    size_t prog_off;
+    uint32_t erased_seq;        // sectors up to it are erased or in use
+
+    bool mounted;
+    bool erase_pending;         // erase of erased_seq + 1 under way
+
+    slot_t *slots;
+    uint8_t *data;
+    size_t first;               // oldest slot in use
+    size_t used;
+
+    uint8_t *buf;               // records checked while mounting
+
+    ext_flash_log_stats_t stats;
+
+    static const uint32_t header_magic = 0x474f4c45;
+    static const size_t default_erase_ahead = 2;
+    static const size_t default_buffer_pages = 8;
+};
+
+#endif
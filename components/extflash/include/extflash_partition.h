@@ -0,0 +1,69 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#if !defined(_EXTFLASH_PARTITION_H_)
+#define _EXTFLASH_PARTITION_H_ 1
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+#include "extflash.h"
+
+typedef struct
+{
+    const char *label;          // name to find it by, kept by reference
+    size_t offset;              // sector aligned start on the chip
+    size_t size;                // sector aligned size
+} ext_flash_partition_config_t;
+
+// Named region of a chip for a filesystem or other user, see find()
+class ExtFlashPartition
+{
+public:
+    ExtFlashPartition();
+    virtual ~ExtFlashPartition();
+
+    esp_err_t init(ExtFlash *flash, const ext_flash_partition_config_t *config);
+    void term();
+
+    static ExtFlashPartition *find(const char *label);
+
+    const char *label();
+    ExtFlash *chip();
+    size_t size();
+    size_t sector_size();
+    size_t page_size();
+
+    esp_err_t read(size_t addr, void *dest, size_t size);
+    esp_err_t write(size_t addr, const void *src, size_t size);
+    esp_err_t erase_range(size_t addr, size_t size);
+    esp_err_t sync();
+
+private:
+    esp_err_t check(size_t addr, size_t size);
+    esp_err_t flush(size_t addr, size_t size);
+
+private:
+    ext_flash_partition_config_t cfg;
+    ExtFlash *flash;
+
+    // Erase held back to be done along with the next ones, see erase_range()
+    size_t erase_start;
+    size_t erase_size;
+
+    ExtFlashPartition *next;
+    static ExtFlashPartition *partitions;
+};
+
+#endif
@@ -0,0 +1,90 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#if !defined(_EXTFLASH_POOL_H_)
+#define _EXTFLASH_POOL_H_ 1
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+typedef struct
+{
+    size_t start;               // first byte tracked, sector aligned
+    size_t size;                // bytes tracked, sector aligned
+} ext_flash_pool_config_t;
+
+typedef struct
+{
+    uint32_t discarded;         // sectors discarded
+    uint32_t erased;            // sectors erased ahead of time
+    uint32_t erases;            // erases that took them, of any size
+    uint32_t allocated;         // blank sectors handed out
+    uint32_t inline_erases;     // sectors handed out that had to be erased first
+    uint32_t skipped;           // sector erases skipped as the sector was blank
+} ext_flash_pool_stats_t;
+
+// Which sectors are discarded or known to be blank, see ExtFlash::set_pool()
+class ExtFlashPool
+{
+public:
+    ExtFlashPool();
+    virtual ~ExtFlashPool();
+
+    esp_err_t init(const ext_flash_pool_config_t *config, size_t sector_size);
+    void term();
+
+    size_t sector_size();
+    bool covers(size_t addr, size_t size);
+
+    void get_stats(ext_flash_pool_stats_t *stats);
+    void reset_stats();
+
+    void discard(size_t addr, size_t size);
+    void written(size_t addr, size_t size);
+    void erasing(size_t addr, size_t size);
+    void erased(size_t addr, size_t size);
+    bool blank(size_t addr, size_t size);
+    bool erasable(size_t addr, size_t size);
+    bool next_discarded(size_t *addr);
+    bool take_blank(size_t *addr);
+    bool take_discarded(size_t *addr);
+    void skipped();
+    void erased_ahead(size_t size);
+
+private:
+    enum
+    {
+        sector_used,            // or not known to be anything else
+        sector_discarded,
+        sector_erasing,
+        sector_blank,
+        sector_allocated        // blank and handed out
+    };
+
+    void set_state(size_t sector, uint8_t state);
+    bool take(uint8_t from, size_t *addr);
+
+    ext_flash_pool_config_t cfg;
+    size_t sector_sz;
+    size_t nsectors;
+
+    uint8_t *states;            // per sector
+    size_t ndiscarded;
+    size_t nblank;
+    size_t hand;                // where the last search ended
+
+    ext_flash_pool_stats_t stats;
+};
+
+#endif
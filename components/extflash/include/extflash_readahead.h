@@ -0,0 +1,100 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#if !defined(_EXTFLASH_READAHEAD_H_)
+#define _EXTFLASH_READAHEAD_H_ 1
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+typedef struct
+{
+    size_t streams;             // sequential streams followed at once
+    size_t buffers;             // buffers per stream, 2 = double, 3 = triple
+    size_t min_size;            // smallest read-ahead per buffer
+    size_t max_size;            // largest read-ahead per buffer
+    bool psram;                 // true=PSRAM, false=internal RAM
+} ext_flash_read_ahead_config_t;
+
+typedef struct
+{
+    uint32_t hits;              // reads served from read-ahead buffers
+    uint32_t misses;            // sequential reads that weren't buffered
+    uint32_t reads;             // read-aheads issued
+    uint64_t wasted;            // bytes read ahead but never used
+} ext_flash_read_ahead_stats_t;
+
+// Sequential read detection and read-ahead, see ExtFlash::set_read_ahead()
+class ExtFlashReadAhead
+{
+public:
+    ExtFlashReadAhead();
+    virtual ~ExtFlashReadAhead();
+
+    esp_err_t init(const ext_flash_read_ahead_config_t *config);
+    void term();
+
+    void get_stats(ext_flash_read_ahead_stats_t *stats);
+    void reset_stats();
+
+public:
+    typedef struct
+    {
+        uint8_t *data;
+        size_t addr;
+        size_t len;             // 0 = empty
+        uint32_t handle;        // completes the read into it
+    } buffer_t;
+
+    typedef struct
+    {
+        size_t next;            // where the next sequential read starts
+        size_t ahead;           // where the next read-ahead starts
+        size_t window;          // current read-ahead size
+        uint32_t run;           // sequential reads in a row
+        uint32_t full;          // buffers used up in a row
+        uint32_t used;          // LRU stamp
+        buffer_t *bufs;
+    } stream_t;
+
+    stream_t *find(size_t addr);
+    stream_t *lru();
+    void restart(stream_t *s, size_t next);
+    buffer_t *buffer(stream_t *s, size_t addr);
+
+    void used_up(stream_t *s);
+    void dropped(stream_t *s);
+    void issued(stream_t *s, buffer_t *b, size_t addr, size_t len, uint32_t handle);
+    void hit();
+    void miss();
+
+    size_t buffer_count();
+    size_t max_size();
+    void invalidate(size_t addr, size_t size);
+
+    // Sequential reads seen before reading ahead
+    static const uint32_t min_run = 2;
+
+private:
+    ext_flash_read_ahead_config_t cfg;
+
+    stream_t *streams;
+    buffer_t *bufs;
+    uint8_t *data;
+    uint32_t tick;
+
+    ext_flash_read_ahead_stats_t stats;
+};
+
+#endif
@@ -0,0 +1,47 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#if !defined(_EXTFLASH_SLEEPER_H_)
+#define _EXTFLASH_SLEEPER_H_ 1
+
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+// Puts a task to sleep for a given time without keeping the core busy.
+// Sleeps of a tick or more are whole ticks, rounded up, and shorter ones
+// block on a one-shot timer.  Only those of max_spin_us or less, too short
+// for the timer to be worth it, are busy-waited.  One task at a time.
+class ExtFlashSleeper
+{
+public:
+    ExtFlashSleeper();
+    virtual ~ExtFlashSleeper();
+
+    esp_err_t init();
+    void term();
+
+    void sleep_us(uint32_t us);
+
+    static const uint32_t max_spin_us = 50;
+
+private:
+    static void expired(void *arg);
+
+    esp_timer_handle_t timer;
+    SemaphoreHandle_t wake;
+};
+
+#endif
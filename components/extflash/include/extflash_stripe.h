@@ -0,0 +1,63 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#if !defined(_EXTFLASH_STRIPE_H_)
+#define _EXTFLASH_STRIPE_H_ 1
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+#include "extflash.h"
+#include "extflash_sleeper.h"
+
+typedef struct
+{
+    size_t unit;                // stripe unit, a multiple of the sector size, 0 = one sector
+} ext_flash_stripe_config_t;
+
+// Chips, each on its own bus, striped into one address space
+class ExtFlashStripe
+{
+public:
+    ExtFlashStripe();
+    virtual ~ExtFlashStripe();
+
+    esp_err_t init(ExtFlash **chips, int count, const ext_flash_stripe_config_t *config);
+    void term();
+
+    size_t sector_size();
+    size_t chip_size();
+    esp_err_t erase_range(size_t addr, size_t size);
+    esp_err_t write(size_t addr, const void *src, size_t size);
+    esp_err_t read(size_t addr, void *dest, size_t size);
+
+private:
+    size_t chip_addr(int chip, size_t addr);
+    size_t stripe_addr(int chip, size_t addr);
+    esp_err_t check(size_t addr, size_t size);
+    esp_err_t run(size_t addr, const uint8_t *src, size_t size);
+
+private:
+    static const int max_chips = 4;
+
+    ext_flash_stripe_config_t cfg;
+    ExtFlash *chips[max_chips];
+    int nchips;
+    size_t sector_sz;
+    size_t capacity;
+
+    ExtFlashSleeper sleeper;
+};
+
+#endif
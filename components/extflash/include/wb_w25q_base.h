@@ -17,20 +17,19 @@
 
 #include "extflash.h"
 
-#define CMD_WRITE_STATUS_REG2               0x31
-#define CMD_READ_STATUS_REG2                0x35
-#define CMD_ENTER_QPI_MODE                  0x38
+#define CMD_QUAD_PAGE_PROGRAM               0x32
 #define CMD_FAST_READ_DUAL_OUTPUT           0x3b
 #define CMD_SR_WRITE_ENABLE                 0x50
 #define CMD_BLOCK_ERASE_32K                 0x52
 #define CMD_FAST_READ_QUAD_OUTPUT           0x6b
+#define CMD_ERASE_PROGRAM_SUSPEND           0x75
+#define CMD_ERASE_PROGRAM_RESUME            0x7a
 #define CMD_FAST_READ_DUAL_IO               0xbb
 #define CMD_SET_READ_PARAMETERS             0xc0
 #define CMD_BLOCK_ERASE_64K                 0xd8
 #define CMD_OCTAL_WORD_READ_QUAD_IO         0xe3
 #define CMD_WORD_READ_QUAD_IO               0xe7
 #define CMD_FAST_READ_QUAD_IO               0xeb
-#define CMD_EXIT_QPI_MODE                   0xff
 
 class wb_w25q_base : public ExtFlash
 {
@@ -38,19 +37,44 @@ public:
     wb_w25q_base();
     virtual ~wb_w25q_base();
 
+    // Suspend erases to serve reads from other tasks (off by default)
+    void set_suspend_mode(bool enable);
+
+    // Stay in continuous read mode between reads (off by default)
+    void set_crm_session_mode(bool enable);
+
     //
     // ExtFlash implementation
     //
     virtual void reset() override;
+    virtual void mode_begin() override;
+    virtual void mode_end() override;
 
 protected:
     uint8_t read_status_register2();
     void write_status_register2(uint8_t status);
 
+    //
+    // ExtFlash implementation
+    //
+    virtual bool suspend() override;
+    virtual void resume() override;
+
 protected:
     static const uint8_t crm_on = 0x20;
     static const uint8_t crm_off = 0x10;
     static const uint8_t sr2_quad_enable = 0x02;
+    static const uint8_t sr2_suspend = 0x80;
+
+private:
+    bool suspend_enabled;
+    int64_t resumed_at;
+
+    // Time an erase gets to make progress between suspends
+    static const uint32_t resume_holdoff_us = 200;
+
+    // tSUS, the longest the chip takes to suspend
+    static const uint32_t max_suspend_us = 20;
 };
 
 #endif
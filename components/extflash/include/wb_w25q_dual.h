@@ -23,10 +23,11 @@ public:
     wb_w25q_dual();
     virtual ~wb_w25q_dual();
 
+protected:
     //
-    // ExtFlash implementaion
+    // ExtFlash implementation
     //
-    virtual esp_err_t read(size_t src_addr, void *dest, size_t size) final;
+    virtual esp_err_t queue_read(size_t addr, void *dest, size_t size) final;
 };
 
 #endif
@@ -28,7 +28,13 @@ public:
     //
     virtual void mode_begin() final;
     virtual void mode_end() final;
-    virtual esp_err_t read(size_t src_addr, void *dest, size_t size) final;
+
+protected:
+    //
+    // ExtFlash implementation
+    //
+    virtual esp_err_t queue_read(size_t addr, void *dest, size_t size) final;
+    virtual void page_program(size_t addr, const uint8_t *src, size_t size) final;
 };
 
 #endif
@@ -14,6 +14,8 @@
 
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "rom/ets_sys.h"
 
 #include "wb_w25q_base.h"
 
@@ -21,6 +23,13 @@ static const char *TAG = "wb_w25q_base";
 
 wb_w25q_base::wb_w25q_base()
 {
+    // Used when SFDP isn't read, datasheet typical times
+    erase_types[0] = {CMD_SECTOR_ERASE, 4 * 1024, 45 * 1000};
+    erase_types[1] = {CMD_BLOCK_ERASE_32K, 32 * 1024, 120 * 1000};
+    erase_types[2] = {CMD_BLOCK_ERASE_64K, 64 * 1024, 150 * 1000};
+
+    suspend_enabled = false;
+    resumed_at = 0;
 }
 
 wb_w25q_base::~wb_w25q_base()
@@ -44,6 +53,18 @@ void wb_w25q_base::write_status_register2(uint8_t status)
     wait_for_device_idle();
 }
 
+void wb_w25q_base::set_suspend_mode(bool enable)
+{
+    ESP_LOGD(TAG, "%s - enable=%d", __func__, enable);
+
+    suspend_enabled = enable;
+}
+
+void wb_w25q_base::set_crm_session_mode(bool enable)
+{
+    set_crm_session(enable);
+}
+
 // ============================================================================
 // ExtFlash implementation
 // ============================================================================
@@ -64,3 +85,60 @@ void wb_w25q_base::reset()
     wait_for_device_idle();
 }
 
+// The subclasses set up their own protocol rather than going by SFDP
+void wb_w25q_base::mode_begin()
+{
+}
+
+void wb_w25q_base::mode_end()
+{
+}
+
+bool wb_w25q_base::suspend()
+{
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (!suspend_enabled)
+    {
+        return false;
+    }
+
+    int64_t since = esp_timer_get_time() - resumed_at;
+    if (since < resume_holdoff_us)
+    {
+        ets_delay_us(resume_holdoff_us - since);
+    }
+
+    // WIP stays set for up to tSUS and SUS is only set if the erase hadn't
+    // finished already.  A chip still busy when polled after tSUS is resumed
+    // in case it suspends after all, and the reader waits for the erase.
+    cmd(CMD_ERASE_PROGRAM_SUSPEND);
+    wait_for_command_completion();
+
+    int64_t deadline = esp_timer_get_time() + max_suspend_us;
+    while (true)
+    {
+        bool late = esp_timer_get_time() > deadline;
+        if (!(read_status_register1() & sr1_wip))
+        {
+            break;
+        }
+
+        if (late)
+        {
+            ESP_LOGW(TAG, "suspend took longer than %dus", max_suspend_us);
+            resume();
+            return false;
+        }
+    }
+
+    return (read_status_register2() & sr2_suspend) != 0;
+}
+
+void wb_w25q_base::resume()
+{
+    ESP_LOGD(TAG, "%s", __func__);
+
+    cmd(CMD_ERASE_PROGRAM_RESUME);
+    resumed_at = esp_timer_get_time();
+}
@@ -31,10 +31,17 @@ wb_w25q_dio::~wb_w25q_dio()
 // ExtFlash implementation
 // ============================================================================
 
-esp_err_t wb_w25q_dio::read(size_t addr, void *dest, size_t size)
+esp_err_t wb_w25q_dio::queue_read(size_t addr, void *dest, size_t size)
 {
     ESP_LOGD(TAG, "%s - addr=0x%08x size=%d", __func__, addr, size);
 
+    // Chips past 16MB without 4-byte address mode may lack the 4-byte
+    // variant of the read
+    if (addr_inst(CMD_FAST_READ_DUAL_IO) == 0)
+    {
+        return ExtFlash::queue_read(addr, dest, size);
+    }
+
     esp_err_t err;
 
     set_1_2_2();
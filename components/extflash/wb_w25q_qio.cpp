@@ -45,21 +45,40 @@ void wb_w25q_qio::mode_end()
     write_status_register2(read_status_register2() & (~sr2_quad_enable));
 }
 
-esp_err_t wb_w25q_qio::read(size_t addr, void *dest, size_t size)
+esp_err_t wb_w25q_qio::queue_read(size_t addr, void *dest, size_t size)
 {
     ESP_LOGD(TAG, "%s - addr=0x%08x size=%d", __func__, addr, size);
 
+    // Chips past 16MB without 4-byte address mode may lack the 4-byte
+    // variant of the read
+    if (addr_inst(CMD_FAST_READ_QUAD_IO) == 0)
+    {
+        return ExtFlash::queue_read(addr, dest, size);
+    }
+
     esp_err_t err;
+    bool octal = (addr & 0x0f) == 0 && (size & 0x0f) == 0 && addr_inst(CMD_OCTAL_WORD_READ_QUAD_IO);
+    bool word = (addr & 0x01) == 0 && (size & 0x01) == 0 && addr_inst(CMD_WORD_READ_QUAD_IO);
+    uint8_t inst = crm_instruction();
+
+    // Carrying on with the read the chip is still in CRM for is cheaper
+    // than leaving CRM for a better suited one
+    if (!(inst == CMD_FAST_READ_QUAD_IO ||
+          (inst == CMD_WORD_READ_QUAD_IO && word) ||
+          (inst == CMD_OCTAL_WORD_READ_QUAD_IO && octal)))
+    {
+        inst = 0;
+    }
 
-    if (size > 4)
+    if (size > 4 || inst != 0)
     {
         set_1_4_4();
 
-        if ((addr & 0x0f) == 0 && (size & 0x0f) == 0)
+        if (inst == CMD_OCTAL_WORD_READ_QUAD_IO || (inst == 0 && octal))
         {
             err = read_crm(CMD_OCTAL_WORD_READ_QUAD_IO, crm_on, crm_off, 0, addr, dest, size);
         }
-        else if ((addr & 0x01) == 0 && (size & 0x01) == 0)
+        else if (inst == CMD_WORD_READ_QUAD_IO || (inst == 0 && word))
         {
             err = read_crm(CMD_WORD_READ_QUAD_IO, crm_on, crm_off, 8, addr, dest, size);
         }
@@ -78,3 +97,17 @@ esp_err_t wb_w25q_qio::read(size_t addr, void *dest, size_t size)
     return err;
 }
 
+void wb_w25q_qio::page_program(size_t addr, const uint8_t *src, size_t size)
+{
+    if (addr_inst(CMD_QUAD_PAGE_PROGRAM) == 0)
+    {
+        ExtFlash::page_program(addr, src, size);
+        return;
+    }
+
+    set_1_1_4();
+
+    cmd(false, CMD_QUAD_PAGE_PROGRAM, addr, (uint8_t *) src, size);
+
+    set_1_1_1();
+}
@@ -55,10 +55,17 @@ void wb_w25q_qpi::mode_end()
     wait_for_device_idle();
 }
 
-esp_err_t wb_w25q_qpi::read(size_t addr, void *dest, size_t size)
+esp_err_t wb_w25q_qpi::queue_read(size_t addr, void *dest, size_t size)
 {
     ESP_LOGD(TAG, "%s - addr=0x%08x size=%d", __func__, addr, size);
 
+    // Chips past 16MB without 4-byte address mode may lack the 4-byte
+    // variant of the read
+    if (addr_inst(CMD_FAST_READ_QUAD_IO) == 0)
+    {
+        return ExtFlash::queue_read(addr, dest, size);
+    }
+
     return read_crm(CMD_FAST_READ_QUAD_IO, crm_on, crm_off, 0, addr, dest, size);
 }
 
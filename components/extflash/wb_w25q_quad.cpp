@@ -45,10 +45,17 @@ void wb_w25q_quad::mode_end()
     write_status_register2(read_status_register2() & (~sr2_quad_enable));
 }
 
-esp_err_t wb_w25q_quad::read(size_t addr, void *dest, size_t size)
+esp_err_t wb_w25q_quad::queue_read(size_t addr, void *dest, size_t size)
 {
     ESP_LOGD(TAG, "%s - addr=0x%08x size=%d", __func__, addr, size);
 
+    // Chips past 16MB without 4-byte address mode may lack the 4-byte
+    // variant of the read
+    if (addr_inst(CMD_FAST_READ_QUAD_OUTPUT) == 0)
+    {
+        return ExtFlash::queue_read(addr, dest, size);
+    }
+
     esp_err_t err;
 
     set_1_1_4();
@@ -60,3 +67,17 @@ esp_err_t wb_w25q_quad::read(size_t addr, void *dest, size_t size)
     return err;
 }
 
+void wb_w25q_quad::page_program(size_t addr, const uint8_t *src, size_t size)
+{
+    if (addr_inst(CMD_QUAD_PAGE_PROGRAM) == 0)
+    {
+        ExtFlash::page_program(addr, src, size);
+        return;
+    }
+
+    set_1_1_4();
+
+    cmd(false, CMD_QUAD_PAGE_PROGRAM, addr, (uint8_t *) src, size);
+
+    set_1_1_1();
+}
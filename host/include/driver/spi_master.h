@@ -0,0 +1,114 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//
+// Host simulation stand-in for the ESP-IDF header of the same name
+//
+// Transactions are handed to the simulated bus and flash chips in
+// host/sim_spi.cpp instead of the SPI peripheral.
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "esp_attr.h"
+#include "freertos/FreeRTOS.h"
+#include "driver/gpio.h"
+#include "driver/spi_common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SPI_DEVICE_TXBIT_LSBFIRST   (1 << 0)
+#define SPI_DEVICE_RXBIT_LSBFIRST   (1 << 1)
+#define SPI_DEVICE_BIT_LSBFIRST     (SPI_DEVICE_TXBIT_LSBFIRST | SPI_DEVICE_RXBIT_LSBFIRST)
+#define SPI_DEVICE_3WIRE            (1 << 2)
+#define SPI_DEVICE_POSITIVE_CS      (1 << 3)
+#define SPI_DEVICE_HALFDUPLEX       (1 << 4)
+#define SPI_DEVICE_CLK_AS_CS        (1 << 5)
+#define SPI_DEVICE_NO_DUMMY         (1 << 6)
+
+#define SPI_TRANS_MODE_DIO          (1 << 0)
+#define SPI_TRANS_MODE_QIO          (1 << 1)
+#define SPI_TRANS_USE_RXDATA        (1 << 2)
+#define SPI_TRANS_USE_TXDATA        (1 << 3)
+#define SPI_TRANS_MODE_DIOQIO_ADDR  (1 << 4)
+#define SPI_TRANS_VARIABLE_CMD      (1 << 5)
+#define SPI_TRANS_VARIABLE_ADDR     (1 << 6)
+
+typedef struct spi_transaction_t spi_transaction_t;
+typedef void (*transaction_cb_t)(spi_transaction_t *trans);
+
+typedef struct
+{
+    uint8_t command_bits;
+    uint8_t address_bits;
+    uint8_t dummy_bits;
+    uint8_t mode;
+    uint8_t duty_cycle_pos;
+    uint8_t cs_ena_pretrans;
+    uint8_t cs_ena_posttrans;
+    int clock_speed_hz;
+    int input_delay_ns;
+    int spics_io_num;
+    uint32_t flags;
+    int queue_size;
+    transaction_cb_t pre_cb;
+    transaction_cb_t post_cb;
+} spi_device_interface_config_t;
+
+struct spi_transaction_t
+{
+    uint32_t flags;
+    uint16_t cmd;
+    uint64_t addr;
+    size_t length;
+    size_t rxlength;
+    void *user;
+    union
+    {
+        const void *tx_buffer;
+        uint8_t tx_data[4];
+    };
+    union
+    {
+        void *rx_buffer;
+        uint8_t rx_data[4];
+    };
+};
+
+typedef struct
+{
+    struct spi_transaction_t base;
+    uint8_t command_bits;
+    uint8_t address_bits;
+} spi_transaction_ext_t;
+
+typedef struct spi_device_t *spi_device_handle_t;
+
+esp_err_t spi_bus_add_device(spi_host_device_t host, const spi_device_interface_config_t *dev_config, spi_device_handle_t *handle);
+esp_err_t spi_bus_remove_device(spi_device_handle_t handle);
+esp_err_t spi_device_queue_trans(spi_device_handle_t handle, spi_transaction_t *trans_desc, TickType_t ticks_to_wait);
+esp_err_t spi_device_get_trans_result(spi_device_handle_t handle, spi_transaction_t **trans_desc, TickType_t ticks_to_wait);
+esp_err_t spi_device_transmit(spi_device_handle_t handle, spi_transaction_t *trans_desc);
+esp_err_t spi_device_polling_transmit(spi_device_handle_t handle, spi_transaction_t *trans_desc);
+
+#ifdef __cplusplus
+}
+#endif
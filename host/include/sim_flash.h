@@ -0,0 +1,117 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//
+// Control interface of the host simulation
+//
+// The simulated SPI master decodes every transaction into the command,
+// address, mode, dummy and data phases a real chip would see, replays it
+// against a W25Q flash model and charges simulated time for it.  Time only
+// moves when the driver does something that costs time on the hardware, so
+// benchmarks measure the modelled ESP32 and chip, not the host.
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "driver/spi_master.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct
+{
+    const char *name;
+    uint8_t jedec_id[3];
+    size_t capacity;            // bytes
+    bool sfdp;                  // answer READ_SFDP with a JESD216B table
+    uint32_t tbp1_ns;           // first byte program time
+    uint32_t tbp2_ns;           // additional byte program time
+    uint32_t tpp_ns;            // page program time
+    uint32_t tw_ns;             // non-volatile status register write time
+    uint32_t tsus_ns;           // suspend latency
+    uint64_t tse_ns;            // 4KB sector erase time
+    uint64_t tbe1_ns;           // 32KB block erase time
+    uint64_t tbe2_ns;           // 64KB block erase time
+    uint64_t tce_ns;            // chip erase time
+    bool insts_4b_only;         // no B7h, and only some of the 4-byte instructions
+} sim_flash_chip_t;
+
+typedef struct
+{
+    uint32_t queue_ns;          // CPU time of spi_device_queue_trans()
+    uint32_t setup_ns;          // bus time to start a queued transaction (ISR, DMA descriptors)
+    uint32_t dma_ns_per_byte;   // DMA overhead per data byte
+    uint32_t reap_ns;           // CPU time to collect an already finished transaction
+    uint32_t wake_ns;           // CPU time to block on and wake up from a pending transaction
+    uint32_t bounce_ns;         // driver allocating a temporary DMA buffer
+    uint32_t poll_ns;           // bus time to start a polling transaction
+} sim_spi_timing_t;
+
+typedef struct
+{
+    uint32_t transactions;      // transactions executed
+    uint64_t clocks;            // SCK cycles
+    uint64_t bus_ns;            // time the bus was busy
+    uint32_t dma_bounces;       // transactions the SPI driver had to copy through a temporary buffer
+    uint32_t polled;            // transactions run with spi_device_polling_transmit()
+    uint32_t status_polls;      // status register reads issued while the chip was busy
+    uint32_t programs;          // page programs
+    uint32_t erases;            // sector, block and chip erases
+    uint32_t protocol_errors;   // transactions the chip could not make sense of
+    uint32_t busy_violations;   // commands sent while the chip was busy
+} sim_flash_stats_t;
+
+// Chip presets: "w25q32", "w25q64", "w25q128" (the default) and "w25q256"
+const sim_flash_chip_t *sim_flash_find_chip(const char *name);
+
+// Attach a chip to a chip select, replacing any chip already there
+void sim_flash_attach(spi_host_device_t host, int cs_io_num, const sim_flash_chip_t *chip);
+
+// Direct access to the array of the chip on a chip select
+uint8_t *sim_flash_array(spi_host_device_t host, int cs_io_num, size_t *size);
+
+void sim_spi_get_timing(sim_spi_timing_t *timing);
+void sim_spi_set_timing(const sim_spi_timing_t *timing);
+
+void sim_flash_get_stats(sim_flash_stats_t *stats);
+void sim_flash_reset_stats(void);
+
+// Whether the SPI DMA can reach a buffer
+bool sim_ptr_dma_capable(const void *ptr);
+
+int64_t sim_time_ns(void);
+void sim_advance_ns(int64_t ns);
+
+// Block the running task until the clock reaches wake_ns, letting other
+// tasks run meanwhile
+void sim_block_until_ns(int64_t wake_ns);
+
+// Called whenever the running task blocks in vTaskDelay() or on a
+// semaphore, to stand in for another task that gets to run meanwhile.
+// Busy-waits in ets_delay_us() and taskYIELD() keep the CPU, so they don't
+// call it
+void sim_set_sleep_hook(void (*hook)(void *arg), void *arg);
+
+// Print the statistics and exit, with a failure status if the chip saw
+// any protocol errors
+void sim_finish(void) __attribute__((noreturn));
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,265 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// LittleFS smoke test for ext_flash_lfs_config(), built by "make lfs" in
+// place of the benchmarks in main/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "extflash.h"
+#include "extflash_partition.h"
+#include "extflash_lfs.h"
+
+#if !__has_include("lfs.h")
+#error "lfs.h not found, build with make LITTLEFS=<littlefs release> lfs"
+#endif
+
+#define PIN_SPI_MOSI    GPIO_NUM_23
+#define PIN_SPI_MISO    GPIO_NUM_19
+#define PIN_SPI_WP      GPIO_NUM_22
+#define PIN_SPI_HD      GPIO_NUM_21
+#define PIN_SPI_SCK     GPIO_NUM_18
+#define PIN_SPI_SS      GPIO_NUM_5
+
+#define PART_OFFSET     0x100000
+#define PART_SIZE       0x100000
+
+#define BIG_SIZE        20000       // spans several blocks
+#define SMALL_SIZE      100         // inlined in its directory entry
+
+static uint8_t big[BIG_SIZE];
+static uint8_t small[SMALL_SIZE];
+static uint8_t check[BIG_SIZE];
+
+static int write_file(lfs_t *lfs, const char *path, const uint8_t *data, size_t size, int flags)
+{
+    lfs_file_t file;
+
+    int err = lfs_file_open(lfs, &file, path, LFS_O_WRONLY | LFS_O_CREAT | flags);
+    if (err < 0)
+    {
+        return err;
+    }
+
+    lfs_ssize_t len = lfs_file_write(lfs, &file, data, size);
+
+    err = lfs_file_close(lfs, &file);
+
+    return len < 0 ? len : len != (lfs_ssize_t) size ? LFS_ERR_IO : err;
+}
+
+static int read_file(lfs_t *lfs, const char *path, const uint8_t *expect, size_t size)
+{
+    lfs_file_t file;
+
+    int err = lfs_file_open(lfs, &file, path, LFS_O_RDONLY);
+    if (err < 0)
+    {
+        return err;
+    }
+
+    memset(check, 0, size);
+
+    lfs_soff_t fsize = lfs_file_size(lfs, &file);
+    lfs_ssize_t len = lfs_file_read(lfs, &file, check, size);
+
+    err = lfs_file_close(lfs, &file);
+
+    if (fsize < 0 || len < 0)
+    {
+        return fsize < 0 ? fsize : len;
+    }
+
+    return fsize != (lfs_soff_t) size || len != (lfs_ssize_t) size || memcmp(check, expect, size) ? LFS_ERR_CORRUPT : err;
+}
+
+// Mounting the blank partition has to fail, then format, mount, write a
+// file spanning several blocks and an inlined one, and read both back after
+// a remount, after an append and after a remount of a fresh lfs_config
+static const char *smoke_test(ExtFlashPartition *part, int *result)
+{
+    struct lfs_config lfscfg = {};
+    lfs_t lfs;
+    int err;
+
+    if (ext_flash_lfs_config(part, &lfscfg) != ESP_OK)
+    {
+        *result = LFS_ERR_INVAL;
+        return "config";
+    }
+
+    if (part->erase_range(0, part->size()) != ESP_OK || part->sync() != ESP_OK)
+    {
+        *result = LFS_ERR_IO;
+        return "erase";
+    }
+
+    if ((err = lfs_mount(&lfs, &lfscfg)) == 0)
+    {
+        lfs_unmount(&lfs);
+        *result = 0;
+        return "mount blank";
+    }
+
+    if ((*result = lfs_format(&lfs, &lfscfg)) < 0)
+    {
+        return "format";
+    }
+
+    if ((*result = lfs_mount(&lfs, &lfscfg)) < 0)
+    {
+        return "mount";
+    }
+
+    if ((*result = write_file(&lfs, "big", big, BIG_SIZE, LFS_O_TRUNC)) < 0 ||
+        (*result = write_file(&lfs, "small", small, SMALL_SIZE, LFS_O_TRUNC)) < 0)
+    {
+        lfs_unmount(&lfs);
+        return "write";
+    }
+
+    if ((*result = lfs_unmount(&lfs)) < 0)
+    {
+        return "unmount";
+    }
+
+    if ((*result = lfs_mount(&lfs, &lfscfg)) < 0)
+    {
+        return "remount";
+    }
+
+    if ((*result = read_file(&lfs, "big", big, BIG_SIZE)) < 0 ||
+        (*result = read_file(&lfs, "small", small, SMALL_SIZE)) < 0)
+    {
+        lfs_unmount(&lfs);
+        return "read";
+    }
+
+    if ((*result = write_file(&lfs, "small", small, SMALL_SIZE, LFS_O_APPEND)) < 0)
+    {
+        lfs_unmount(&lfs);
+        return "append";
+    }
+
+    if ((*result = lfs_unmount(&lfs)) < 0)
+    {
+        return "unmount";
+    }
+
+    struct lfs_config fresh = {};
+    ext_flash_lfs_config(part, &fresh);
+
+    if ((*result = lfs_mount(&lfs, &fresh)) < 0)
+    {
+        return "remount";
+    }
+
+    memcpy(big, small, SMALL_SIZE);
+    memcpy(big + SMALL_SIZE, small, SMALL_SIZE);
+
+    if ((*result = read_file(&lfs, "small", big, 2 * SMALL_SIZE)) < 0)
+    {
+        lfs_unmount(&lfs);
+        return "read appended";
+    }
+
+    lfs_ssize_t used = lfs_fs_size(&lfs);
+
+    if ((*result = lfs_unmount(&lfs)) < 0)
+    {
+        return "unmount";
+    }
+
+    *result = used;
+
+    return NULL;
+}
+
+extern "C" void app_main(void *)
+{
+    printf("LITTLEFS SMOKE TEST...\n\n");
+
+    ext_flash_config_t cfg =
+    {
+        .vspi = true,
+        .sck_io_num = PIN_SPI_SCK,
+        .miso_io_num = PIN_SPI_MISO,
+        .mosi_io_num = PIN_SPI_MOSI,
+        .ss_io_num = PIN_SPI_SS,
+        .hd_io_num = PIN_SPI_HD,
+        .wp_io_num = PIN_SPI_WP,
+        .speed_mhz = 40,
+        .dma_channel = 1,
+        .queue_size = 2,
+        .max_dma_size = 8192,
+        .sector_size = 0,
+        .capacity = 0,
+        .auto_mode = false,
+        .bounce_buffers = 0,
+        .scheduler = false
+    };
+
+    ExtFlash flash;
+
+    esp_err_t err = flash.init(&cfg);
+    if (err != ESP_OK)
+    {
+        printf("initialization failed %d\n", err);
+        return;
+    }
+
+    ext_flash_partition_config_t partcfg =
+    {
+        .label = "storage",
+        .offset = PART_OFFSET,
+        .size = PART_SIZE
+    };
+
+    ExtFlashPartition part;
+
+    err = part.init(&flash, &partcfg);
+    if (err != ESP_OK)
+    {
+        printf("partition failed %d\n", err);
+        flash.term();
+        return;
+    }
+
+    for (size_t i = 0; i < BIG_SIZE; i++)
+    {
+        big[i] = i * 7 + (i >> 9);
+    }
+
+    for (size_t i = 0; i < SMALL_SIZE; i++)
+    {
+        small[i] = 'a' + i % 26;
+    }
+
+    int result;
+    const char *failed = smoke_test(ExtFlashPartition::find("storage"), &result);
+
+    if (failed)
+    {
+        printf("failed at %s, %d\n", failed, result);
+    }
+    else
+    {
+        printf("passed, %d of %d blocks used\n", result, PART_SIZE / flash.sector_size());
+    }
+
+    part.term();
+    flash.term();
+}
@@ -0,0 +1,917 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "sim_chip.h"
+
+static const char *TAG = "sim_chip";
+
+#define SR1_BUSY                            0x01
+#define SR1_WEL                             0x02
+#define SR2_QE                              0x02
+#define SR2_SUS                             0x80
+#define SR3_ADS                             0x01
+
+//
+// Cursor over the cycles the host drove.  Lines the host did not drive read
+// as 1 (they are pulled up), lines the chip does not sample are ignored and
+// either case is remembered as a width mismatch.
+//
+class sim_chip::stream
+{
+public:
+    stream(const std::vector<sim_clock_t> &clocks) : c(clocks)
+    {
+        pos = 0;
+        mismatch = false;
+    }
+
+    size_t left() const
+    {
+        return c.size() - pos;
+    }
+
+    bool take(int bits, int width, uint32_t *val)
+    {
+        size_t clocks = bits / width;
+        if (clocks > left())
+        {
+            return false;
+        }
+
+        uint32_t v = 0;
+        for (size_t i = 0; i < clocks; i++)
+        {
+            const sim_clock_t &k = c[pos++];
+            uint32_t n = k.value;
+
+            if (k.width != width)
+            {
+                mismatch = true;
+                n |= ((1 << width) - 1) & ~((1 << k.width) - 1);
+                n &= (1 << width) - 1;
+            }
+
+            v = (v << width) | n;
+        }
+
+        *val = v;
+
+        return true;
+    }
+
+    bool skip(size_t clocks)
+    {
+        if (clocks > left())
+        {
+            return false;
+        }
+
+        pos += clocks;
+
+        return true;
+    }
+
+    void bytes(int width, std::vector<uint8_t> &out)
+    {
+        uint32_t v;
+
+        while (left() >= (size_t) (8 / width))
+        {
+            take(8, width, &v);
+            out.push_back(v);
+        }
+    }
+
+    // Mode bit reset: nothing but ones on IO0
+    bool mode_reset() const
+    {
+        for (const sim_clock_t &k : c)
+        {
+            if (k.width != 1 || k.value != 1)
+            {
+                return false;
+            }
+        }
+
+        return !c.empty();
+    }
+
+    bool mismatch;
+
+private:
+    const std::vector<sim_clock_t> &c;
+    size_t pos;
+};
+
+sim_chip::sim_chip(const sim_flash_chip_t *params)
+{
+    p = *params;
+
+    mem.assign(p.capacity, 0xff);
+
+    sr1 = 0;
+    sr2 = 0;
+    sr3 = 0;
+    vwen = false;
+    qpi = false;
+    addr4 = false;
+    qpi_dummy = 2;
+    crm = 0;
+    crm_format = {};
+    last_inst = 0;
+
+    busy = BUSY_NONE;
+    busy_until = 0;
+    suspending = false;
+    suspended = BUSY_NONE;
+    suspended_ns = 0;
+    erase_addr = 0;
+    erase_size = 0;
+
+    stats = {};
+
+    build_sfdp();
+}
+
+sim_chip::~sim_chip()
+{
+}
+
+uint8_t *sim_chip::array(size_t *size)
+{
+    *size = mem.size();
+
+    return mem.data();
+}
+
+void sim_chip::error(const char *fmt, ...)
+{
+    char msg[128];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    stats.protocol_errors++;
+
+    ESP_LOGE(TAG, "%s: %s", p.name, msg);
+}
+
+void sim_chip::update(int64_t now)
+{
+    if (busy != BUSY_NONE && now >= busy_until)
+    {
+        if (suspending)
+        {
+            suspending = false;
+            suspended = busy;
+            sr2 |= SR2_SUS;
+        }
+        else
+        {
+            sr1 &= ~SR1_WEL;
+        }
+
+        busy = BUSY_NONE;
+    }
+}
+
+void sim_chip::start_busy(busy_kind_t kind, int64_t now, uint64_t ns)
+{
+    busy = kind;
+    busy_until = now + ns;
+}
+
+void sim_chip::transfer(sim_transfer_t *x)
+{
+    update(x->start_ns);
+
+    stats.transactions++;
+
+    // Nobody drives the bus unless the chip is answering
+    if (x->rx_len)
+    {
+        memset(x->rx, 0xff, x->rx_len);
+    }
+
+    stream s(x->out);
+
+    if (s.mode_reset() && x->rx_len == 0)
+    {
+        if (crm)
+        {
+            crm = 0;
+        }
+        else if (qpi && busy == BUSY_NONE)
+        {
+            qpi = false;
+        }
+        last_inst = 0xff;
+        return;
+    }
+
+    if (crm)
+    {
+        do_read(crm, &crm_format, s, x);
+        return;
+    }
+
+    uint32_t inst;
+    if (!s.take(8, qpi ? 4 : 1, &inst))
+    {
+        if (s.left() || x->rx_len)
+        {
+            error("truncated instruction");
+        }
+        return;
+    }
+
+    bool reset = (last_inst == 0x66 && inst == 0x99);
+    last_inst = inst;
+
+    if (busy != BUSY_NONE &&
+        inst != 0x05 &&
+        inst != 0x35 &&
+        inst != 0x15 &&
+        inst != 0x75)
+    {
+        stats.busy_violations++;
+        ESP_LOGE(TAG, "%s: instruction 0x%02x while busy", p.name, inst);
+        return;
+    }
+
+    if (reset)
+    {
+        qpi = false;
+        crm = 0;
+        addr4 = false;
+        vwen = false;
+        qpi_dummy = 2;
+        sr1 &= ~SR1_WEL;
+        sr2 &= ~SR2_SUS;
+        sr3 &= ~SR3_ADS;
+        suspended = BUSY_NONE;
+        return;
+    }
+
+    read_format_t f;
+    uint8_t reg;
+
+    switch (inst)
+    {
+        case 0x05:
+            if (busy != BUSY_NONE)
+            {
+                stats.status_polls++;
+            }
+            reg = (sr1 & ~SR1_BUSY) | (busy != BUSY_NONE ? SR1_BUSY : 0);
+            do_reply(&reg, 1, true, x);
+
+            // SR1 is streamed continuously, so later bytes see the operation end
+            for (size_t i = 0; busy != BUSY_NONE && !suspending && i < x->rx_len; i++)
+            {
+                if (x->rx_start_ns + (int64_t) i * x->rx_byte_ns >= busy_until)
+                {
+                    x->rx[i] &= ~(SR1_BUSY | SR1_WEL);
+                }
+            }
+        break;
+
+        case 0x35:
+            do_reply(&sr2, 1, true, x);
+        break;
+
+        case 0x15:
+            reg = (sr3 & ~SR3_ADS) | (addr4 ? SR3_ADS : 0);
+            do_reply(&reg, 1, true, x);
+        break;
+
+        case 0x01:
+            do_write_status(1, s, x);
+        break;
+
+        case 0x31:
+            do_write_status(2, s, x);
+        break;
+
+        case 0x11:
+            do_write_status(3, s, x);
+        break;
+
+        case 0x06:
+            sr1 |= SR1_WEL;
+        break;
+
+        case 0x04:
+            sr1 &= ~SR1_WEL;
+        break;
+
+        case 0x50:
+            vwen = true;
+        break;
+
+        case 0x9f:
+            do_reply(p.jedec_id, sizeof(p.jedec_id), false, x);
+        break;
+
+        case 0x5a:
+        {
+            if (qpi)
+            {
+                error("READ_SFDP in QPI mode");
+                break;
+            }
+
+            uint32_t a;
+            if (!s.take(24, 1, &a) || !s.skip(8) || s.left() || s.mismatch)
+            {
+                error("malformed READ_SFDP");
+                break;
+            }
+
+            if (x->rx_width != 1)
+            {
+                error("READ_SFDP data phase on %d lines", x->rx_width);
+            }
+
+            for (size_t i = 0; i < x->rx_len; i++)
+            {
+                x->rx[i] = (p.sfdp && a + i < sizeof(sfdp)) ? sfdp[a + i] : 0xff;
+            }
+        }
+        break;
+
+        case 0x66:
+        case 0x99:
+        break;
+
+        case 0x38:
+            if (qpi)
+            {
+                // Ignored, like the real part
+            }
+            else if ((sr2 & SR2_QE) == 0)
+            {
+                error("ENTER_QPI with QE clear");
+            }
+            else
+            {
+                qpi = true;
+            }
+        break;
+
+        case 0xff:
+            qpi = false;
+        break;
+
+        case 0xc0:
+        {
+            std::vector<uint8_t> d;
+            s.bytes(4, d);
+            if (!qpi || d.size() != 1)
+            {
+                error("malformed SET_READ_PARAMETERS");
+                break;
+            }
+            qpi_dummy = 2 + ((d[0] >> 4) & 0x03) * 2;
+        }
+        break;
+
+        case 0xb7:
+            if (p.capacity <= (1 << 24) || p.insts_4b_only)
+            {
+                error("ENTER_4B_MODE on a part without it");
+                break;
+            }
+            addr4 = true;
+        break;
+
+        case 0xe9:
+            addr4 = false;
+        break;
+
+        case 0x75:
+            if (!suspending && suspended == BUSY_NONE && (busy == BUSY_PROGRAM || busy == BUSY_ERASE))
+            {
+                suspended_ns = busy_until > x->end_ns ? busy_until - x->end_ns : 0;
+                suspending = true;
+                busy_until = x->end_ns + p.tsus_ns;
+            }
+        break;
+
+        case 0x7a:
+            if (suspended != BUSY_NONE)
+            {
+                start_busy(suspended, x->end_ns, suspended_ns);
+                suspended = BUSY_NONE;
+                sr2 &= ~SR2_SUS;
+            }
+        break;
+
+        case 0x02:
+            do_program(inst, false, qpi ? 4 : 1, s, x);
+        break;
+
+        case 0x12:
+            do_program(inst, true, qpi ? 4 : 1, s, x);
+        break;
+
+        case 0x32:
+        case 0x34:
+            if (inst == 0x34 && p.insts_4b_only)
+            {
+                error("unknown instruction 0x%02x in %s mode", inst, qpi ? "QPI" : "SPI");
+                break;
+            }
+            if (qpi)
+            {
+                error("QUAD_PAGE_PROGRAM in QPI mode");
+                break;
+            }
+            do_program(inst, inst == 0x34, 4, s, x);
+        break;
+
+        case 0x20:
+        case 0x21:
+            do_erase(inst, inst == 0x21, 4 * 1024, s, x);
+        break;
+
+        case 0x52:
+        case 0x5c:
+            do_erase(inst, inst == 0x5c, 32 * 1024, s, x);
+        break;
+
+        case 0xd8:
+        case 0xdc:
+            do_erase(inst, inst == 0xdc, 64 * 1024, s, x);
+        break;
+
+        case 0xc7:
+        case 0x60:
+            do_erase(inst, false, 0, s, x);
+        break;
+
+        default:
+            if (((inst != 0x6c && inst != 0xec) || !p.insts_4b_only) && read_format(inst, &f))
+            {
+                do_read(inst, &f, s, x);
+            }
+            else
+            {
+                error("unknown instruction 0x%02x in %s mode", inst, qpi ? "QPI" : "SPI");
+            }
+        break;
+    }
+
+    if (s.mismatch)
+    {
+        error("instruction 0x%02x sent with the wrong number of data lines", inst);
+    }
+}
+
+bool sim_chip::read_format(uint8_t inst, read_format_t *f)
+{
+    *f = {};
+
+    bool four = false;
+
+    if (qpi)
+    {
+        switch (inst)
+        {
+            case 0x0c:
+                four = true;
+            case 0x0b:
+                *f = {4, 3, false, qpi_dummy, 4, false, 0};
+            break;
+
+            case 0xec:
+                four = true;
+            case 0xeb:
+                *f = {4, 3, true, (uint8_t) (qpi_dummy - 2), 4, false, 0};
+            break;
+
+            default:
+                return false;
+        }
+    }
+    else
+    {
+        switch (inst)
+        {
+            case 0x13:
+                four = true;
+            case 0x03:
+                *f = {1, 3, false, 0, 1, false, 0};
+            break;
+
+            case 0x0c:
+                four = true;
+            case 0x0b:
+                *f = {1, 3, false, 8, 1, false, 0};
+            break;
+
+            case 0x3c:
+                four = true;
+            case 0x3b:
+                *f = {1, 3, false, 8, 2, false, 0};
+            break;
+
+            case 0x6c:
+                four = true;
+            case 0x6b:
+                *f = {1, 3, false, 8, 4, true, 0};
+            break;
+
+            case 0xbc:
+                four = true;
+            case 0xbb:
+                *f = {2, 3, true, 0, 2, false, 0};
+            break;
+
+            case 0xec:
+                four = true;
+            case 0xeb:
+                *f = {4, 3, true, 4, 4, true, 0};
+            break;
+
+            case 0xe7:
+                *f = {4, 3, true, 2, 4, true, 2};
+            break;
+
+            case 0xe3:
+                *f = {4, 3, true, 0, 4, true, 16};
+            break;
+
+            default:
+                return false;
+        }
+    }
+
+    if (four || addr4)
+    {
+        f->addr_bytes = 4;
+    }
+
+    return true;
+}
+
+void sim_chip::do_read(uint8_t inst, const read_format_t *f, stream &s, sim_transfer_t *x)
+{
+    uint32_t addr;
+    uint32_t mode = 0;
+
+    if (!s.take(f->addr_bytes * 8, f->addr_width, &addr) ||
+        (f->mode && !s.take(8, f->addr_width, &mode)) ||
+        !s.skip(f->dummy))
+    {
+        error("read 0x%02x truncated before the data phase", inst);
+        crm = 0;
+        return;
+    }
+
+    if (s.left())
+    {
+        error("read 0x%02x has %d extra clocks before the data phase", inst, (int) s.left());
+    }
+
+    if (f->needs_qe && (sr2 & SR2_QE) == 0)
+    {
+        error("read 0x%02x with QE clear", inst);
+        crm = 0;
+        return;
+    }
+
+    if (f->align && (addr % f->align) != 0)
+    {
+        error("read 0x%02x from misaligned address 0x%08x", inst, addr);
+    }
+
+    if (x->rx_len && x->rx_width != f->data_width)
+    {
+        error("read 0x%02x data phase on %d lines instead of %d", inst, x->rx_width, f->data_width);
+    }
+
+    if (f->mode)
+    {
+        crm = ((mode & 0x30) == 0x20) ? inst : 0;
+        crm_format = *f;
+    }
+
+    size_t cap = mem.size();
+    size_t a = addr % cap;
+    for (size_t i = 0; i < x->rx_len; )
+    {
+        size_t n = x->rx_len - i;
+        if (n > cap - a)
+        {
+            n = cap - a;
+        }
+
+        memcpy(&x->rx[i], &mem[a], n);
+
+        i += n;
+        a = 0;
+    }
+}
+
+void sim_chip::do_program(uint8_t inst, bool four, int width, stream &s, sim_transfer_t *x)
+{
+    uint32_t addr;
+    std::vector<uint8_t> data;
+
+    if (!s.take((four || addr4 ? 4 : 3) * 8, qpi ? 4 : 1, &addr) || x->rx_len)
+    {
+        error("malformed program 0x%02x", inst);
+        return;
+    }
+
+    s.bytes(width, data);
+
+    if (width == 4 && !qpi && (sr2 & SR2_QE) == 0)
+    {
+        error("program 0x%02x with QE clear", inst);
+        return;
+    }
+
+    // Programs are allowed while an erase is suspended, except into the
+    // block being erased
+    size_t target = addr % mem.size();
+    if (suspended == BUSY_PROGRAM ||
+        (suspended == BUSY_ERASE && (erase_size == 0 || (target >= erase_addr && target < erase_addr + erase_size))))
+    {
+        error("program 0x%02x while suspended", inst);
+        return;
+    }
+
+    if ((sr1 & SR1_WEL) == 0)
+    {
+        error("program 0x%02x without write enable", inst);
+        return;
+    }
+
+    if (data.empty())
+    {
+        sr1 &= ~SR1_WEL;
+        return;
+    }
+
+    size_t page = (addr % mem.size()) & ~0xff;
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        mem[page + ((addr + i) & 0xff)] &= data[i];
+    }
+
+    uint64_t ns = p.tbp1_ns + (uint64_t) (data.size() - 1) * p.tbp2_ns;
+    if (ns > p.tpp_ns)
+    {
+        ns = p.tpp_ns;
+    }
+
+    stats.programs++;
+    start_busy(BUSY_PROGRAM, x->end_ns, ns);
+}
+
+void sim_chip::do_erase(uint8_t inst, bool four, size_t size, stream &s, sim_transfer_t *x)
+{
+    uint32_t addr = 0;
+
+    if ((size && !s.take((four || addr4 ? 4 : 3) * 8, qpi ? 4 : 1, &addr)) || s.left() || x->rx_len)
+    {
+        error("malformed erase 0x%02x", inst);
+        return;
+    }
+
+    if (suspended != BUSY_NONE)
+    {
+        error("erase 0x%02x while suspended", inst);
+        return;
+    }
+
+    if ((sr1 & SR1_WEL) == 0)
+    {
+        error("erase 0x%02x without write enable", inst);
+        return;
+    }
+
+    uint64_t ns;
+    erase_size = size;
+    if (size == 0)
+    {
+        memset(mem.data(), 0xff, mem.size());
+        ns = p.tce_ns;
+    }
+    else
+    {
+        erase_addr = (addr % mem.size()) & ~(size - 1);
+        memset(&mem[erase_addr], 0xff, size);
+        ns = size == 4096 ? p.tse_ns : size == 32768 ? p.tbe1_ns : p.tbe2_ns;
+    }
+
+    stats.erases++;
+    start_busy(BUSY_ERASE, x->end_ns, ns);
+}
+
+void sim_chip::do_reply(const uint8_t *data, size_t len, bool repeat, sim_transfer_t *x)
+{
+    int width = qpi ? 4 : 1;
+
+    if (x->rx_len && x->rx_width != width)
+    {
+        error("reply data phase on %d lines instead of %d", x->rx_width, width);
+    }
+
+    for (size_t i = 0; i < x->rx_len; i++)
+    {
+        x->rx[i] = repeat ? data[i % len] : (i < len ? data[i] : 0x00);
+    }
+}
+
+void sim_chip::do_write_status(int reg, stream &s, sim_transfer_t *x)
+{
+    std::vector<uint8_t> d;
+
+    s.bytes(qpi ? 4 : 1, d);
+
+    if (d.empty() || x->rx_len)
+    {
+        error("malformed status register %d write", reg);
+        return;
+    }
+
+    bool wel = (sr1 & SR1_WEL) != 0;
+    if (!wel && !vwen)
+    {
+        error("status register %d write without write enable", reg);
+        return;
+    }
+    vwen = false;
+
+    switch (reg)
+    {
+        case 1:
+            sr1 = (sr1 & (SR1_BUSY | SR1_WEL)) | (d[0] & ~(SR1_BUSY | SR1_WEL));
+            if (d.size() > 1)
+            {
+                sr2 = (sr2 & SR2_SUS) | (d[1] & ~SR2_SUS);
+            }
+        break;
+
+        case 2:
+            sr2 = (sr2 & SR2_SUS) | (d[0] & ~SR2_SUS);
+        break;
+
+        case 3:
+            sr3 = (sr3 & SR3_ADS) | (d[0] & ~SR3_ADS);
+        break;
+    }
+
+    if (wel)
+    {
+        start_busy(BUSY_WRSR, x->end_ns, p.tw_ns);
+    }
+}
+
+//
+// Encode a typical time as an SFDP count/units field
+//
+static uint32_t sfdp_time(uint64_t ns, const uint64_t *units, int nunits, int count_bits)
+{
+    for (int u = 0; u < nunits; u++)
+    {
+        uint64_t count = (ns + units[u] - 1) / units[u];
+        if (count == 0)
+        {
+            count = 1;
+        }
+
+        if (count <= (1u << count_bits))
+        {
+            return (u << count_bits) | (count - 1);
+        }
+    }
+
+    return ((nunits - 1) << count_bits) | ((1 << count_bits) - 1);
+}
+
+void sim_chip::build_sfdp()
+{
+    static const uint64_t erase_units[] = {1000000, 16000000, 128000000, 1000000000};
+    static const uint64_t pp_units[] = {8000, 64000};
+    static const uint64_t byte_units[] = {1000, 8000};
+    static const uint64_t sus_units[] = {128, 1000, 8000, 64000};
+    static const uint64_t chip_units[] = {16000000ull, 256000000ull, 4000000000ull, 64000000000ull};
+
+    bool big = p.capacity > (1 << 24);
+    uint32_t bfpt[16];
+    uint32_t bait[2];
+
+    memset(sfdp, 0xff, sizeof(sfdp));
+
+    sfdp[0] = 'S';
+    sfdp[1] = 'F';
+    sfdp[2] = 'D';
+    sfdp[3] = 'P';
+    sfdp[4] = 6;                    // JESD216B
+    sfdp[5] = 1;
+    sfdp[6] = big ? 1 : 0;          // number of parameter headers - 1
+    sfdp[7] = 0xff;
+
+    // Basic flash parameter table
+    sfdp[8] = 0x00;
+    sfdp[9] = 6;
+    sfdp[10] = 1;
+    sfdp[11] = 16;
+    sfdp[12] = 0x80;
+    sfdp[13] = 0x00;
+    sfdp[14] = 0x00;
+    sfdp[15] = 0xff;
+
+    // 4-byte address instruction table
+    if (big)
+    {
+        sfdp[16] = 0x84;
+        sfdp[17] = 0;
+        sfdp[18] = 1;
+        sfdp[19] = 2;
+        sfdp[20] = 0xc0;
+        sfdp[21] = 0x00;
+        sfdp[22] = 0x00;
+        sfdp[23] = 0xff;
+    }
+
+    bfpt[0] = 0xff800000 |          // reserved
+              (1 << 22) |           // 1-1-4
+              (1 << 21) |           // 1-4-4
+              (1 << 20) |           // 1-2-2
+              ((big ? 1 : 0) << 17) |
+              (1 << 16) |           // 1-1-2
+              (0x20 << 8) |
+              0xe0 |
+              (1 << 2) |            // 64 byte or larger write granularity
+              0x01;                 // 4KB erase
+    bfpt[1] = (uint32_t) (p.capacity * 8 - 1);
+    bfpt[2] = (0x6b << 24) | (0 << 21) | (8 << 16) | (0xeb << 8) | (2 << 5) | 4;
+    bfpt[3] = (0xbb << 24) | (4 << 21) | (0 << 16) | (0x3b << 8) | (0 << 5) | 8;
+    bfpt[4] = 0xffffffee | (1 << 4);           // 4-4-4, no 2-2-2
+    bfpt[5] = 0x0000ffff;
+    bfpt[6] = (0xeb << 24) | (2 << 21) | (0 << 16) | 0xffff;
+    bfpt[7] = (0x52 << 24) | (15 << 16) | (0x20 << 8) | 12;
+    bfpt[8] = (0xd8 << 8) | 16;
+    bfpt[9] = (sfdp_time(p.tbe2_ns, erase_units, 4, 5) << 18) |
+              (sfdp_time(p.tbe1_ns, erase_units, 4, 5) << 11) |
+              (sfdp_time(p.tse_ns, erase_units, 4, 5) << 4) |
+              3;
+    bfpt[10] = (sfdp_time(p.tce_ns, chip_units, 4, 5) << 24) |
+               (sfdp_time(p.tbp2_ns, byte_units, 2, 4) << 19) |
+               (sfdp_time(p.tbp1_ns, byte_units, 2, 4) << 14) |
+               (sfdp_time(p.tpp_ns, pp_units, 2, 5) << 8) |
+               (8 << 4) |
+               2;
+    bfpt[11] = (sfdp_time(p.tsus_ns, sus_units, 4, 5) << 24);
+    bfpt[12] = 0x757a757a;
+    bfpt[13] = 0xfffffff7;
+    bfpt[14] = (4 << 20) | (1 << 9) | (1 << 4) | 0x01;
+    bfpt[15] = big ? (0x01 << 24) | (1 << 14) | (0x10 << 8) : (0x10 << 8);
+    if (p.insts_4b_only)
+    {
+        bfpt[15] = (0x20 << 24) | (1 << 14) | (0x10 << 8);
+    }
+
+    memcpy(&sfdp[0x80], bfpt, sizeof(bfpt));
+
+    if (big)
+    {
+        bait[0] = 0xfffff000 |
+                  (1 << 11) |       // erase type 3
+                  (1 << 9) |        // erase type 1
+                  0xff;             // 13h 0Ch 3Ch BCh 6Ch ECh 12h 34h
+        bait[1] = (0xff << 24) | (0xdc << 16) | (0xff << 8) | 0x21;
+
+        // Without 6Ch, ECh and 34h
+        if (p.insts_4b_only)
+        {
+            bait[0] &= ~0xb0;
+        }
+
+        memcpy(&sfdp[0xc0], bait, sizeof(bait));
+    }
+}
@@ -0,0 +1,117 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#if !defined(_SIM_CHIP_H_)
+#define _SIM_CHIP_H_ 1
+
+#include <stdint.h>
+#include <vector>
+
+#include "sim_flash.h"
+
+//
+// One SCK cycle as driven by the host: how many lines carried data and the
+// value on them (IO0 is the least significant bit)
+//
+typedef struct
+{
+    uint8_t width;
+    uint8_t value;
+} sim_clock_t;
+
+typedef struct
+{
+    std::vector<sim_clock_t> out;   // cycles driven by the host
+    int rx_width;                   // lines sampled by the host during the read phase
+    uint8_t *rx;                    // read phase data
+    size_t rx_len;
+    int64_t start_ns;               // CS asserted
+    int64_t end_ns;                 // CS deasserted
+    int64_t rx_start_ns;            // first clock of the read phase
+    int64_t rx_byte_ns;             // clocking time of one read phase byte
+} sim_transfer_t;
+
+class sim_chip
+{
+public:
+    sim_chip(const sim_flash_chip_t *params);
+    virtual ~sim_chip();
+
+    void transfer(sim_transfer_t *x);
+
+    uint8_t *array(size_t *size);
+
+    sim_flash_stats_t stats;
+
+private:
+    typedef struct
+    {
+        uint8_t addr_width;
+        uint8_t addr_bytes;
+        bool mode;
+        uint8_t dummy;              // clocks after the address (and mode) phase
+        uint8_t data_width;
+        bool needs_qe;
+        uint8_t align;              // required address alignment
+    } read_format_t;
+
+    enum busy_kind_t
+    {
+        BUSY_NONE,
+        BUSY_PROGRAM,
+        BUSY_ERASE,
+        BUSY_WRSR,
+    };
+
+    class stream;
+
+    void update(int64_t now);
+    bool read_format(uint8_t inst, read_format_t *f);
+    void do_read(uint8_t inst, const read_format_t *f, stream &s, sim_transfer_t *x);
+    void do_program(uint8_t inst, bool addr4, int width, stream &s, sim_transfer_t *x);
+    void do_erase(uint8_t inst, bool addr4, size_t size, stream &s, sim_transfer_t *x);
+    void do_reply(const uint8_t *data, size_t len, bool repeat, sim_transfer_t *x);
+    void do_write_status(int reg, stream &s, sim_transfer_t *x);
+    void start_busy(busy_kind_t kind, int64_t now, uint64_t ns);
+    void build_sfdp();
+
+    void error(const char *fmt, ...);
+
+private:
+    sim_flash_chip_t p;
+
+    std::vector<uint8_t> mem;
+    uint8_t sfdp[256];
+
+    uint8_t sr1;
+    uint8_t sr2;
+    uint8_t sr3;
+    bool vwen;
+    bool qpi;
+    bool addr4;
+    uint8_t qpi_dummy;
+    uint8_t crm;
+    read_format_t crm_format;
+    uint8_t last_inst;
+
+    busy_kind_t busy;
+    int64_t busy_until;
+    bool suspending;
+    busy_kind_t suspended;
+    int64_t suspended_ns;
+    size_t erase_addr;          // block of the last erase, 0 size = chip
+    size_t erase_size;
+};
+
+#endif
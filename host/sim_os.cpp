@@ -0,0 +1,652 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//
+// Simulated clock, logging and the bits of FreeRTOS the driver uses
+//
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <set>
+#include <vector>
+
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "rom/ets_sys.h"
+
+#include "sim_flash.h"
+
+static const char *TAG = "sim";
+
+static int64_t now_ns;
+static esp_log_level_t log_level = ESP_LOG_WARN;
+
+extern "C" void app_main(void *);
+
+int64_t sim_time_ns(void)
+{
+    return now_ns;
+}
+
+void sim_advance_ns(int64_t ns)
+{
+    if (ns > 0)
+    {
+        now_ns += ns;
+    }
+}
+
+static std::set<const void *> spiram;
+
+bool sim_ptr_dma_capable(const void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return false;
+    }
+
+    auto it = spiram.upper_bound(ptr);
+    if (it != spiram.begin())
+    {
+        const uint8_t *base = (const uint8_t *) *--it;
+        if ((const uint8_t *) ptr < base + ((const size_t *) base)[-1])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+    // Keep the size in front of the block so PSRAM lookups know its extent
+    size_t *p = (size_t *) malloc(size + 2 * sizeof(size_t));
+    if (p == NULL)
+    {
+        return NULL;
+    }
+
+    p[0] = caps;
+    p[1] = size;
+
+    if (caps & MALLOC_CAP_SPIRAM)
+    {
+        spiram.insert(&p[2]);
+    }
+
+    return &p[2];
+}
+
+void *heap_caps_calloc(size_t n, size_t size, uint32_t caps)
+{
+    void *p = heap_caps_malloc(n * size, caps);
+    if (p)
+    {
+        memset(p, 0, n * size);
+    }
+
+    return p;
+}
+
+void heap_caps_free(void *ptr)
+{
+    if (ptr)
+    {
+        spiram.erase(ptr);
+        free((size_t *) ptr - 2);
+    }
+}
+
+void sim_finish(void)
+{
+    sim_flash_stats_t s;
+
+    sim_flash_get_stats(&s);
+
+    if (getenv("EXTFLASH_SIM_STATS") || s.protocol_errors || s.busy_violations)
+    {
+        fprintf(stderr,
+                "sim: %.3f secs, %u transactions, %u polled, %llu clocks, %u dma bounces, %u status polls, "
+                "%u programs, %u erases, %u protocol errors, %u busy violations\n",
+                now_ns / 1e9,
+                s.transactions,
+                s.polled,
+                (unsigned long long) s.clocks,
+                s.dma_bounces,
+                s.status_polls,
+                s.programs,
+                s.erases,
+                s.protocol_errors,
+                s.busy_violations);
+    }
+
+    fflush(stdout);
+
+    exit(s.protocol_errors || s.busy_violations ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    switch (code)
+    {
+        case ESP_OK: return "ESP_OK";
+        case ESP_FAIL: return "ESP_FAIL";
+        case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+        case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+        case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+        case ESP_ERR_INVALID_RESPONSE: return "ESP_ERR_INVALID_RESPONSE";
+        case ESP_ERR_INVALID_CRC: return "ESP_ERR_INVALID_CRC";
+        case ESP_ERR_INVALID_VERSION: return "ESP_ERR_INVALID_VERSION";
+    }
+
+    return "UNKNOWN ERROR";
+}
+
+void _esp_error_check_failed(esp_err_t rc, const char *file, int line, const char *function, const char *expression)
+{
+    fprintf(stderr, "ESP_ERROR_CHECK failed: esp_err_t 0x%x (%s) at %s:%d\n", rc, esp_err_to_name(rc), file, line);
+    fprintf(stderr, "func: %s\nexpression: %s\n", function, expression);
+    abort();
+}
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+    log_level = level;
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+    if (level > log_level)
+    {
+        return;
+    }
+
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+}
+
+uint32_t esp_log_timestamp(void)
+{
+    return (uint32_t) (now_ns / 1000000);
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return now_ns / 1000;
+}
+
+//
+// Tasks are cooperative: the running one keeps the CPU until it blocks in
+// vTaskDelay(), on a semaphore or on an SPI transaction, yields, or wakes a
+// task of higher priority.  Timers are due once the clock has passed their
+// expiry, and their callbacks run at the next of those points.  The highest priority ready task runs next, the
+// longest ready first among equals, and when none is ready the clock jumps
+// to the earliest wake up.
+//
+struct sim_task
+{
+    const char *name;
+    UBaseType_t priority;
+    TaskFunction_t func;
+    void *arg;
+    void *stack;
+    ucontext_t context;
+    bool ready;
+    bool deleted;
+    uint32_t seq;                   // when it became ready or started waiting
+    int64_t wake_ns;                // end of its delay or timeout, or -1
+    SemaphoreHandle_t waiting;      // semaphore it is blocked on
+};
+
+static const size_t task_stack_size = 1024 * 1024;
+
+static sim_task main_task = {"main", 1};
+static sim_task *current = &main_task;
+static std::vector<sim_task *> tasks = {&main_task};
+static uint32_t task_seq;
+
+struct esp_timer
+{
+    esp_timer_cb_t callback;
+    void *arg;
+    int64_t expire_ns;              // -1 when not running
+};
+
+static std::vector<esp_timer *> timers;
+static bool dispatching;
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *out_handle)
+{
+    esp_timer *t = new esp_timer{args->callback, args->arg, -1};
+
+    timers.push_back(t);
+    *out_handle = t;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    if (timer->expire_ns >= 0)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    timer->expire_ns = now_ns + (int64_t) timeout_us * 1000;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    if (timer->expire_ns < 0)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    timer->expire_ns = -1;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    for (auto it = timers.begin(); it != timers.end(); ++it)
+    {
+        if (*it == timer)
+        {
+            timers.erase(it);
+            break;
+        }
+    }
+
+    delete timer;
+
+    return ESP_OK;
+}
+
+// Runs the callbacks of timers that are due, as the timer task would
+static void fire_timers(void)
+{
+    for (size_t i = 0; i < timers.size(); i++)
+    {
+        esp_timer *t = timers[i];
+        if (t->expire_ns >= 0 && t->expire_ns <= now_ns)
+        {
+            t->expire_ns = -1;
+            dispatching = true;
+            t->callback(t->arg);
+            dispatching = false;
+        }
+    }
+}
+
+static void (*sleep_hook)(void *arg);
+static void *sleep_arg;
+
+void sim_set_sleep_hook(void (*hook)(void *arg), void *arg)
+{
+    sleep_hook = hook;
+    sleep_arg = arg;
+}
+
+static void make_ready(sim_task *t)
+{
+    t->ready = true;
+    t->seq = task_seq++;
+    t->wake_ns = -1;
+    t->waiting = NULL;
+}
+
+static bool runs_before(sim_task *a, sim_task *b)
+{
+    return b == NULL || a->priority > b->priority || (a->priority == b->priority && (int32_t) (a->seq - b->seq) < 0);
+}
+
+static sim_task *next_ready(void)
+{
+    sim_task *next = NULL;
+
+    fire_timers();
+
+    for (sim_task *t : tasks)
+    {
+        if (!t->deleted && !t->ready && t->wake_ns >= 0 && t->wake_ns <= now_ns)
+        {
+            make_ready(t);
+        }
+    }
+
+    for (sim_task *t : tasks)
+    {
+        if (t->ready && runs_before(t, next))
+        {
+            next = t;
+        }
+    }
+
+    return next;
+}
+
+// Switch to the task that should run, which may be the current one
+static void schedule(void)
+{
+    sim_task *next;
+
+    while ((next = next_ready()) == NULL)
+    {
+        int64_t wake = -1;
+        for (sim_task *t : tasks)
+        {
+            if (!t->deleted && t->wake_ns >= 0 && (wake < 0 || t->wake_ns < wake))
+            {
+                wake = t->wake_ns;
+            }
+        }
+
+        for (esp_timer *t : timers)
+        {
+            if (t->expire_ns >= 0 && (wake < 0 || t->expire_ns < wake))
+            {
+                wake = t->expire_ns;
+            }
+        }
+
+        if (wake < 0)
+        {
+            ESP_LOGE(TAG, "deadlock: every task is blocked for good");
+            abort();
+        }
+
+        sim_advance_ns(wake - now_ns);
+    }
+
+    if (next == current)
+    {
+        next->ready = false;
+        return;
+    }
+
+    sim_task *prev = current;
+    current = next;
+    next->ready = false;
+    swapcontext(&prev->context, &next->context);
+
+    // Free the stacks of tasks that deleted themselves, now that we're off them
+    for (auto it = tasks.begin(); it != tasks.end();)
+    {
+        sim_task *t = *it;
+        if (t->deleted && t != current)
+        {
+            free(t->stack);
+            delete t;
+            it = tasks.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+// Let a task of higher priority that has become ready run now
+static void preempt(void)
+{
+    sim_task *next = next_ready();
+
+    if (next && next->priority > current->priority)
+    {
+        make_ready(current);
+        schedule();
+    }
+}
+
+static void block(int64_t wake_ns, SemaphoreHandle_t sem)
+{
+    current->ready = false;
+    current->wake_ns = wake_ns;
+    current->waiting = sem;
+    current->seq = task_seq++;
+    schedule();
+    current->waiting = NULL;
+    current->wake_ns = -1;
+}
+
+void sim_block_until_ns(int64_t wake_ns)
+{
+    block(wake_ns > now_ns ? wake_ns : now_ns, NULL);
+}
+
+static void task_start(void)
+{
+    current->func(current->arg);
+    vTaskDelete(NULL);
+}
+
+BaseType_t xTaskCreate(TaskFunction_t func, const char *name, uint32_t stack_depth, void *arg, UBaseType_t priority, TaskHandle_t *handle)
+{
+    sim_task *t = new sim_task{name, priority, func, arg};
+
+    t->stack = malloc(task_stack_size);
+    getcontext(&t->context);
+    t->context.uc_stack.ss_sp = t->stack;
+    t->context.uc_stack.ss_size = task_stack_size;
+    t->context.uc_link = NULL;
+    makecontext(&t->context, task_start, 0);
+
+    tasks.push_back(t);
+    make_ready(t);
+
+    if (handle)
+    {
+        *handle = t;
+    }
+
+    preempt();
+
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    sim_task *t = task ? task : current;
+
+    t->deleted = true;
+    t->ready = false;
+    t->wake_ns = -1;
+    t->waiting = NULL;
+
+    if (t == current)
+    {
+        schedule();
+    }
+}
+
+void vTaskDelay(const TickType_t ticks)
+{
+    if (ticks == portMAX_DELAY && current == &main_task)
+    {
+        sim_finish();
+    }
+
+    int64_t wake = ticks == portMAX_DELAY ? -1 : now_ns + (int64_t) ticks * portTICK_PERIOD_MS * 1000000;
+
+    if (sleep_hook)
+    {
+        sleep_hook(sleep_arg);
+    }
+
+    block(wake < 0 || wake > now_ns ? wake : now_ns, NULL);
+}
+
+// The task stays ready, so a yield costs the trip round the scheduler and
+// only lets tasks of the same or higher priority in
+void sim_task_yield(void)
+{
+    sim_advance_ns(1000);
+
+    sim_task *next = next_ready();
+    if (next && next->priority >= current->priority)
+    {
+        make_ready(current);
+        schedule();
+    }
+}
+
+// A busy-wait keeps the CPU, so only the clock moves
+void ets_delay_us(uint32_t us)
+{
+    sim_advance_ns((int64_t) us * 1000);
+}
+
+struct sim_semaphore
+{
+    UBaseType_t count;
+    UBaseType_t max;
+};
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return new sim_semaphore{1, 1};
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return new sim_semaphore{0, 1};
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count)
+{
+    return new sim_semaphore{initial_count, max_count};
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+    delete sem;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks_to_wait)
+{
+    int64_t timeout = ticks_to_wait == portMAX_DELAY ? -1 : now_ns + (int64_t) ticks_to_wait * portTICK_PERIOD_MS * 1000000;
+
+    while (sem->count == 0)
+    {
+        if (timeout >= 0 && now_ns >= timeout)
+        {
+            return pdFALSE;
+        }
+
+        if (sleep_hook)
+        {
+            sleep_hook(sleep_arg);
+            if (sem->count > 0)
+            {
+                break;
+            }
+        }
+
+        block(timeout, sem);
+    }
+
+    sem->count--;
+
+    return pdTRUE;
+}
+
+// Wakes the waiter of highest priority, longest waiting among equals, which
+// takes the count when it runs unless another task gets there first
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    if (sem->count == sem->max)
+    {
+        return pdFALSE;
+    }
+
+    sem->count++;
+
+    sim_task *waiter = NULL;
+    for (sim_task *t : tasks)
+    {
+        if (t->waiting == sem && !t->ready && runs_before(t, waiter))
+        {
+            waiter = t;
+        }
+    }
+
+    if (waiter)
+    {
+        make_ready(waiter);
+        if (!dispatching)
+        {
+            preempt();
+        }
+    }
+
+    return pdTRUE;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return current;
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t) (now_ns / (portTICK_PERIOD_MS * 1000000ll));
+}
+
+//
+// Benchmarks time themselves with gettimeofday(), so hand them the
+// simulated clock
+//
+int gettimeofday(struct timeval *__restrict tv, void *__restrict tz) __THROW
+{
+    tv->tv_sec = now_ns / 1000000000;
+    tv->tv_usec = (now_ns / 1000) % 1000000;
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *level = getenv("EXTFLASH_SIM_LOG");
+    if (level)
+    {
+        log_level = (esp_log_level_t) atoi(level);
+    }
+
+    main_task.wake_ns = -1;
+
+    ESP_LOGI(TAG, "simulating %s", getenv("EXTFLASH_SIM_CHIP") ? getenv("EXTFLASH_SIM_CHIP") : "w25q128");
+
+    app_main(NULL);
+
+    sim_finish();
+}
@@ -0,0 +1,538 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//
+// SPI master driver stand-in
+//
+// Every queued transaction is turned into the cycles the ESP32 would drive,
+// played against the chip on its chip select and timed:
+//
+//   queue:  the caller pays queue_ns of CPU time
+//   start:  when both the caller and the bus are ready, plus setup_ns
+//   end:    start + SCK cycles + dma_ns_per_byte for the data phase
+//   reap:   the caller waits for the end (plus wake_ns) or pays reap_ns
+//
+// Polling transactions start poll_ns after the caller and bus are ready and
+// the caller spins until they end.
+//
+// The read data is handed to the caller when the transaction is reaped, like
+// the DMA would, so reading a buffer too early shows up as stale data.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <utility>
+
+#include "esp_log.h"
+#include "driver/spi_master.h"
+
+#include "sim_chip.h"
+
+static const char *TAG = "sim_spi";
+
+typedef struct
+{
+    spi_transaction_t *trans;
+    int64_t end_ns;
+    std::vector<uint8_t> rx;
+} sim_pending_t;
+
+struct spi_device_t
+{
+    spi_host_device_t host;
+    spi_device_interface_config_t cfg;
+    std::deque<sim_pending_t> pending;
+    sim_chip *chip;
+};
+
+typedef struct
+{
+    bool initialized;
+    int dma_chan;
+    int max_transfer_sz;
+    int devices;
+    int64_t free_ns;
+} sim_bus_t;
+
+static const sim_flash_chip_t chips[] =
+{
+    {
+        "w25q32", {0xef, 0x40, 0x16}, 4 * 1024 * 1024, true,
+        30000, 2500, 700000, 10000000, 20000,
+        45000000ull, 120000000ull, 150000000ull, 10000000000ull
+    },
+    {
+        "w25q64", {0xef, 0x40, 0x17}, 8 * 1024 * 1024, true,
+        30000, 2500, 700000, 10000000, 20000,
+        45000000ull, 120000000ull, 150000000ull, 20000000000ull
+    },
+    {
+        "w25q128", {0xef, 0x40, 0x18}, 16 * 1024 * 1024, true,
+        30000, 2500, 700000, 10000000, 20000,
+        45000000ull, 120000000ull, 150000000ull, 40000000000ull
+    },
+    {
+        "w25q256", {0xef, 0x40, 0x19}, 32 * 1024 * 1024, true,
+        30000, 2500, 700000, 10000000, 20000,
+        45000000ull, 120000000ull, 150000000ull, 80000000000ull
+    },
+    {
+        "w25q256-nob7", {0xef, 0x40, 0x19}, 32 * 1024 * 1024, true,
+        30000, 2500, 700000, 10000000, 20000,
+        45000000ull, 120000000ull, 150000000ull, 80000000000ull,
+        true
+    },
+};
+
+static sim_spi_timing_t timing =
+{
+    .queue_ns = 2000,
+    .setup_ns = 25000,
+    .dma_ns_per_byte = 3,
+    .reap_ns = 1000,
+    .wake_ns = 8000,
+    .bounce_ns = 5000,
+    .poll_ns = 8000,
+};
+
+static sim_bus_t buses[3];
+static std::map<std::pair<int, int>, sim_chip *> attached;
+static sim_flash_stats_t retired;
+
+static const sim_flash_chip_t *default_chip()
+{
+    const char *name = getenv("EXTFLASH_SIM_CHIP");
+    const sim_flash_chip_t *chip = sim_flash_find_chip(name ? name : "w25q128");
+
+    if (chip == NULL)
+    {
+        ESP_LOGE(TAG, "unknown chip %s, using w25q128", name);
+        chip = sim_flash_find_chip("w25q128");
+    }
+
+    return chip;
+}
+
+const sim_flash_chip_t *sim_flash_find_chip(const char *name)
+{
+    for (const sim_flash_chip_t &c : chips)
+    {
+        if (strcmp(c.name, name) == 0)
+        {
+            return &c;
+        }
+    }
+
+    return NULL;
+}
+
+static void retire(sim_chip *chip)
+{
+    retired.transactions += chip->stats.transactions;
+    retired.clocks += chip->stats.clocks;
+    retired.bus_ns += chip->stats.bus_ns;
+    retired.dma_bounces += chip->stats.dma_bounces;
+    retired.polled += chip->stats.polled;
+    retired.status_polls += chip->stats.status_polls;
+    retired.programs += chip->stats.programs;
+    retired.erases += chip->stats.erases;
+    retired.protocol_errors += chip->stats.protocol_errors;
+    retired.busy_violations += chip->stats.busy_violations;
+}
+
+void sim_flash_attach(spi_host_device_t host, int cs_io_num, const sim_flash_chip_t *chip)
+{
+    sim_chip *&slot = attached[std::make_pair((int) host, cs_io_num)];
+
+    if (slot)
+    {
+        retire(slot);
+        delete slot;
+    }
+
+    slot = new sim_chip(chip);
+}
+
+uint8_t *sim_flash_array(spi_host_device_t host, int cs_io_num, size_t *size)
+{
+    auto it = attached.find(std::make_pair((int) host, cs_io_num));
+    if (it == attached.end())
+    {
+        *size = 0;
+        return NULL;
+    }
+
+    return it->second->array(size);
+}
+
+void sim_spi_get_timing(sim_spi_timing_t *t)
+{
+    *t = timing;
+}
+
+void sim_spi_set_timing(const sim_spi_timing_t *t)
+{
+    timing = *t;
+}
+
+void sim_flash_get_stats(sim_flash_stats_t *stats)
+{
+    *stats = retired;
+
+    for (auto &it : attached)
+    {
+        const sim_flash_stats_t &s = it.second->stats;
+
+        stats->transactions += s.transactions;
+        stats->clocks += s.clocks;
+        stats->bus_ns += s.bus_ns;
+        stats->dma_bounces += s.dma_bounces;
+        stats->polled += s.polled;
+        stats->status_polls += s.status_polls;
+        stats->programs += s.programs;
+        stats->erases += s.erases;
+        stats->protocol_errors += s.protocol_errors;
+        stats->busy_violations += s.busy_violations;
+    }
+}
+
+void sim_flash_reset_stats(void)
+{
+    retired = {};
+
+    for (auto &it : attached)
+    {
+        it.second->stats = {};
+    }
+}
+
+esp_err_t spi_bus_initialize(spi_host_device_t host, const spi_bus_config_t *bus_config, int dma_chan)
+{
+    if (host != HSPI_HOST && host != VSPI_HOST)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    sim_bus_t *bus = &buses[host];
+    if (bus->initialized)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    for (const sim_bus_t &b : buses)
+    {
+        if (dma_chan && b.initialized && b.dma_chan == dma_chan)
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+    }
+
+    bus->initialized = true;
+    bus->dma_chan = dma_chan;
+    bus->max_transfer_sz = bus_config->max_transfer_sz ? bus_config->max_transfer_sz : 64;
+    bus->devices = 0;
+    bus->free_ns = sim_time_ns();
+
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_free(spi_host_device_t host)
+{
+    sim_bus_t *bus = &buses[host];
+
+    if (!bus->initialized || bus->devices != 0)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    bus->initialized = false;
+
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_add_device(spi_host_device_t host, const spi_device_interface_config_t *dev_config, spi_device_handle_t *handle)
+{
+    sim_bus_t *bus = &buses[host];
+
+    if (!bus->initialized)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (dev_config->clock_speed_hz <= 0 || dev_config->queue_size <= 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    auto key = std::make_pair((int) host, dev_config->spics_io_num);
+    if (attached.find(key) == attached.end())
+    {
+        sim_flash_attach(host, dev_config->spics_io_num, default_chip());
+    }
+
+    spi_device_t *dev = new spi_device_t;
+    dev->host = host;
+    dev->cfg = *dev_config;
+    dev->chip = attached[key];
+
+    bus->devices++;
+
+    *handle = dev;
+
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_remove_device(spi_device_handle_t handle)
+{
+    if (!handle->pending.empty())
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    buses[handle->host].devices--;
+
+    delete handle;
+
+    return ESP_OK;
+}
+
+//
+// Lay out the cycles of a transaction the way the SPI peripheral sends them
+//
+static esp_err_t build(spi_device_t *dev, spi_transaction_t *t, sim_transfer_t *x, size_t *tx_len)
+{
+    spi_transaction_ext_t *ext = (spi_transaction_ext_t *) t;
+    uint32_t flags = t->flags;
+
+    int cmd_bits = (flags & SPI_TRANS_VARIABLE_CMD) ? ext->command_bits : dev->cfg.command_bits;
+    int addr_bits = (flags & SPI_TRANS_VARIABLE_ADDR) ? ext->address_bits : dev->cfg.address_bits;
+    int data_width = (flags & SPI_TRANS_MODE_QIO) ? 4 : (flags & SPI_TRANS_MODE_DIO) ? 2 : 1;
+    int addr_width = (flags & SPI_TRANS_MODE_DIOQIO_ADDR) ? data_width : 1;
+
+    if (addr_bits > 64 || cmd_bits > 16 || (addr_bits % addr_width) != 0 || (t->length % 8) != 0)
+    {
+        ESP_LOGE(TAG, "bad transaction: flags=0x%02x cmd_bits=%d addr_bits=%d length=%d", flags, cmd_bits, addr_bits, (int) t->length);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    for (int i = cmd_bits - 1; i >= 0; i--)
+    {
+        x->out.push_back({1, (uint8_t) ((t->cmd >> i) & 1)});
+    }
+
+    for (int i = addr_bits - addr_width; i >= 0; i -= addr_width)
+    {
+        x->out.push_back({(uint8_t) addr_width, (uint8_t) ((t->addr >> i) & ((1 << addr_width) - 1))});
+    }
+
+    const uint8_t *tx = (flags & SPI_TRANS_USE_TXDATA) ? t->tx_data : (const uint8_t *) t->tx_buffer;
+    *tx_len = t->length / 8;
+    for (size_t b = 0; b < *tx_len; b++)
+    {
+        for (int i = 8 - data_width; i >= 0; i -= data_width)
+        {
+            x->out.push_back({(uint8_t) data_width, (uint8_t) ((tx[b] >> i) & ((1 << data_width) - 1))});
+        }
+    }
+
+    x->rx_width = data_width;
+    x->rx_len = t->rxlength / 8;
+
+    return ESP_OK;
+}
+
+static bool needs_bounce(sim_bus_t *bus, spi_transaction_t *t, size_t tx_len, size_t rx_len)
+{
+    if (bus->dma_chan == 0)
+    {
+        return false;
+    }
+
+    if (tx_len && !(t->flags & SPI_TRANS_USE_TXDATA) && !sim_ptr_dma_capable(t->tx_buffer))
+    {
+        return true;
+    }
+
+    if (rx_len && !(t->flags & SPI_TRANS_USE_RXDATA) &&
+        (!sim_ptr_dma_capable(t->rx_buffer) || ((uintptr_t) t->rx_buffer % 4) != 0 || (rx_len % 4) != 0))
+    {
+        return true;
+    }
+
+    return false;
+}
+
+//
+// Play a transaction against the chip, starting setup_ns after both the
+// caller and the bus are ready
+//
+static esp_err_t run(spi_device_handle_t handle, spi_transaction_t *trans_desc, int64_t setup_ns, sim_pending_t *p)
+{
+    sim_bus_t *bus = &buses[handle->host];
+    sim_transfer_t x = {};
+    size_t tx_len;
+
+    esp_err_t err = build(handle, trans_desc, &x, &tx_len);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    if ((int) tx_len > bus->max_transfer_sz || (int) x.rx_len > bus->max_transfer_sz)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    p->trans = trans_desc;
+    p->rx.resize(x.rx_len);
+    x.rx = p->rx.data();
+
+    size_t data_len = tx_len + x.rx_len;
+    uint64_t clocks = x.out.size() + (x.rx_len * 8) / x.rx_width;
+
+    int64_t start = std::max(sim_time_ns(), bus->free_ns) + setup_ns;
+    if (needs_bounce(bus, trans_desc, tx_len, x.rx_len))
+    {
+        handle->chip->stats.dma_bounces++;
+        start += timing.bounce_ns + data_len;
+    }
+
+    int64_t bus_ns = (int64_t) (clocks * 1000000000ull / handle->cfg.clock_speed_hz) + data_len * timing.dma_ns_per_byte;
+
+    x.start_ns = start;
+    x.end_ns = start + bus_ns;
+    x.rx_start_ns = start + (int64_t) (x.out.size() * 1000000000ull / handle->cfg.clock_speed_hz);
+    x.rx_byte_ns = (int64_t) ((8 / x.rx_width) * 1000000000ull / handle->cfg.clock_speed_hz);
+    bus->free_ns = x.end_ns;
+
+    handle->chip->stats.clocks += clocks;
+    handle->chip->stats.bus_ns += bus_ns;
+    handle->chip->transfer(&x);
+
+    p->end_ns = x.end_ns;
+
+    return ESP_OK;
+}
+
+esp_err_t spi_device_queue_trans(spi_device_handle_t handle, spi_transaction_t *trans_desc, TickType_t ticks_to_wait)
+{
+    sim_pending_t p;
+
+    if ((int) handle->pending.size() >= handle->cfg.queue_size)
+    {
+        ESP_LOGE(TAG, "queue of %d transactions overflowed", handle->cfg.queue_size);
+        return ESP_ERR_TIMEOUT;
+    }
+
+    sim_advance_ns(timing.queue_ns);
+
+    esp_err_t err = run(handle, trans_desc, timing.setup_ns, &p);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    handle->pending.push_back(std::move(p));
+
+    return ESP_OK;
+}
+
+esp_err_t spi_device_get_trans_result(spi_device_handle_t handle, spi_transaction_t **trans_desc, TickType_t ticks_to_wait)
+{
+    if (handle->pending.empty())
+    {
+        if (ticks_to_wait == portMAX_DELAY)
+        {
+            ESP_LOGE(TAG, "waiting forever on an empty queue");
+            abort();
+        }
+        sim_advance_ns(timing.reap_ns);
+        return ESP_ERR_TIMEOUT;
+    }
+
+    sim_pending_t &p = handle->pending.front();
+    int64_t now = sim_time_ns();
+
+    if (p.end_ns > now)
+    {
+        if (ticks_to_wait != portMAX_DELAY &&
+            now + (int64_t) ticks_to_wait * portTICK_PERIOD_MS * 1000000 < p.end_ns)
+        {
+            sim_advance_ns(timing.reap_ns + (int64_t) ticks_to_wait * portTICK_PERIOD_MS * 1000000);
+            return ESP_ERR_TIMEOUT;
+        }
+        sim_block_until_ns(p.end_ns + timing.wake_ns);
+    }
+    else
+    {
+        sim_advance_ns(timing.reap_ns);
+    }
+
+    spi_transaction_t *t = p.trans;
+    if (!p.rx.empty())
+    {
+        memcpy((t->flags & SPI_TRANS_USE_RXDATA) ? t->rx_data : (uint8_t *) t->rx_buffer, p.rx.data(), p.rx.size());
+    }
+
+    *trans_desc = t;
+    handle->pending.pop_front();
+
+    return ESP_OK;
+}
+
+// The caller spins on the transaction instead of sleeping until an interrupt,
+// which the driver only allows with none of the device's queued ones pending
+esp_err_t spi_device_polling_transmit(spi_device_handle_t handle, spi_transaction_t *trans_desc)
+{
+    sim_pending_t p;
+
+    if (!handle->pending.empty())
+    {
+        ESP_LOGE(TAG, "polling transaction with %d queued ones pending", (int) handle->pending.size());
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t err = run(handle, trans_desc, timing.poll_ns, &p);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    handle->chip->stats.polled++;
+    sim_advance_ns(p.end_ns - sim_time_ns());
+
+    if (!p.rx.empty())
+    {
+        memcpy((trans_desc->flags & SPI_TRANS_USE_RXDATA) ? trans_desc->rx_data : (uint8_t *) trans_desc->rx_buffer, p.rx.data(), p.rx.size());
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t spi_device_transmit(spi_device_handle_t handle, spi_transaction_t *trans_desc)
+{
+    spi_transaction_t *done;
+
+    esp_err_t err = spi_device_queue_trans(handle, trans_desc, portMAX_DELAY);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    return spi_device_get_trans_result(handle, &done, portMAX_DELAY);
+}
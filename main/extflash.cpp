@@ -21,8 +21,14 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "xtensa/hal.h"
 
 #include "extflash.h"
+#include "extflash_stripe.h"
+#include "extflash_ftl.h"
+#include "extflash_log.h"
+#include "extflash_pool.h"
 #include "wb_w25q_dual.h"
 #include "wb_w25q_dio.h"
 #include "wb_w25q_quad.h"
@@ -35,13 +41,67 @@
 #define PIN_SPI_HD      GPIO_NUM_21     // PIN 7 - IO3 - /HOLD - /RESET
 #define PIN_SPI_SCK     GPIO_NUM_18     // PIN 6 - CLK - CLK
 #define PIN_SPI_SS      GPIO_NUM_5      // PIN 1 - /CS - /CS
+#define PIN_SPI_SS2     GPIO_NUM_27     // /CS of a second chip on the bus
 
+// Second chip for the stripe test
+#define PIN_HSPI_MOSI   GPIO_NUM_13
+#define PIN_HSPI_MISO   GPIO_NUM_12
+#define PIN_HSPI_WP     GPIO_NUM_2
+#define PIN_HSPI_HD     GPIO_NUM_4
+#define PIN_HSPI_SCK    GPIO_NUM_14
+#define PIN_HSPI_SS     GPIO_NUM_15
+
+#if !defined(ENABLE_READ_TEST)
 #define ENABLE_READ_TEST    1
+#endif
+
+#if !defined(ENABLE_ASYNC_READ_TEST)
+#define ENABLE_ASYNC_READ_TEST  0
+#endif
+
+#if !defined(ENABLE_WRITE_TEST)
 #define ENABLE_WRITE_TEST   0
+#endif
 
-#if ENABLE_READ_TEST
+#if !defined(ENABLE_ENCODE_TEST)
+#define ENABLE_ENCODE_TEST  0
+#endif
+
+#if !defined(ENABLE_STRIPE_TEST)
+#define ENABLE_STRIPE_TEST  0
+#endif
+
+#if !defined(ENABLE_FTL_TEST)
+#define ENABLE_FTL_TEST     0
+#endif
+
+#if !defined(ENABLE_LOG_TEST)
+#define ENABLE_LOG_TEST     0
+#endif
+
+#if !defined(ENABLE_POOL_TEST)
+#define ENABLE_POOL_TEST    0
+#endif
 
-void read_test(ExtFlash & flash, const char *name, const char *cycles)
+#if !defined(ENABLE_SMART_WRITE_TEST)
+#define ENABLE_SMART_WRITE_TEST 0
+#endif
+
+#if !defined(ENABLE_VERIFY_TEST)
+#define ENABLE_VERIFY_TEST  0
+#endif
+
+#if !defined(ENABLE_SCHEDULER_TEST)
+#define ENABLE_SCHEDULER_TEST   0
+#endif
+
+#if !defined(ENABLE_SHARED_BUS_TEST)
+#define ENABLE_SHARED_BUS_TEST  0
+#endif
+
+#if ENABLE_READ_TEST || ENABLE_ASYNC_READ_TEST
+
+void read_test(ExtFlash & flash, const char *name, const char *cycles, bool async)
 {
     for (int mhz = 10; mhz <= 80; mhz <<= 1)
     {
@@ -76,15 +136,33 @@ void read_test(ExtFlash & flash, const char *name, const char *cycles)
 
                 for (int bs = 256; bs <= sector_sz * 16; bs <<= 1)
                 {
-                    uint8_t *buf = (uint8_t *) malloc(bs);
+                    uint8_t *buf = (uint8_t *) malloc(bs * 2);
                     int bc = cap / bs;
 
                     struct timeval start;
                     gettimeofday(&start, NULL);
 
-                    for (int i = 0; i < bc; i++)
+                    if (async)
+                    {
+                        // Keep the next block in flight while the current one is "used"
+                        ext_flash_handle_t handle[2];
+
+                        flash.read_async(0, buf, bs, &handle[0]);
+                        for (int i = 1; i <= bc; i++)
+                        {
+                            if (i < bc)
+                            {
+                                flash.read_async(i * bs, buf + (i & 1) * bs, bs, &handle[i & 1]);
+                            }
+                            flash.wait(handle[(i - 1) & 1]);
+                        }
+                    }
+                    else
                     {
-                        flash.read(i * bs, buf, bs);
+                        for (int i = 0; i < bc; i++)
+                        {
+                            flash.read(i * bs, buf, bs);
+                        }
                     }
 
                     struct timeval end;
@@ -252,50 +330,1632 @@ void write_test(ExtFlash & flash, const char *name, const char *cycles)
 }
 #endif
 
-extern "C" void app_main(void *)
+#if ENABLE_STRIPE_TEST
+
+static float stripe_elapsed(struct timeval *start)
 {
+    struct timeval end;
+    gettimeofday(&end, NULL);
 
-#if ENABLE_READ_TEST
+    struct timeval elapsed;
+    timersub(&end, start, &elapsed);
 
-#define READ_TEST(c, n, b)      \
-    {                           \
-        c flash;                \
-        read_test(flash, n, b); \
+    return elapsed.tv_sec + elapsed.tv_usec / 1000000.0;
+}
+
+// Erases, writes and reads 1MB on the first chip alone and then striped
+// over both, in 64K requests, and checks the data landed on the chips a
+// stripe unit at a time
+void stripe_test(ExtFlash & flash1, ExtFlash & flash2, const char *name, const char *cycles, size_t unit)
+{
+    printf("%-5.5s  %-6.6s  %5d  ", name, cycles, unit);
+
+    ext_flash_config_t cfg1 =
+    {
+        .vspi = true,
+        .sck_io_num = PIN_SPI_SCK,
+        .miso_io_num = PIN_SPI_MISO,
+        .mosi_io_num = PIN_SPI_MOSI,
+        .ss_io_num = PIN_SPI_SS,
+        .hd_io_num = PIN_SPI_HD,
+        .wp_io_num = PIN_SPI_WP,
+        .speed_mhz = 40,
+        .dma_channel = 1,
+        .queue_size = 2,
+        .max_dma_size = 8192,
+        .sector_size = 0,
+        .capacity = 0
+    };
+
+    ext_flash_config_t cfg2 =
+    {
+        .vspi = false,
+        .sck_io_num = PIN_HSPI_SCK,
+        .miso_io_num = PIN_HSPI_MISO,
+        .mosi_io_num = PIN_HSPI_MOSI,
+        .ss_io_num = PIN_HSPI_SS,
+        .hd_io_num = PIN_HSPI_HD,
+        .wp_io_num = PIN_HSPI_WP,
+        .speed_mhz = 40,
+        .dma_channel = 2,
+        .queue_size = 2,
+        .max_dma_size = 8192,
+        .sector_size = 0,
+        .capacity = 0
+    };
+
+    const size_t total = 1024 * 1024;
+    const size_t bs = 65536;
+    uint8_t *wbuf = (uint8_t *) malloc(bs);
+    uint8_t *rbuf = (uint8_t *) malloc(bs);
+    ExtFlash *chips[] = {&flash1, &flash2};
+    ExtFlashStripe stripe;
+    ext_flash_stripe_config_t stripecfg =
+    {
+        .unit = unit
+    };
+    float secs[2][3];
+    struct timeval start;
+    bool good = true;
+
+    if (flash1.init(&cfg1) != ESP_OK || flash2.init(&cfg2) != ESP_OK || stripe.init(chips, 2, &stripecfg) != ESP_OK)
+    {
+        printf("initialization failed\n");
+        good = false;
     }
 
-    printf("READ TEST...\n\n");
-    printf("       Bus     Bus  Queue  Block  Block               \n");
-    printf("Proto  Cycles  Mhz   Size   Size  Count   Secs    MB/s\n");
+    for (size_t i = 0; i < bs; i++)
+    {
+        wbuf[i] = i * 31 + (i >> 11);
+    }
 
-    READ_TEST(ExtFlash,     "std",  "1-1-1");
-    READ_TEST(wb_w25q_dual, "dual", "1-1-2");
-    READ_TEST(wb_w25q_dio,  "dio",  "1-2-2");
-    READ_TEST(wb_w25q_quad, "quad", "1-1-4");
-    READ_TEST(wb_w25q_qio,  "qio",  "1-4-4");
-    READ_TEST(wb_w25q_qpi,  "qpi",  "4-4-4");
+    for (int s = 0; s < 2 && good; s++)
+    {
+        gettimeofday(&start, NULL);
+        good &= (s ? stripe.erase_range(0, total) : flash1.erase_range(0, total)) == ESP_OK;
+        secs[s][0] = stripe_elapsed(&start);
+
+        gettimeofday(&start, NULL);
+        for (size_t addr = 0; addr < total; addr += bs)
+        {
+            good &= (s ? stripe.write(addr, wbuf, bs) : flash1.write(addr, wbuf, bs)) == ESP_OK;
+        }
+        secs[s][1] = stripe_elapsed(&start);
+
+        gettimeofday(&start, NULL);
+        for (size_t addr = 0; addr < total; addr += bs)
+        {
+            good &= (s ? stripe.read(addr, rbuf, bs) : flash1.read(addr, rbuf, bs)) == ESP_OK;
+        }
+        secs[s][2] = stripe_elapsed(&start);
+
+        for (size_t addr = 0; addr < total && good; addr += bs)
+        {
+            good &= (s ? stripe.read(addr, rbuf, bs) : flash1.read(addr, rbuf, bs)) == ESP_OK;
+            good &= memcmp(rbuf, wbuf, bs) == 0;
+        }
+    }
+
+    // Every unit should be on the chips in turn
+    for (size_t addr = 0; addr < total && good; addr += unit)
+    {
+        size_t n = addr / unit;
+        uint8_t b;
+        good &= chips[n % 2]->read((n / 2) * unit + 7, &b, 1) == ESP_OK;
+        good &= b == wbuf[(addr + 7) % bs];
+    }
+
+    if (good)
+    {
+        printf("%5.2f  %5.2f  %6.2f  %6.2f  %5.3f  %5.3f  %6.2f  %6.2f\n",
+               secs[0][0], secs[1][0],
+               total / 1024.0 / secs[0][1], total / 1024.0 / secs[1][1],
+               secs[0][2], secs[1][2],
+               total / 1048576.0 / secs[0][2], total / 1048576.0 / secs[1][2]);
+    }
+    else
+    {
+        printf("erase/write/verify failed\n");
+    }
+
+    free(wbuf);
+    free(rbuf);
+
+    stripe.term();
+    flash2.term();
+    flash1.term();
+}
 
 #endif
 
-#if ENABLE_WRITE_TEST
+#if ENABLE_FTL_TEST
 
-#define WRITE_TEST(c, n, b)      \
-    {                            \
-        c flash;                 \
-        write_test(flash, n, b); \
+// Block contents are made from the block number and the number of times
+// it has been written, so only the counts need keeping to check them
+static void ftl_fill(uint8_t *buf, size_t size, uint32_t block, uint16_t gen)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        buf[i] = block * 7 + gen * 13 + i;
     }
+}
 
-    printf("\n");
+static bool ftl_check(ExtFlashFtl & ftl, uint16_t *gens, uint32_t blocks, uint8_t *rbuf, uint8_t *wbuf)
+{
+    size_t bs = ftl.block_size();
 
-    printf("ERASE/WRITE/VERIFY Test...\n\n"); 
-    printf("       Bus   \n");
-    printf("Proto  Cycles\n");
+    for (uint32_t b = 0; b < blocks; b++)
+    {
+        ftl_fill(wbuf, bs, b, gens[b]);
+        if (ftl.read(b * bs, rbuf, bs) != ESP_OK || memcmp(rbuf, wbuf, bs) != 0)
+        {
+            printf("verify failed at block %u\n", b);
+            return false;
+        }
+    }
 
-    WRITE_TEST(ExtFlash,     "std",  "1-1-1");
-    WRITE_TEST(wb_w25q_dual, "dual", "1-1-2");
-    WRITE_TEST(wb_w25q_dio,  "dio",  "1-2-2");
-    WRITE_TEST(wb_w25q_quad, "quad", "1-1-4");
-    WRITE_TEST(wb_w25q_qio,  "qio",  "1-4-4");
-    WRITE_TEST(wb_w25q_qpi,  "qpi",  "4-4-4");
+    return true;
+}
+
+// Fills a 64 sector FTL, rewrites random blocks, and reads it all back
+// before and after mounting it again
+void ftl_test(ExtFlash & flash, size_t spare)
+{
+    if (spare)
+    {
+        printf("%5d  ", spare);
+    }
+    else
+    {
+        printf("  def  ");
+    }
+
+    ext_flash_config_t cfg =
+    {
+        .vspi = true,
+        .sck_io_num = PIN_SPI_SCK,
+        .miso_io_num = PIN_SPI_MISO,
+        .mosi_io_num = PIN_SPI_MOSI,
+        .ss_io_num = PIN_SPI_SS,
+        .hd_io_num = PIN_SPI_HD,
+        .wp_io_num = PIN_SPI_WP,
+        .speed_mhz = 40,
+        .dma_channel = 1,
+        .queue_size = 2,
+        .max_dma_size = 8192,
+        .sector_size = 0,
+        .capacity = 0
+    };
+
+    esp_err_t err = flash.init(&cfg);
+    if (err != ESP_OK)
+    {
+        printf("initialization failed %d\n", err);
+        flash.term();
+        return;
+    }
+
+    ext_flash_ftl_config_t ftlcfg =
+    {
+        .start = 0x100000,
+        .size = 64 * flash.sector_size(),
+        .block_size = 0,
+        .spare_sectors = spare,
+        .wear_threshold = 0
+    };
+
+    flash.erase_range(ftlcfg.start, ftlcfg.size);
+
+    ExtFlashFtl ftl;
+    err = ftl.init(&flash, &ftlcfg);
+    if (err != ESP_OK)
+    {
+        printf("ftl initialization failed %d\n", err);
+        flash.term();
+        return;
+    }
+
+    const int updates = 20000;
+    size_t bs = ftl.block_size();
+    uint32_t blocks = ftl.size() / bs;
+    uint16_t *gens = (uint16_t *) calloc(blocks, sizeof(uint16_t));
+    uint8_t *rbuf = (uint8_t *) malloc(bs);
+    uint8_t *wbuf = (uint8_t *) malloc(bs);
+    bool good = true;
+
+    for (uint32_t b = 0; b < blocks && good; b++)
+    {
+        ftl_fill(wbuf, bs, b, 0);
+        good = ftl.write(b * bs, wbuf, bs) == ESP_OK;
+    }
+    ftl.reset_stats();
+
+    struct timeval start;
+    gettimeofday(&start, NULL);
+
+    srand(1);
+    for (int u = 0; u < updates && good; u++)
+    {
+        uint32_t b = rand() % blocks;
+        ftl_fill(wbuf, bs, b, ++gens[b]);
+        good = ftl.write(b * bs, wbuf, bs) == ESP_OK;
+    }
+
+    struct timeval end;
+    gettimeofday(&end, NULL);
+
+    struct timeval elapsed;
+    timersub(&end, &start, &elapsed);
+
+    ext_flash_ftl_stats_t stats;
+    ftl.get_stats(&stats);
+
+    good = good && ftl_check(ftl, gens, blocks, rbuf, wbuf);
+
+    ftl.term();
+    if (good && ftl.init(&flash, &ftlcfg) != ESP_OK)
+    {
+        printf("remount failed\n");
+        good = false;
+    }
+
+    good = good && ftl_check(ftl, gens, blocks, rbuf, wbuf);
+
+    if (good)
+    {
+        float ms = (elapsed.tv_sec * 1000000.0 + elapsed.tv_usec) / 1000.0;
+
+        printf("%6u  %6u  %7u  %6u  %4.2f  %6.3f  %4u..%u\n",
+               blocks, stats.writes, stats.relocations, stats.erases,
+               (stats.writes + stats.relocations) / (float) stats.writes,
+               ms / updates, stats.min_erases, stats.max_erases);
+    }
+
+    free(gens);
+    free(rbuf);
+    free(wbuf);
+
+    ftl.term();
+    flash.term();
+}
+
+#endif
+
+#if ENABLE_LOG_TEST
+
+#define LOG_RECORD  32
+
+static void log_fill(uint8_t *rec, uint32_t n)
+{
+    memcpy(rec, &n, sizeof(n));
+    for (int i = sizeof(n); i < LOG_RECORD; i++)
+    {
+        rec[i] = n * 7 + i;
+    }
+}
+
+// Reads the whole log, which must be consecutive records ending with last,
+// and returns how many there were or -1
+static int log_check(ExtFlashLog & log, uint32_t last, uint32_t *first)
+{
+    ext_flash_log_cursor_t cursor;
+    uint8_t rec[LOG_RECORD];
+    uint8_t want[LOG_RECORD];
+    size_t size = sizeof(rec);
+    uint32_t n = 0;
+    uint32_t prev = 0;
+    esp_err_t err;
+
+    log.rewind(&cursor);
+    while ((err = log.read(&cursor, rec, &size)) == ESP_OK)
+    {
+        uint32_t v;
+        memcpy(&v, rec, sizeof(v));
+        log_fill(want, v);
+        if (size != LOG_RECORD || memcmp(rec, want, LOG_RECORD) != 0 || (n > 0 && v != prev + 1))
+        {
+            printf("record %u after %u bad\n", v, prev);
+            return -1;
+        }
+
+        if (n == 0)
+        {
+            *first = v;
+        }
+        prev = v;
+        n++;
+        size = sizeof(rec);
+    }
+
+    if (err != ESP_ERR_NOT_FOUND || n == 0 || prev != last)
+    {
+        printf("read ended with %d after %u records, last %u\n", err, n, prev);
+        return -1;
+    }
+
+    return n;
+}
+
+// Appends enough to a 16 sector log to wrap round it, then reads it back
+// after mounting it again and after truncating it
+void log_test(wb_w25q_base & flash, const char *name, const char *cycles)
+{
+    printf("%-5.5s  %-6.6s  ", name, cycles);
+
+    ext_flash_config_t cfg =
+    {
+        .vspi = true,
+        .sck_io_num = PIN_SPI_SCK,
+        .miso_io_num = PIN_SPI_MISO,
+        .mosi_io_num = PIN_SPI_MOSI,
+        .ss_io_num = PIN_SPI_SS,
+        .hd_io_num = PIN_SPI_HD,
+        .wp_io_num = PIN_SPI_WP,
+        .speed_mhz = 40,
+        .dma_channel = 1,
+        .queue_size = 2,
+        .max_dma_size = 8192,
+        .sector_size = 0,
+        .capacity = 0
+    };
+
+    esp_err_t err = flash.init(&cfg);
+    if (err != ESP_OK)
+    {
+        printf("initialization failed %d\n", err);
+        flash.term();
+        return;
+    }
+
+    flash.set_suspend_mode(true);
+
+    ext_flash_log_config_t logcfg =
+    {
+        .start = 0x100000,
+        .size = 16 * flash.sector_size(),
+        .erase_ahead = 0,
+        .buffer_pages = 0
+    };
+
+    flash.erase_range(logcfg.start, logcfg.size);
+
+    ExtFlashLog log;
+    err = log.init(&flash, &logcfg);
+
+    const uint32_t records = 2 * logcfg.size / LOG_RECORD;
+    uint8_t rec[LOG_RECORD];
+    uint32_t appended = 0;
+
+    while (err == ESP_OK && appended < records)
+    {
+        log_fill(rec, appended);
+        if (log.append(rec, LOG_RECORD) == ESP_OK)
+        {
+            appended++;
+        }
+        else
+        {
+            err = log.service();
+            vTaskDelay(1);
+        }
+
+        if (err == ESP_OK && (appended % 16) == 0)
+        {
+            err = log.service();
+        }
+    }
+
+    if (err == ESP_OK)
+    {
+        err = log.sync();
+    }
+
+    ext_flash_log_stats_t stats;
+    log.get_stats(&stats);
+
+    uint32_t first = 0;
+    int n = err == ESP_OK ? log_check(log, records - 1, &first) : -1;
+    bool good = n > 0 && first > 0 && stats.dropped > 0;
+
+    // The same records after mounting it again
+    uint32_t first2 = 0;
+    log.term();
+    good = good && log.init(&flash, &logcfg) == ESP_OK;
+    good = good && log_check(log, records - 1, &first2) == n && first2 == first;
+
+    // Give up the older half
+    ext_flash_log_cursor_t cursor;
+    size_t size;
+    log.rewind(&cursor);
+    for (int i = 0; good && i < n / 2; i++)
+    {
+        size = sizeof(rec);
+        good = log.read(&cursor, rec, &size) == ESP_OK;
+    }
+    good = good && log.truncate(&cursor) == ESP_OK && log.sync() == ESP_OK;
+
+    int n3 = good ? log_check(log, records - 1, &first) : -1;
+    good = good && n3 > 0 && n3 < n;
+
+    uint32_t first4 = 0;
+    log.term();
+    good = good && log.init(&flash, &logcfg) == ESP_OK;
+    good = good && log_check(log, records - 1, &first4) == n3 && first4 == first;
+
+    if (good)
+    {
+        printf("%8u  %5u  %6u  %7u  %7d  %9d\n", appended, stats.pages, stats.erases, stats.dropped, n, n3);
+    }
+    else
+    {
+        printf("append/remount/truncate failed\n");
+    }
+
+    log.term();
+    flash.term();
+}
+
+#endif
+
+#if ENABLE_POOL_TEST
+
+static bool pool_blank(ExtFlash & flash, size_t addr, size_t size, uint8_t *buf)
+{
+    for (size_t a = addr; a < addr + size; a += flash.sector_size())
+    {
+        if (flash.read(a, buf, flash.sector_size()) != ESP_OK)
+        {
+            return false;
+        }
+
+        for (size_t i = 0; i < flash.sector_size(); i++)
+        {
+            if (buf[i] != 0xff)
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Discards 1MB with two sectors in it still in use and erases the rest
+// from "idle time", then compares writing sectors the usual way with
+// writing sectors handed out blank by the pool
+void pool_test(ExtFlash & flash, const char *name, const char *cycles)
+{
+    printf("%-5.5s  %-6.6s  ", name, cycles);
+
+    ext_flash_config_t cfg =
+    {
+        .vspi = true,
+        .sck_io_num = PIN_SPI_SCK,
+        .miso_io_num = PIN_SPI_MISO,
+        .mosi_io_num = PIN_SPI_MOSI,
+        .ss_io_num = PIN_SPI_SS,
+        .hd_io_num = PIN_SPI_HD,
+        .wp_io_num = PIN_SPI_WP,
+        .speed_mhz = 40,
+        .dma_channel = 1,
+        .queue_size = 2,
+        .max_dma_size = 8192,
+        .sector_size = 0,
+        .capacity = 0
+    };
+
+    esp_err_t err = flash.init(&cfg);
+    if (err != ESP_OK)
+    {
+        printf("initialization failed %d\n", err);
+        flash.term();
+        return;
+    }
+
+    const size_t start = 0x100000;
+    const size_t region = 0x100000;
+    const int count = 16;
+    size_t sector_sz = flash.sector_size();
+    uint8_t *buf = (uint8_t *) malloc(sector_sz);
+    uint8_t *wbuf = (uint8_t *) malloc(sector_sz);
+    size_t used[] = {start + 0x25000, start + 0x48000};
+    bool good = true;
+
+    for (size_t i = 0; i < sector_sz; i++)
+    {
+        wbuf[i] = i * 31 + (i >> 8);
+    }
+
+    ExtFlashPool pool;
+    ext_flash_pool_config_t poolcfg =
+    {
+        .start = start,
+        .size = 2 * region
+    };
+
+    // Something in every sector first, the pool starts out knowing nothing
+    good &= flash.erase_range(start, region) == ESP_OK;
+    good &= pool.init(&poolcfg, sector_sz) == ESP_OK && flash.set_pool(&pool) == ESP_OK;
+    for (size_t a = start; good && a < start + region; a += sector_sz)
+    {
+        good &= flash.write(a, wbuf, 16) == ESP_OK;
+    }
+
+    good &= flash.discard(start, region) == ESP_OK;
+    for (int i = 0; good && i < 2; i++)
+    {
+        good &= flash.write(used[i], wbuf, 16) == ESP_OK;
+    }
+
+    while (good && (err = flash.erase_discarded()) == ESP_OK)
+    {
+    }
+    good &= err == ESP_ERR_NOT_FOUND;
+
+    ext_flash_pool_stats_t stats;
+    pool.get_stats(&stats);
+
+    for (size_t a = start; good && a < start + region; a += sector_sz)
+    {
+        if (a == used[0] || a == used[1])
+        {
+            good &= flash.read(a, buf, 16) == ESP_OK && memcmp(buf, wbuf, 16) == 0;
+        }
+        else
+        {
+            good &= pool_blank(flash, a, sector_sz, buf);
+        }
+    }
+
+    struct timeval start_tv;
+    struct timeval end;
+    struct timeval elapsed;
+    float direct_ms = 0;
+    float pooled_ms = 0;
+
+    gettimeofday(&start_tv, NULL);
+    for (int i = 0; good && i < count; i++)
+    {
+        size_t a = start + region + i * sector_sz;
+        good &= flash.erase_sector(a / sector_sz) == ESP_OK && flash.write(a, wbuf, sector_sz) == ESP_OK;
+    }
+    gettimeofday(&end, NULL);
+    timersub(&end, &start_tv, &elapsed);
+    direct_ms = (elapsed.tv_sec * 1000000.0 + elapsed.tv_usec) / 1000.0 / count;
+
+    // Callers that erase anyway have the erase skipped
+    size_t sectors[count];
+    gettimeofday(&start_tv, NULL);
+    for (int i = 0; good && i < count; i++)
+    {
+        good &= flash.allocate_sector(&sectors[i]) == ESP_OK;
+        good &= good && flash.erase_sector(sectors[i]) == ESP_OK && flash.write(sectors[i] * sector_sz, wbuf, sector_sz) == ESP_OK;
+    }
+    gettimeofday(&end, NULL);
+    timersub(&end, &start_tv, &elapsed);
+    pooled_ms = (elapsed.tv_sec * 1000000.0 + elapsed.tv_usec) / 1000.0 / count;
+
+    for (int i = 0; good && i < count; i++)
+    {
+        good &= flash.read(sectors[i] * sector_sz, buf, sector_sz) == ESP_OK && memcmp(buf, wbuf, sector_sz) == 0;
+    }
+
+    if (good)
+    {
+        printf("%7u  %6u  %6.2f  %6.2f\n", stats.erased, stats.erases, direct_ms, pooled_ms);
+    }
+    else
+    {
+        printf("discard/erase/allocate failed\n");
+    }
+
+    free(buf);
+    free(wbuf);
+
+    flash.set_pool(NULL);
+    pool.term();
+    flash.term();
+}
+
+#endif
+
+#if ENABLE_SMART_WRITE_TEST
+
+// Times one smart_write() of the blob and checks what it skipped and that
+// the sector holds the blob and the marker after it
+static float smart_step(ExtFlash & flash, size_t addr, const uint8_t *blob, size_t size,
+                        const uint8_t *marker, size_t marker_size, uint8_t *buf,
+                        uint32_t erases_skipped, uint32_t pages_skipped, bool *good)
+{
+    ext_flash_stats_t stats;
+    struct timeval start;
+    struct timeval end;
+    struct timeval elapsed;
+
+    flash.reset_stats();
+
+    gettimeofday(&start, NULL);
+    *good &= flash.smart_write(addr, blob, size) == ESP_OK;
+    gettimeofday(&end, NULL);
+    timersub(&end, &start, &elapsed);
+
+    flash.get_stats(&stats);
+    *good &= stats.erases_skipped == erases_skipped && stats.pages_skipped == pages_skipped;
+    *good &= flash.read(addr, buf, size) == ESP_OK && memcmp(buf, blob, size) == 0;
+    *good &= flash.read(addr + size, buf, marker_size) == ESP_OK && memcmp(buf, marker, marker_size) == 0;
+
+    return (elapsed.tv_sec * 1000000.0 + elapsed.tv_usec) / 1000.0;
+}
+
+// Rewrites a 3000 byte blob unchanged, with bits only cleared and with a
+// bit set, which alone needs the sector erased
+void smart_write_test(ExtFlash & flash, const char *name, const char *cycles)
+{
+    printf("%-5.5s  %-6.6s  ", name, cycles);
+
+    ext_flash_config_t cfg =
+    {
+        .vspi = true,
+        .sck_io_num = PIN_SPI_SCK,
+        .miso_io_num = PIN_SPI_MISO,
+        .mosi_io_num = PIN_SPI_MOSI,
+        .ss_io_num = PIN_SPI_SS,
+        .hd_io_num = PIN_SPI_HD,
+        .wp_io_num = PIN_SPI_WP,
+        .speed_mhz = 40,
+        .dma_channel = 1,
+        .queue_size = 2,
+        .max_dma_size = 8192,
+        .sector_size = 0,
+        .capacity = 0
+    };
+
+    esp_err_t err = flash.init(&cfg);
+    if (err != ESP_OK)
+    {
+        printf("initialization failed %d\n", err);
+        flash.term();
+        return;
+    }
+
+    const size_t addr = 0x100000;
+    const size_t size = 3000;
+    const size_t pages = (size + flash.page_size() - 1) / flash.page_size();
+    uint8_t *blob = (uint8_t *) malloc(size);
+    uint8_t *buf = (uint8_t *) malloc(size);
+    uint8_t marker[16];
+    bool good = true;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        blob[i] = i * 13 + (i >> 7);
+    }
+    memset(marker, 0x5a, sizeof(marker));
+
+    struct timeval start;
+    struct timeval end;
+    struct timeval elapsed;
+
+    gettimeofday(&start, NULL);
+    good &= flash.erase_sector(addr / flash.sector_size()) == ESP_OK;
+    good &= flash.write(addr, blob, size) == ESP_OK;
+    gettimeofday(&end, NULL);
+    timersub(&end, &start, &elapsed);
+    good &= flash.write(addr + size, marker, sizeof(marker)) == ESP_OK;
+
+    float plain = (elapsed.tv_sec * 1000000.0 + elapsed.tv_usec) / 1000.0;
+
+    float same = smart_step(flash, addr, blob, size, marker, sizeof(marker), buf, 1, pages, &good);
+
+    blob[1000] &= 0xf0;
+    float clears = smart_step(flash, addr, blob, size, marker, sizeof(marker), buf, 1, pages - 1, &good);
+
+    // Pages past the marker are left blank by the erase
+    blob[1000] |= 0x0f;
+    size_t blank = (flash.sector_size() - size - sizeof(marker)) / flash.page_size();
+    float sets = smart_step(flash, addr, blob, size, marker, sizeof(marker), buf, 0, blank, &good);
+
+    if (good)
+    {
+        printf("%7.2f  %9.2f  %6.2f  %6.2f\n", plain, same, clears, sets);
+    }
+    else
+    {
+        printf("smart_write failed\n");
+    }
+
+    free(blob);
+    free(buf);
+
+    flash.term();
+}
+
+#endif
+
+#if ENABLE_VERIFY_TEST
+
+static float verify_elapsed(struct timeval *start)
+{
+    struct timeval end;
+    gettimeofday(&end, NULL);
+
+    struct timeval elapsed;
+    timersub(&end, start, &elapsed);
+
+    return elapsed.tv_sec + elapsed.tv_usec / 1000000.0;
+}
+
+// Checks verify(), crc32() and sha256() against the standard check values,
+// "123456789" for the CRC and FIPS 180-2's "abc", two block and million
+// 'a' messages for SHA-256.  The million 'a's run through many chunks.
+void verify_test(ExtFlash & flash, const char *name, const char *cycles)
+{
+    printf("%-5.5s  %-6.6s  ", name, cycles);
+
+    ext_flash_config_t cfg =
+    {
+        .vspi = true,
+        .sck_io_num = PIN_SPI_SCK,
+        .miso_io_num = PIN_SPI_MISO,
+        .mosi_io_num = PIN_SPI_MOSI,
+        .ss_io_num = PIN_SPI_SS,
+        .hd_io_num = PIN_SPI_HD,
+        .wp_io_num = PIN_SPI_WP,
+        .speed_mhz = 40,
+        .dma_channel = 1,
+        .queue_size = 2,
+        .max_dma_size = 8192,
+        .sector_size = 0,
+        .capacity = 0
+    };
+
+    esp_err_t err = flash.init(&cfg);
+    if (err != ESP_OK)
+    {
+        printf("initialization failed %d\n", err);
+        flash.term();
+        return;
+    }
+
+    static const char check[] = "123456789";
+    static const char abc[] = "abc";
+    static const char two[] = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    static const uint8_t abc_digest[32] =
+    {
+        0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+        0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+    };
+    static const uint8_t two_digest[32] =
+    {
+        0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8, 0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39,
+        0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67, 0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1
+    };
+    static const uint8_t million_digest[32] =
+    {
+        0xcd, 0xc7, 0x6e, 0x5c, 0x99, 0x14, 0xfb, 0x92, 0x81, 0xa1, 0xc7, 0xe2, 0x84, 0xd7, 0x3e, 0x67,
+        0xf1, 0x80, 0x9a, 0x48, 0xa4, 0x97, 0x20, 0x0e, 0x04, 0x6d, 0x39, 0xcc, 0xc7, 0x11, 0x2c, 0xd0
+    };
+
+    const size_t small = 0x100000;
+    const size_t big = 0x200000;
+    const size_t million = 1000000;
+    const size_t bs = 4096;
+    uint8_t *buf = (uint8_t *) malloc(bs * 2);
+    uint8_t digest[32];
+    uint32_t crc;
+    size_t mismatch;
+    bool good = true;
+
+    good &= flash.erase_range(small, 0x10000) == ESP_OK;
+    good &= flash.write(small, check, 9) == ESP_OK;
+    good &= flash.write(small + 256, abc, 3) == ESP_OK;
+    good &= flash.write(small + 512, two, 56) == ESP_OK;
+
+    // One call, then carried on over a second
+    crc = 0;
+    good &= flash.crc32(small, 9, &crc) == ESP_OK && crc == 0xcbf43926;
+    crc = 0;
+    good &= flash.crc32(small, 4, &crc) == ESP_OK && flash.crc32(small + 4, 5, &crc) == ESP_OK && crc == 0xcbf43926;
+
+    good &= flash.sha256(small + 256, 3, digest) == ESP_OK && memcmp(digest, abc_digest, 32) == 0;
+    good &= flash.sha256(small + 512, 56, digest) == ESP_OK && memcmp(digest, two_digest, 32) == 0;
+
+    // Equal, and a difference past the first chunk
+    for (size_t i = 0; i < bs * 2; i++)
+    {
+        buf[i] = i * 7 + (i >> 9);
+    }
+    good &= flash.write(small + 0x1000, buf, bs * 2) == ESP_OK;
+    good &= flash.verify(small + 0x1000, buf, bs * 2, &mismatch) == ESP_OK && mismatch == bs * 2;
+    buf[4321] ^= 0x10;
+    good &= flash.verify(small + 0x1000, buf, bs * 2, &mismatch) == ESP_OK && mismatch == 4321;
+
+    memset(buf, 'a', bs);
+    good &= flash.erase_range(big, (million + 0xffff) & ~0xffff) == ESP_OK;
+    for (size_t a = 0; good && a < million; a += bs)
+    {
+        good &= flash.write(big + a, buf, million - a < bs ? million - a : bs) == ESP_OK;
+    }
+
+    float secs[3] = {};
+    struct timeval start;
+    gettimeofday(&start, NULL);
+
+    good &= flash.sha256(big, million, digest) == ESP_OK && memcmp(digest, million_digest, 32) == 0;
+
+    secs[0] = verify_elapsed(&start);
+
+    // verify() of the million 'a's next to a single read() of them
+    uint8_t *image = (uint8_t *) malloc(million);
+    if (image)
+    {
+        memset(image, 'a', million);
+
+        gettimeofday(&start, NULL);
+        good &= flash.verify(big, image, million, &mismatch) == ESP_OK && mismatch == million;
+        secs[1] = verify_elapsed(&start);
+
+        gettimeofday(&start, NULL);
+        good &= flash.read(big, image, million) == ESP_OK;
+        secs[2] = verify_elapsed(&start);
+
+        for (size_t i = 0; good && i < million; i++)
+        {
+            good &= image[i] == 'a';
+        }
+
+        free(image);
+    }
+
+    if (good)
+    {
+        printf("passed, 1000000 bytes, SHA-256 %.4f secs", secs[0]);
+        if (secs[1] > 0)
+        {
+            printf(", verify %.4f secs, read %.4f secs", secs[1], secs[2]);
+        }
+        printf("\n");
+    }
+    else
+    {
+        printf("verify/crc32/sha256 failed\n");
+    }
+
+    free(buf);
+
+    flash.term();
+}
+
+#endif
+
+#if ENABLE_SCHEDULER_TEST
+
+#define SCHED_READERS   12
+#define SCHED_WRITE     65536
+#define SCHED_READ      256
+#define SCHED_ENTRIES   8
+
+typedef struct
+{
+    ExtFlash *flash;
+    int id;
+    ext_flash_priority_t priority;
+    esp_err_t err;
+} sched_task_t;
+
+static SemaphoreHandle_t sched_lock;
+static SemaphoreHandle_t sched_done;
+static SemaphoreHandle_t sched_go;
+static uint8_t *sched_buf;
+static int sched_order[SCHED_READERS];
+static int sched_finished;
+
+static void sched_writer(void *arg)
+{
+    sched_task_t *t = (sched_task_t *) arg;
+
+    t->err = t->flash->write(0, sched_buf, SCHED_WRITE);
+
+    xSemaphoreGive(sched_done);
+    vTaskDelete(NULL);
+}
+
+// Reads at its request priority and notes when it got the bus
+static void sched_reader(void *arg)
+{
+    sched_task_t *t = (sched_task_t *) arg;
+    uint8_t buf[SCHED_READ];
+    size_t off = t->id * SCHED_READ;
+
+    t->err = ESP_OK;
+    if (t->priority != EXT_FLASH_PRIORITY_DEFAULT)
+    {
+        t->err = t->flash->set_priority(t->priority);
+    }
+
+    if (t->err == ESP_OK)
+    {
+        t->err = t->flash->read(SCHED_WRITE + off, buf, SCHED_READ);
+    }
+
+    if (t->err == ESP_OK && memcmp(buf, sched_buf + off, SCHED_READ) != 0)
+    {
+        t->err = ESP_ERR_INVALID_CRC;
+    }
+
+    xSemaphoreTake(sched_lock, portMAX_DELAY);
+    sched_order[sched_finished++] = t->id;
+    xSemaphoreGive(sched_lock);
+
+    if (t->priority != EXT_FLASH_PRIORITY_DEFAULT)
+    {
+        t->flash->set_priority(EXT_FLASH_PRIORITY_DEFAULT);
+    }
+
+    xSemaphoreGive(sched_done);
+    vTaskDelete(NULL);
+}
+
+// Holds an entry with a priority until told to let go
+static void sched_holder(void *arg)
+{
+    sched_task_t *t = (sched_task_t *) arg;
+
+    t->err = t->flash->set_priority(EXT_FLASH_PRIORITY_URGENT);
+    xSemaphoreGive(sched_done);
+
+    xSemaphoreTake(sched_go, portMAX_DELAY);
+    t->flash->set_priority(EXT_FLASH_PRIORITY_DEFAULT);
+
+    xSemaphoreGive(sched_done);
+    vTaskDelete(NULL);
+}
+
+// Starts a write, queues readers behind it while it holds the bus and
+// checks they were handed the bus in the expected order
+static bool sched_round(ExtFlash & flash, const ext_flash_priority_t *priorities, const int *expect, int count)
+{
+    sched_task_t writer = {&flash, -1, EXT_FLASH_PRIORITY_DEFAULT, ESP_FAIL};
+    sched_task_t readers[SCHED_READERS];
+    bool good = true;
+
+    sched_finished = 0;
+
+    // Above this task, so the writer has the bus before the readers start
+    xTaskCreate(sched_writer, "sched_writer", 4096, &writer, 2, NULL);
+    for (int i = 0; i < count; i++)
+    {
+        readers[i] = {&flash, i, priorities[i], ESP_FAIL};
+        xTaskCreate(sched_reader, "sched_reader", 4096, &readers[i], 2, NULL);
+    }
+
+    for (int i = 0; i <= count; i++)
+    {
+        xSemaphoreTake(sched_done, portMAX_DELAY);
+    }
+
+    good &= writer.err == ESP_OK;
+    for (int i = 0; i < count; i++)
+    {
+        good &= readers[i].err == ESP_OK && sched_order[i] == expect[i];
+    }
+
+    return good;
+}
+
+// Readers with a priority each are handed the bus from a write in priority
+// order, more readers than scheduler entries are served in arrival order,
+// and afterwards every entry is free again
+void scheduler_test(ExtFlash & flash, const char *name, const char *cycles)
+{
+    printf("%-5.5s  %-6.6s  ", name, cycles);
+
+    ext_flash_config_t cfg =
+    {
+        .vspi = true,
+        .sck_io_num = PIN_SPI_SCK,
+        .miso_io_num = PIN_SPI_MISO,
+        .mosi_io_num = PIN_SPI_MOSI,
+        .ss_io_num = PIN_SPI_SS,
+        .hd_io_num = PIN_SPI_HD,
+        .wp_io_num = PIN_SPI_WP,
+        .speed_mhz = 40,
+        .dma_channel = 1,
+        .queue_size = 2,
+        .max_dma_size = 8192,
+        .sector_size = 0,
+        .capacity = 0,
+        .auto_mode = false,
+        .bounce_buffers = 0,
+        .scheduler = true
+    };
+
+    esp_err_t err = flash.init(&cfg);
+    if (err != ESP_OK)
+    {
+        printf("initialization failed %d\n", err);
+        flash.term();
+        return;
+    }
+
+    static const ext_flash_priority_t mixed[] =
+    {
+        EXT_FLASH_PRIORITY_BULK,
+        EXT_FLASH_PRIORITY_NORMAL,
+        EXT_FLASH_PRIORITY_URGENT,
+        EXT_FLASH_PRIORITY_NORMAL,
+        EXT_FLASH_PRIORITY_URGENT,
+        EXT_FLASH_PRIORITY_BULK
+    };
+    static const int mixed_order[] = {2, 4, 1, 3, 0, 5};
+    ext_flash_priority_t defaults[SCHED_READERS];
+    int arrival_order[SCHED_READERS];
+
+    for (int i = 0; i < SCHED_READERS; i++)
+    {
+        defaults[i] = EXT_FLASH_PRIORITY_DEFAULT;
+        arrival_order[i] = i;
+    }
+
+    sched_lock = xSemaphoreCreateMutex();
+    sched_done = xSemaphoreCreateCounting(SCHED_READERS + 1, 0);
+    sched_go = xSemaphoreCreateCounting(SCHED_ENTRIES, 0);
+    sched_buf = (uint8_t *) malloc(SCHED_WRITE);
+
+    for (size_t i = 0; i < SCHED_WRITE; i++)
+    {
+        sched_buf[i] = i * 13 + (i >> 8);
+    }
+
+    bool setup = flash.erase_range(0, 2 * SCHED_WRITE) == ESP_OK;
+    setup &= flash.write(SCHED_WRITE, sched_buf, SCHED_READERS * SCHED_READ) == ESP_OK;
+
+    ext_flash_stats_t stats;
+    flash.reset_stats();
+
+    bool ordered = setup && sched_round(flash, mixed, mixed_order, sizeof(mixed) / sizeof(mixed[0]));
+    bool overflow = setup && sched_round(flash, defaults, arrival_order, SCHED_READERS);
+
+    flash.get_stats(&stats);
+
+    // Every entry should be back, so as many tasks as there are can hold a
+    // priority at once, one more is refused and bad priorities are too
+    sched_task_t holders[SCHED_ENTRIES];
+    bool released = true;
+
+    for (int i = 0; i < SCHED_ENTRIES; i++)
+    {
+        holders[i] = {&flash, i, EXT_FLASH_PRIORITY_URGENT, ESP_FAIL};
+        xTaskCreate(sched_holder, "sched_holder", 4096, &holders[i], 2, NULL);
+    }
+    for (int i = 0; i < SCHED_ENTRIES; i++)
+    {
+        xSemaphoreTake(sched_done, portMAX_DELAY);
+        released &= holders[i].err == ESP_OK;
+    }
+
+    released &= flash.set_priority(EXT_FLASH_PRIORITY_URGENT) == ESP_ERR_NO_MEM;
+    released &= flash.set_priority((ext_flash_priority_t) (EXT_FLASH_PRIORITY_URGENT + 1)) == ESP_ERR_INVALID_ARG;
+
+    for (int i = 0; i < SCHED_ENTRIES; i++)
+    {
+        xSemaphoreGive(sched_go);
+    }
+    for (int i = 0; i < SCHED_ENTRIES; i++)
+    {
+        xSemaphoreTake(sched_done, portMAX_DELAY);
+    }
+
+    released &= flash.set_priority(EXT_FLASH_PRIORITY_URGENT) == ESP_OK;
+    released &= flash.set_priority(EXT_FLASH_PRIORITY_DEFAULT) == ESP_OK;
+
+    printf("%-7s  %-8s  %-8s  %8u\n",
+           ordered ? "passed" : "failed",
+           overflow ? "passed" : "failed",
+           released ? "passed" : "failed",
+           stats.handoffs);
+
+    free(sched_buf);
+    vSemaphoreDelete(sched_go);
+    vSemaphoreDelete(sched_done);
+    vSemaphoreDelete(sched_lock);
+
+    flash.term();
+}
+
+#endif
+
+#if ENABLE_SHARED_BUS_TEST
+
+#define SHARED_SIZE     (256 * 1024)
+#define SHARED_BS       65536
+
+typedef struct
+{
+    ExtFlash *flash;
+    bool erase;
+    esp_err_t err;
+} shared_task_t;
+
+static SemaphoreHandle_t shared_done;
+static uint8_t *shared_buf;
+
+static esp_err_t shared_op(ExtFlash *flash, bool erase)
+{
+    if (erase)
+    {
+        return flash->erase_range(0, SHARED_SIZE);
+    }
+
+    for (size_t addr = 0; addr < SHARED_SIZE; addr += SHARED_BS)
+    {
+        esp_err_t err = flash->write(addr, shared_buf, SHARED_BS);
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+    }
+
+    return ESP_OK;
+}
+
+static void shared_worker(void *arg)
+{
+    shared_task_t *t = (shared_task_t *) arg;
+
+    t->err = shared_op(t->flash, t->erase);
+
+    xSemaphoreGive(shared_done);
+    vTaskDelete(NULL);
+}
+
+static float shared_elapsed(struct timeval *start)
+{
+    struct timeval end;
+    gettimeofday(&end, NULL);
+
+    struct timeval elapsed;
+    timersub(&end, start, &elapsed);
+
+    return elapsed.tv_sec + elapsed.tv_usec / 1000000.0;
+}
+
+// Erases and writes 256K on each of two chips on one bus, first from one
+// task going from chip to chip and then from a task per chip, and checks
+// the data on both
+void shared_bus_test(ExtFlash & flash1, ExtFlash & flash2, const char *name, const char *cycles)
+{
+    printf("%-5.5s  %-6.6s  ", name, cycles);
+
+    ext_flash_bus_config_t buscfg =
+    {
+        .vspi = true,
+        .sck_io_num = PIN_SPI_SCK,
+        .miso_io_num = PIN_SPI_MISO,
+        .mosi_io_num = PIN_SPI_MOSI,
+        .hd_io_num = PIN_SPI_HD,
+        .wp_io_num = PIN_SPI_WP,
+        .dma_channel = 1,
+        .max_dma_size = 8192
+    };
+
+    ext_flash_config_t cfg =
+    {
+        .vspi = true,
+        .sck_io_num = PIN_SPI_SCK,
+        .miso_io_num = PIN_SPI_MISO,
+        .mosi_io_num = PIN_SPI_MOSI,
+        .ss_io_num = PIN_SPI_SS,
+        .hd_io_num = PIN_SPI_HD,
+        .wp_io_num = PIN_SPI_WP,
+        .speed_mhz = 40,
+        .dma_channel = 1,
+        .queue_size = 2,
+        .max_dma_size = 8192,
+        .sector_size = 0,
+        .capacity = 0
+    };
+
+    ExtFlashBus bus;
+    ExtFlash *chips[] = {&flash1, &flash2};
+    uint8_t *rbuf = (uint8_t *) malloc(SHARED_BS);
+    float secs[2][2];
+    struct timeval start;
+    bool good = bus.init(&buscfg) == ESP_OK;
+
+    good = good && flash1.init(&bus, &cfg) == ESP_OK;
+    cfg.ss_io_num = PIN_SPI_SS2;
+    good = good && flash2.init(&bus, &cfg) == ESP_OK;
+    if (!good)
+    {
+        printf("initialization failed\n");
+    }
+
+    shared_done = xSemaphoreCreateCounting(2, 0);
+    shared_buf = (uint8_t *) malloc(SHARED_BS);
+
+    for (size_t i = 0; i < SHARED_BS; i++)
+    {
+        shared_buf[i] = i * 29 + (i >> 10);
+    }
+
+    for (int tasks = 1; tasks <= 2 && good; tasks++)
+    {
+        for (int op = 0; op < 2; op++)
+        {
+            bool erase = op == 0;
+
+            gettimeofday(&start, NULL);
+            if (tasks == 1)
+            {
+                good &= shared_op(&flash1, erase) == ESP_OK;
+                good &= shared_op(&flash2, erase) == ESP_OK;
+            }
+            else
+            {
+                // Above this task, so both are under way before it waits
+                shared_task_t workers[2];
+                for (int c = 0; c < 2; c++)
+                {
+                    workers[c] = {chips[c], erase, ESP_FAIL};
+                    xTaskCreate(shared_worker, "shared_worker", 4096, &workers[c], 2, NULL);
+                }
+                for (int c = 0; c < 2; c++)
+                {
+                    xSemaphoreTake(shared_done, portMAX_DELAY);
+                    good &= workers[c].err == ESP_OK;
+                }
+            }
+            secs[tasks - 1][op] = shared_elapsed(&start);
+        }
+
+        for (int c = 0; c < 2 && good; c++)
+        {
+            for (size_t addr = 0; addr < SHARED_SIZE && good; addr += SHARED_BS)
+            {
+                good &= chips[c]->read(addr, rbuf, SHARED_BS) == ESP_OK;
+                good &= memcmp(rbuf, shared_buf, SHARED_BS) == 0;
+            }
+        }
+    }
+
+    if (good)
+    {
+        printf("%5.2f  %5.2f  %6.2f  %6.2f   %4.2f   %4.2f\n",
+               secs[0][0], secs[1][0],
+               2 * SHARED_SIZE / 1024.0 / secs[0][1], 2 * SHARED_SIZE / 1024.0 / secs[1][1],
+               secs[0][0] / secs[1][0], secs[0][1] / secs[1][1]);
+    }
+    else
+    {
+        printf("erase/write/verify failed\n");
+    }
+
+    free(shared_buf);
+    free(rbuf);
+    vSemaphoreDelete(shared_done);
+
+    flash2.term();
+    flash1.term();
+    bus.term();
+}
+
+#endif
+
+#if ENABLE_ENCODE_TEST
+
+// Times encoding alone, with staged cmd() calls that never reach the SPI
+// driver, taking the best of several runs so the figures don't depend on
+// whatever else the core was doing
+class encode_test : public ExtFlash
+{
+public:
+    void run(const char *name, bool qpi)
+    {
+        if (qpi)
+        {
+            qpi_enable();
+        }
+        set_1_4_4();
+
+        printf("%-5.5s", name);
+
+        for (int shape = 0; shape < 4; shape++)
+        {
+            uint32_t cycles = UINT32_MAX;
+
+            for (int run = 0; run < runs; run++)
+            {
+                uint32_t c = time_shape(shape);
+                cycles = c < cycles ? c : cycles;
+            }
+
+            printf("  %10.1f", cycles / (float) count);
+        }
+
+        printf("\n");
+
+        qpi_disable();
+        set_1_1_1();
+    }
+
+private:
+    static const int count = 100000;
+    static const int runs = 10;
+
+    uint32_t time_shape(int shape)
+    {
+        uint32_t start = xthal_get_ccount();
+
+        for (int i = 0; i < count; i++)
+        {
+            stage_begin();
+            switch (shape)
+            {
+                case 0:
+                    cmd(true, 0xeb, i << 8, 0xa0, 4, buf, sizeof(buf));
+                break;
+
+                case 1:
+                    cmd(true, CMD_FAST_READ, i << 8, 8, buf, sizeof(buf));
+                break;
+
+                case 2:
+                    cmd(false, CMD_PAGE_PROGRAM, i << 8, buf, sizeof(buf));
+                break;
+
+                case 3:
+                    cmd(true, CMD_READ_STATUS_REG1, buf, 1);
+                break;
+            }
+            stage_end();
+        }
+
+        return xthal_get_ccount() - start;
+    }
+
+    uint8_t buf[256];
+};
+
+#endif
+
+extern "C" void app_main(void *)
+{
+
+#if ENABLE_READ_TEST
+
+#define READ_TEST(c, n, b)             \
+    {                                  \
+        c flash;                       \
+        read_test(flash, n, b, false); \
+    }
+
+    printf("READ TEST...\n\n");
+    printf("       Bus     Bus  Queue  Block  Block               \n");
+    printf("Proto  Cycles  Mhz   Size   Size  Count   Secs    MB/s\n");
+
+    READ_TEST(ExtFlash,     "std",  "1-1-1");
+    READ_TEST(wb_w25q_dual, "dual", "1-1-2");
+    READ_TEST(wb_w25q_dio,  "dio",  "1-2-2");
+    READ_TEST(wb_w25q_quad, "quad", "1-1-4");
+    READ_TEST(wb_w25q_qio,  "qio",  "1-4-4");
+    READ_TEST(wb_w25q_qpi,  "qpi",  "4-4-4");
+
+#endif
+
+#if ENABLE_ASYNC_READ_TEST
+
+#define ASYNC_READ_TEST(c, n, b)      \
+    {                                 \
+        c flash;                      \
+        read_test(flash, n, b, true); \
+    }
+
+    printf("\n");
+
+    printf("ASYNC READ TEST...\n\n");
+    printf("       Bus     Bus  Queue  Block  Block               \n");
+    printf("Proto  Cycles  Mhz   Size   Size  Count   Secs    MB/s\n");
+
+    ASYNC_READ_TEST(ExtFlash,     "std",  "1-1-1");
+    ASYNC_READ_TEST(wb_w25q_dual, "dual", "1-1-2");
+    ASYNC_READ_TEST(wb_w25q_dio,  "dio",  "1-2-2");
+    ASYNC_READ_TEST(wb_w25q_quad, "quad", "1-1-4");
+    ASYNC_READ_TEST(wb_w25q_qio,  "qio",  "1-4-4");
+    ASYNC_READ_TEST(wb_w25q_qpi,  "qpi",  "4-4-4");
+
+#endif
+
+#if ENABLE_WRITE_TEST
+
+#define WRITE_TEST(c, n, b)      \
+    {                            \
+        c flash;                 \
+        write_test(flash, n, b); \
+    }
+
+    printf("\n");
+
+    printf("ERASE/WRITE/VERIFY Test...\n\n"); 
+    printf("       Bus   \n");
+    printf("Proto  Cycles\n");
+
+    WRITE_TEST(ExtFlash,     "std",  "1-1-1");
+    WRITE_TEST(wb_w25q_dual, "dual", "1-1-2");
+    WRITE_TEST(wb_w25q_dio,  "dio",  "1-2-2");
+    WRITE_TEST(wb_w25q_quad, "quad", "1-1-4");
+    WRITE_TEST(wb_w25q_qio,  "qio",  "1-4-4");
+    WRITE_TEST(wb_w25q_qpi,  "qpi",  "4-4-4");
+
+#endif
+
+#if ENABLE_STRIPE_TEST
+
+#define STRIPE_TEST(c, n, b, u)                \
+    {                                          \
+        c flash1;                              \
+        c flash2;                              \
+        stripe_test(flash1, flash2, n, b, u);  \
+    }
+
+    printf("\n");
+
+    printf("STRIPE Test...\n\n");
+    printf("       Bus     Stripe  Erase Secs      Write KB/s    Read Secs       Read MB/s\n");
+    printf("Proto  Cycles   Unit    One    Two     One     Two    One    Two     One     Two\n");
+
+    STRIPE_TEST(wb_w25q_qio, "qio", "1-4-4", 4096);
+    STRIPE_TEST(wb_w25q_qpi, "qpi", "4-4-4", 4096);
+    STRIPE_TEST(wb_w25q_qpi, "qpi", "4-4-4", 65536);
+
+#endif
+
+#if ENABLE_FTL_TEST
+
+    printf("\n");
+
+    printf("FTL Test...\n\n");
+    printf("Spare  Blocks  Writes   Moved  Erases  Ampl  ms/upd  Wear\n");
+
+    {
+        wb_w25q_qio flash;
+        ftl_test(flash, 0);
+        ftl_test(flash, 4);
+        ftl_test(flash, 8);
+        ftl_test(flash, 16);
+    }
+
+#endif
+
+#if ENABLE_LOG_TEST
+
+#define LOG_TEST(c, n, b)      \
+    {                          \
+        c flash;               \
+        log_test(flash, n, b); \
+    }
+
+    printf("\n");
+
+    printf("LOG Test...\n\n");
+    printf("       Bus                                       Records    Records\n");
+    printf("Proto  Cycles  Appended  Pages  Erases  Dropped     Kept  Truncated\n");
+
+    LOG_TEST(wb_w25q_qio, "qio", "1-4-4");
+    LOG_TEST(wb_w25q_qpi, "qpi", "4-4-4");
+
+#endif
+
+#if ENABLE_POOL_TEST
+
+#define POOL_TEST(c, n, b)      \
+    {                           \
+        c flash;                \
+        pool_test(flash, n, b); \
+    }
+
+    printf("\n");
+
+    printf("POOL Test...\n\n");
+    printf("       Bus                      ms per sector\n");
+    printf("Proto  Cycles  Erased  Erases  Direct  Pooled\n");
+
+    POOL_TEST(wb_w25q_qio, "qio", "1-4-4");
+    POOL_TEST(wb_w25q_qpi, "qpi", "4-4-4");
+
+#endif
+
+#if ENABLE_SMART_WRITE_TEST
+
+#define SMART_WRITE_TEST(c, n, b)      \
+    {                                  \
+        c flash;                       \
+        smart_write_test(flash, n, b); \
+    }
+
+    printf("\n");
+
+    printf("SMART WRITE Test...\n\n");
+    printf("       Bus     Erase+\n");
+    printf("Proto  Cycles    Write  Unchanged  Clears    Sets\n");
+
+    SMART_WRITE_TEST(ExtFlash,     "std",  "1-1-1");
+    SMART_WRITE_TEST(wb_w25q_qio,  "qio",  "1-4-4");
+    SMART_WRITE_TEST(wb_w25q_qpi,  "qpi",  "4-4-4");
+
+#endif
+
+#if ENABLE_VERIFY_TEST
+
+#define VERIFY_TEST(c, n, b)      \
+    {                             \
+        c flash;                  \
+        verify_test(flash, n, b); \
+    }
+
+    printf("\n");
+
+    printf("VERIFY/CRC32/SHA256 Test...\n\n");
+    printf("       Bus   \n");
+    printf("Proto  Cycles\n");
+
+    VERIFY_TEST(wb_w25q_qio, "qio", "1-4-4");
+    VERIFY_TEST(wb_w25q_qpi, "qpi", "4-4-4");
+
+#endif
+
+#if ENABLE_SCHEDULER_TEST
+
+#define SCHEDULER_TEST(c, n, b)      \
+    {                                \
+        c flash;                     \
+        scheduler_test(flash, n, b); \
+    }
+
+    printf("\n");
+
+    printf("SCHEDULER Test...\n\n");
+    printf("       Bus                                       Hand-\n");
+    printf("Proto  Cycles  Order    Overflow  Released      offs\n");
+
+    SCHEDULER_TEST(wb_w25q_qio, "qio", "1-4-4");
+    SCHEDULER_TEST(wb_w25q_qpi, "qpi", "4-4-4");
+
+#endif
+
+#if ENABLE_SHARED_BUS_TEST
+
+#define SHARED_BUS_TEST(c, n, b)                \
+    {                                           \
+        c flash1;                               \
+        c flash2;                               \
+        shared_bus_test(flash1, flash2, n, b);  \
+    }
+
+    printf("\n");
+
+    printf("SHARED BUS Test...\n\n");
+    printf("       Bus     Erase Secs      Write KB/s     Speed-up\n");
+    printf("Proto  Cycles   One    Two     One     Two   Erase  Write\n");
+
+    SHARED_BUS_TEST(wb_w25q_qio, "qio", "1-4-4");
+    SHARED_BUS_TEST(wb_w25q_qpi, "qpi", "4-4-4");
+
+#endif
+
+#if ENABLE_ENCODE_TEST
+
+    printf("\n");
+
+    printf("ENCODE Test...\n\n");
+    printf("       Cycles per transaction\n");
+    printf("Proto        read      read-d       write      status\n");
+
+    {
+        encode_test flash;
+        flash.run("1-4-4", false);
+        flash.run("4-4-4", true);
+    }
 
 #endif
 